@@ -3,6 +3,8 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+#include "trace.h"
 #include "vm.h"
 
 void init_chunk(Chunk* chunk) {
@@ -11,30 +13,150 @@ void init_chunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     init_varr(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
+    chunk->loop_count = 0;
+    chunk->loop_capacity = 0;
+    chunk->loops = NULL;
 }
 
-void free_chunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(size_t, chunk->lines, chunk->capacity);
-    free_varr(&chunk->constants);
+void free_chunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, size_t, chunk->lines, chunk->capacity);
+    free_varr(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cache_capacity);
+#ifdef JIT
+    for (size_t i = 0; i < chunk->loop_count; i++) {
+        trace_free(chunk->loops[i].trace);
+    }
+#endif
+    FREE_ARRAY(vm, LoopSite, chunk->loops, chunk->loop_capacity);
     init_chunk(chunk);
 }
 
-void chunk_write(Chunk* chunk, uint8_t byte, size_t line) {
+void chunk_write(VM* vm, Chunk* chunk, uint8_t byte, size_t line) {
     if (chunk->capacity < chunk->count + 1) {
         size_t old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(size_t, chunk->lines, old_capacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, size_t, chunk->lines, old_capacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
     chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
-size_t add_constant(Chunk* chunk, Value value) {
-    stack_push(value);
-    varr_write(&chunk->constants, value);
-    stack_pop();
+// Bytes per instruction, indexed by opcode. OP_CLOSURE is also followed by
+// two bytes per upvalue. Zero marks an opcode missing from the table.
+static const uint8_t instruction_lengths[] = {
+    [OP_CONSTANT]            = 2,
+    [OP_NIL]                 = 1,
+    [OP_TRUE]                = 1,
+    [OP_FALSE]               = 1,
+    [OP_POP]                 = 1,
+    [OP_DEFINE_GLOBAL]       = 3,
+    [OP_SET_GLOBAL]          = 3,
+    [OP_GET_GLOBAL]          = 3,
+    [OP_SET_LOCAL]           = 2,
+    [OP_GET_LOCAL]           = 2,
+    [OP_SET_UPVALUE]         = 2,
+    [OP_GET_UPVALUE]         = 2,
+    [OP_SET_PROPERTY]        = 4,
+    [OP_GET_PROPERTY]        = 4,
+    [OP_GET_SUPER]           = 2,
+    [OP_EQUAL]               = 1,
+    [OP_LESS]                = 1,
+    [OP_GREATER]             = 1,
+    [OP_ADD]                 = 1,
+    [OP_CONCAT]              = 2,
+    [OP_CONCAT_CHECK]        = 3,
+    [OP_SUBTRACT]            = 1,
+    [OP_MULTIPLY]            = 1,
+    [OP_DIVIDE]              = 1,
+    [OP_NEGATE]              = 1,
+    [OP_NOT]                 = 1,
+    [OP_PRINT]               = 1,
+    [OP_LOOP]                = 5,
+    [OP_JUMP]                = 3,
+    [OP_JUMP_IF_FALSE]       = 3,
+    [OP_POP_JUMP_IF_FALSE]   = 3,
+    [OP_CALL]                = 2,
+    [OP_TAIL_CALL]           = 2,
+    [OP_INVOKE]              = 5,
+    [OP_TAIL_INVOKE]         = 5,
+    [OP_SUPER_INVOKE]        = 3,
+    [OP_TAIL_SUPER_INVOKE]   = 3,
+    [OP_CLOSURE]             = 2,
+    [OP_CLOSE_UPVALUE]       = 1,
+    [OP_RETURN]              = 1,
+    [OP_CLASS]               = 2,
+    [OP_INHERIT]             = 1,
+    [OP_METHOD]              = 2,
+    [OP_GET_LOCAL_2]         = 3,
+    [OP_GET_LOCAL_CONSTANT]  = 3,
+    [OP_SET_LOCAL_POP]       = 2,
+    [OP_JUMP_IF_NOT_LESS]    = 3,
+    [OP_JUMP_IF_NOT_GREATER] = 3,
+    [OP_ADD_NUM]             = 1,
+    [OP_ADD_STR]             = 1,
+    [OP_SUBTRACT_NUM]        = 1,
+    [OP_MULTIPLY_NUM]        = 1,
+    [OP_DIVIDE_NUM]          = 1,
+    [OP_LESS_NUM]            = 1,
+    [OP_GREATER_NUM]         = 1,
+};
+
+size_t instruction_length(Chunk* chunk, size_t offset) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction >= sizeof(instruction_lengths) || instruction_lengths[instruction] == 0) {
+        // Walking on would read operands as opcodes.
+        fprintf(stderr, "[lox] error: no length for opcode %d\n", instruction);
+        abort();
+    }
+    size_t length = instruction_lengths[instruction];
+    if (instruction == OP_CLOSURE) {
+        ObjFunction* function = RAW_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        length += 2 * function->upvalue_count;
+    }
+    return length;
+}
+
+size_t add_constant(VM* vm, Chunk* chunk, Value value) {
+    stack_push(vm, value);
+    varr_write(vm, &chunk->constants, value);
+    stack_pop(vm);
     return chunk->constants.count - 1;
 }
+
+size_t add_inline_cache(VM* vm, Chunk* chunk) {
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        size_t old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cache_count];
+    cache->count = 0;
+    cache->next = 0;
+    return chunk->cache_count++;
+}
+
+size_t add_loop_site(VM* vm, Chunk* chunk) {
+    if (chunk->loop_capacity < chunk->loop_count + 1) {
+        size_t old_capacity = chunk->loop_capacity;
+        chunk->loop_capacity = GROW_CAPACITY(old_capacity);
+        chunk->loops = GROW_ARRAY(vm, LoopSite, chunk->loops, old_capacity, chunk->loop_capacity);
+    }
+    LoopSite* site = &chunk->loops[chunk->loop_count];
+    site->countdown = UINT32_MAX;
+    site->attempts = 0;
+    site->trace = NULL;
+#ifdef JIT
+    if (vm->jit_mode == JIT_MODE_FORCE) {
+        site->countdown = 1;
+    } else if (vm->jit_mode == JIT_MODE_ON) {
+        site->countdown = TRACE_HOT_LOOPS;
+    }
+#endif
+    return chunk->loop_count++;
+}
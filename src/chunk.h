@@ -23,6 +23,13 @@ typedef enum {
     OP_LESS,
     OP_GREATER,
     OP_ADD,
+    // Adds its operand's count of values left to right, in one allocation
+    // when they are all strings. The compiler emits it for chains of +.
+    OP_CONCAT,
+    // Checks the newest operands of an OP_CONCAT chain against its first,
+    // before the next operand runs. Operands: the chain's values so far and
+    // how many of the newest are unchecked.
+    OP_CONCAT_CHECK,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -32,27 +39,89 @@ typedef enum {
     OP_LOOP,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
     OP_SUPER_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    // Superinstructions emitted by the compiler's peephole pass.
+    OP_GET_LOCAL_2,
+    OP_GET_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    // Type-specialized forms that run() quickens generic opcodes into. Each
+    // one deoptimizes back to its generic form when its type guard fails.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
 } OpCode;
 
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
+
+#define INLINE_CACHE_WAYS 4
+
+// One receiver shape seen at a property access or invoke site. Fields are
+// remembered by their slot, methods by the closure they resolved to. A store
+// that adds a field also remembers the shape the instance moves to.
+typedef struct {
+    ObjShape* shape;
+    ObjShape* transition;
+    size_t slot;
+    ObjClosure* method;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry entries[INLINE_CACHE_WAYS];
+    uint8_t count;
+    uint8_t next;
+} InlineCache;
+
+typedef struct Trace Trace;
+
+// Back-edge state for one OP_LOOP, indexed by its second operand. The
+// tracing JIT records the loop once countdown reaches zero.
+typedef struct {
+    uint32_t countdown;
+    uint32_t attempts;
+    Trace* trace;
+} LoopSite;
+
 typedef struct {
     size_t count;
     size_t capacity;
     uint8_t* code;
     size_t* lines;
     ValueArray constants;
+    size_t cache_count;
+    size_t cache_capacity;
+    InlineCache* caches;
+    size_t loop_count;
+    size_t loop_capacity;
+    LoopSite* loops;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
-void free_chunk(Chunk* chunk);
-void chunk_write(Chunk* chunk, uint8_t byte, size_t line);
+void free_chunk(VM* vm, Chunk* chunk);
+void chunk_write(VM* vm, Chunk* chunk, uint8_t byte, size_t line);
+
+// The bytes taken by the instruction at offset, its operands included.
+size_t instruction_length(Chunk* chunk, size_t offset);
 
-size_t add_constant(Chunk* chunk, Value value);
+size_t add_constant(VM* vm, Chunk* chunk, Value value);
+size_t add_inline_cache(VM* vm, Chunk* chunk);
+size_t add_loop_site(VM* vm, Chunk* chunk);
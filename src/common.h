@@ -6,11 +6,28 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Everything that allocates or runs code takes the VM it belongs to, so one
+// process can host any number of independent VMs.
+typedef struct VM VM;
+
 #define UNUSED(param) __attribute__((unused))param
 
 #define NAN_BOXING
+#define COMPUTED_GOTO
+#define JIT
+
+// Dispatch through a table of labels needs GNU C's labels as values.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// The JIT emits x86-64 code that works on NaN-boxed values.
+#if defined(JIT) && !(defined(NAN_BOXING) && defined(__x86_64__) && defined(__unix__))
+#undef JIT
+#endif
 
 // #define DEBUG_LOG_GC
 // #define DEBUG_STRESS_GC
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PROFILE_OPCODES
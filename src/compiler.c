@@ -7,6 +7,7 @@
 #include "memory.h"
 #include "chunk.h"
 #include "value.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -26,7 +27,9 @@ typedef enum {
     PREC_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+typedef struct Parser Parser;
+
+typedef void (*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct {
     ParseFn prefix;
@@ -34,13 +37,6 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-typedef struct {
-    Token previous;
-    Token current;
-    bool had_error;
-    bool panic_mode;
-} Parser;
-
 typedef struct {
     Token name;
     int depth;
@@ -67,6 +63,8 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     size_t local_count;
     size_t scope_depth;
+    int last_instruction;
+    size_t last_target;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -75,36 +73,47 @@ typedef struct ClassCompiler {
     bool has_superclass;
 } ClassCompiler;
 
-Parser parser;  // singleton
-Compiler* current = NULL;
-ClassCompiler* current_class = NULL;
+// The state of one compilation. The VM points at it while it runs, so the GC
+// can find the functions being compiled.
+struct Parser {
+    VM* vm;
+    Scanner scanner;
+    Token previous;
+    Token current;
+    bool had_error;
+    bool panic_mode;
+    Compiler* compiler;
+    ClassCompiler* klass;
+};
 
 // forward declarations
-static void expression();
-static void statement();
-static void declaration();
-static void var_declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
+static void var_declaration(Parser* parser);
 static ParseRule* get_rule(TokenType type);
-static void parse_precedence(Precedence precedence);
+static void parse_precedence(Parser* parser, Precedence precedence);
 
-static Chunk* current_chunk() {
-    return &current->function->chunk;
+static Chunk* current_chunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
-static void init_compiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void init_compiler(Parser* parser, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
-    current = compiler;
+    compiler->last_instruction = -1;
+    compiler->last_target = 0;
+    compiler->function = new_function(parser->vm);
+    parser->compiler = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = copy_string(parser->vm, parser->previous.start, parser->previous.length);
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     local->is_captured = false;
     if (type != TYPE_FUNCTION) {
@@ -116,11 +125,11 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     }
 }
 
-static void report_error(Token* token, const char* message) {
-    if (parser.panic_mode) {
+static void report_error(Parser* parser, Token* token, const char* message) {
+    if (parser->panic_mode) {
         return;
     }
-    parser.panic_mode = true;
+    parser->panic_mode = true;
     fprintf(stderr, "[line %zu] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -132,185 +141,408 @@ static void report_error(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    parser->had_error = true;
 }
 
-static void error(const char* message) {
-    report_error(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    report_error(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char* message) {
-    report_error(&parser.current, message);
+static void error_at_current(Parser* parser, const char* message) {
+    report_error(parser, &parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
     while (true) {
-        parser.current = scan_token();
-        if (parser.current.type != TOKEN_ERR) {
+        parser->current = scan_token(&parser->scanner);
+        if (parser->current.type != TOKEN_ERR) {
             break;
         }
-        error_at_current(parser.current.start);
+        error_at_current(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
-    error_at_current(message);
+    error_at_current(parser, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-    if (check(type)) {
-        advance();
+static bool match(Parser* parser, TokenType type) {
+    if (check(parser, type)) {
+        advance(parser);
         return true;
     } else {
         return false;
     }
 }
 
-static uint8_t make_constant(Value value) {
-    size_t idx = add_constant(current_chunk(), value);
+static uint8_t make_constant(Parser* parser, Value value) {
+    size_t idx = add_constant(parser->vm, current_chunk(parser), value);
     if (idx > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t) idx;
 }
 
-static void emit_byte(uint8_t opcode) {
-    chunk_write(current_chunk(), opcode, parser.previous.line);
+static void emit_byte(Parser* parser, uint8_t byte) {
+    chunk_write(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2) {
-    emit_byte(byte1);
-    emit_byte(byte2);
+// Superinstructions: the pairs below are the most frequent ones in our
+// benchmark corpus (see DEBUG_PROFILE_OPCODES), so instead of emitting the
+// second instruction we rewrite the previous one into a fused opcode. Fusing
+// is only safe when no jump lands between the two instructions.
+static uint8_t* fusable_instruction(Parser* parser) {
+    if (parser->compiler->last_instruction == -1
+            || parser->compiler->last_target == current_chunk(parser)->count) {
+        return NULL;
+    }
+    return &current_chunk(parser)->code[parser->compiler->last_instruction];
 }
 
-static void emit_constant(Value value) {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+static void emit_op(Parser* parser, uint8_t op) {
+    uint8_t* last = fusable_instruction(parser);
+    if (last != NULL && op == OP_POP && *last == OP_SET_LOCAL) {
+        *last = OP_SET_LOCAL_POP;
+        return;
+    }
+    parser->compiler->last_instruction = current_chunk(parser)->count;
+    emit_byte(parser, op);
 }
 
-static void emit_return() {
-    if (current->type == TYPE_INITIALIZER) {
-        emit_bytes(OP_GET_LOCAL, 0);
+static void emit_bytes(Parser* parser, uint8_t op, uint8_t operand) {
+    uint8_t* last = fusable_instruction(parser);
+    if (last != NULL && *last == OP_GET_LOCAL) {
+        if (op == OP_GET_LOCAL) {
+            *last = OP_GET_LOCAL_2;
+            emit_byte(parser, operand);
+            return;
+        } else if (op == OP_CONSTANT) {
+            *last = OP_GET_LOCAL_CONSTANT;
+            emit_byte(parser, operand);
+            return;
+        }
+    }
+    emit_op(parser, op);
+    emit_byte(parser, operand);
+}
+
+static void emit_inline_cache(Parser* parser) {
+    size_t idx = add_inline_cache(parser->vm, current_chunk(parser));
+    if (idx > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk.");
+    }
+    emit_byte(parser, (idx >> 8) & 0xff);
+    emit_byte(parser, idx & 0xff);
+}
+
+static void emit_global(Parser* parser, OpCode op, uint16_t slot) {
+    emit_op(parser, op);
+    emit_byte(parser, (slot >> 8) & 0xff);
+    emit_byte(parser, slot & 0xff);
+}
+
+static void emit_constant(Parser* parser, Value value) {
+    emit_bytes(parser, OP_CONSTANT, make_constant(parser, value));
+}
+
+static void emit_return(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emit_bytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emit_byte(OP_NIL);
+        emit_op(parser, OP_NIL);
     }
-    emit_byte(OP_RETURN);
+    emit_op(parser, OP_RETURN);
+}
+
+static size_t mark_jump_target(Parser* parser) {
+    parser->compiler->last_target = current_chunk(parser)->count;
+    return parser->compiler->last_target;
 }
 
-static void emit_loop(size_t loop_start) {
-    emit_byte(OP_LOOP);
+static void emit_loop(Parser* parser, size_t loop_start) {
+    emit_op(parser, OP_LOOP);
 
-    size_t offset = current_chunk()->count - loop_start + 2;
+    size_t offset = current_chunk(parser)->count - loop_start + 4;
     if (offset > UINT16_MAX) {
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
     }
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_byte(parser, (offset >> 8) & 0xff);
+    emit_byte(parser, offset & 0xff);
+
+    size_t idx = add_loop_site(parser->vm, current_chunk(parser));
+    if (idx > UINT16_MAX) {
+        error(parser, "Too many loops in one chunk.");
+    }
+    emit_byte(parser, (idx >> 8) & 0xff);
+    emit_byte(parser, idx & 0xff);
 }
 
-static size_t emit_jump(uint8_t instruction) {
-    emit_byte(instruction);
-    emit_byte(0xff);
-    emit_byte(0xff);
-    return current_chunk()->count - 2;
+static size_t emit_jump(Parser* parser, uint8_t instruction) {
+    // Compare-and-branch: fold a preceding comparison into the jump.
+    uint8_t* last = fusable_instruction(parser);
+    if (last != NULL && instruction == OP_POP_JUMP_IF_FALSE && *last == OP_LESS) {
+        *last = OP_JUMP_IF_NOT_LESS;
+    } else if (last != NULL && instruction == OP_POP_JUMP_IF_FALSE && *last == OP_GREATER) {
+        *last = OP_JUMP_IF_NOT_GREATER;
+    } else {
+        emit_op(parser, instruction);
+    }
+    emit_byte(parser, 0xff);
+    emit_byte(parser, 0xff);
+    return current_chunk(parser)->count - 2;
 }
 
-static void patch_jump(size_t offset) {
-    size_t jump = current_chunk()->count - offset - 2;
+static void patch_jump(Parser* parser, size_t offset) {
+    size_t jump = current_chunk(parser)->count - offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+    current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    current_chunk(parser)->code[offset + 1] = jump & 0xff;
+    mark_jump_target(parser);
 }
 
-static void begin_scope() {
-    current->scope_depth++;
+static void begin_scope(Parser* parser) {
+    parser->compiler->scope_depth++;
 }
 
-static void end_scope() {
-    current->scope_depth--;
-    while (current->local_count > 0 &&
-            current->locals[current->local_count - 1].depth > (int)current->scope_depth) {
-        if (current->locals[current->local_count - 1].is_captured) {
-            emit_byte(OP_CLOSE_UPVALUE);
+static void end_scope(Parser* parser) {
+    parser->compiler->scope_depth--;
+    while (parser->compiler->local_count > 0 &&
+            parser->compiler->locals[parser->compiler->local_count - 1].depth > (int)parser->compiler->scope_depth) {
+        if (parser->compiler->locals[parser->compiler->local_count - 1].is_captured) {
+            emit_op(parser, OP_CLOSE_UPVALUE);
         } else {
-            emit_byte(OP_POP);
+            emit_op(parser, OP_POP);
+        }
+        parser->compiler->local_count--;
+    }
+}
+
+// Walks the finished code adding up each instruction's effect on the stack.
+// Code after a jump starts at the depth the jump left it at, which holds
+// because every statement leaves the stack as it found it.
+static size_t max_stack_depth(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    // The callee and its arguments are already there.
+    long depth = (long)function->arity + 1;
+    long max = depth;
+    for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t* code = &chunk->code[offset];
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_CLOSURE:
+            case OP_CLASS:
+                depth += 1;
+                break;
+            case OP_GET_LOCAL_2:
+            case OP_GET_LOCAL_CONSTANT:
+                depth += 2;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_LOCAL:
+            case OP_SET_UPVALUE:
+            case OP_GET_PROPERTY:
+            case OP_NEGATE:
+            case OP_NOT:
+            case OP_LOOP:
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_CONCAT_CHECK:
+                break;
+            case OP_POP:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_PRINT:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_CLOSE_UPVALUE:
+            case OP_RETURN:
+            case OP_INHERIT:
+            case OP_METHOD:
+            case OP_SET_LOCAL_POP:
+                depth -= 1;
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER:
+                depth -= 2;
+                break;
+            case OP_CONCAT:
+                depth += 1 - (long)code[1];
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                depth -= code[1];
+                break;
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                depth -= code[2];
+                break;
+            case OP_SUPER_INVOKE:
+            case OP_TAIL_SUPER_INVOKE:
+                depth -= code[2] + 1;
+                break;
+            default:
+                // A guess here would reserve too little stack for calls.
+                fprintf(stderr, "[lox] error: no stack effect for opcode %d\n", code[0]);
+                abort();
+        }
+        if (depth > max) {
+            max = depth;
         }
-        current->local_count--;
     }
+    return (size_t)max;
 }
 
-static ObjFunction* end_compiler() {
-    emit_return();
-    ObjFunction* function = current->function;
+static ObjFunction* end_compiler(Parser* parser) {
+    emit_return(parser);
+    ObjFunction* function = parser->compiler->function;
+    function->max_stack = max_stack_depth(function);
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error) {
-        disassemble_chunk(current_chunk(),
+    if (!parser->had_error) {
+        disassemble_chunk(parser->vm, current_chunk(parser),
                 function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void binary(bool UNUSED(can_assign)) {
-    TokenType op_type = parser.previous.type;
+// Loads that cannot fail or be observed, so a check can wait past them.
+static bool is_pure_load(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The rest of a chain of + joins one OP_CONCAT, as long as the count fits
+// its operand. Before each further operand the ones so far are checked,
+// where a chain of OP_ADD would have failed on them. The check is dropped
+// again when the operand turns out to be a pure load on the same line,
+// which leaves it to the next check and reports the same line.
+static void concat_chain(Parser* parser, ParseRule* rule) {
+    Chunk* chunk = current_chunk(parser);
+    uint8_t count = 2;
+    uint8_t unchecked = 1;
+    while (count < UINT8_MAX && check(parser, TOKEN_PLUS)) {
+        size_t guard = chunk->count;
+        emit_bytes(parser, OP_CONCAT_CHECK, count);
+        emit_byte(parser, unchecked);
+        advance(parser);
+        parse_precedence(parser, (Precedence)(rule->precedence + 1));
+        count++;
+
+        size_t operand = guard + instruction_length(chunk, guard);
+        if (chunk->count > operand
+                && chunk->count - operand == instruction_length(chunk, operand)
+                && is_pure_load(chunk->code[operand])
+                && chunk->lines[operand] == chunk->lines[guard]) {
+            size_t length = chunk->count - operand;
+            memmove(&chunk->code[guard], &chunk->code[operand], length);
+            memmove(&chunk->lines[guard], &chunk->lines[operand], sizeof(size_t) * length);
+            chunk->count = guard + length;
+            parser->compiler->last_instruction = (int)guard;
+            unchecked++;
+        } else {
+            unchecked = 1;
+        }
+    }
+    emit_bytes(parser, OP_CONCAT, count);
+}
+
+static void binary(Parser* parser, bool UNUSED(can_assign)) {
+    TokenType op_type = parser->previous.type;
 
     ParseRule* rule = get_rule(op_type);
-    parse_precedence((Precedence)(rule->precedence + 1));
+    parse_precedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (op_type == TOKEN_PLUS && check(parser, TOKEN_PLUS)) {
+        concat_chain(parser, rule);
+        return;
+    }
 
     switch (op_type) {
-        case TOKEN_NE:      emit_bytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EE:      emit_byte(OP_EQUAL); break;
-        case TOKEN_LT:      emit_byte(OP_LESS); break;
-        case TOKEN_LE:      emit_bytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_GT:      emit_byte(OP_GREATER); break;
-        case TOKEN_GE:      emit_bytes(OP_LESS, OP_NOT); break;
-        case TOKEN_PLUS:    emit_byte(OP_ADD); break;
-        case TOKEN_MINUS:   emit_byte(OP_SUBTRACT); break;
-        case TOKEN_STAR:    emit_byte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:   emit_byte(OP_DIVIDE); break;
+        case TOKEN_NE:      emit_op(parser, OP_EQUAL); emit_op(parser, OP_NOT); break;
+        case TOKEN_EE:      emit_op(parser, OP_EQUAL); break;
+        case TOKEN_LT:      emit_op(parser, OP_LESS); break;
+        case TOKEN_LE:      emit_op(parser, OP_GREATER); emit_op(parser, OP_NOT); break;
+        case TOKEN_GT:      emit_op(parser, OP_GREATER); break;
+        case TOKEN_GE:      emit_op(parser, OP_LESS); emit_op(parser, OP_NOT); break;
+        case TOKEN_PLUS:    emit_op(parser, OP_ADD); break;
+        case TOKEN_MINUS:   emit_op(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:    emit_op(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:   emit_op(parser, OP_DIVIDE); break;
         default:
             return; // Unreachable.
     }
 }
 
-static void unary(bool UNUSED(can_assign)) {
-    TokenType op_type = parser.previous.type;
+static void unary(Parser* parser, bool UNUSED(can_assign)) {
+    TokenType op_type = parser->previous.type;
 
-    parse_precedence(PREC_UNARY);
+    parse_precedence(parser, PREC_UNARY);
 
     switch (op_type) {
-        case TOKEN_BANG:  emit_byte(OP_NOT); break;
-        case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+        case TOKEN_BANG:  emit_op(parser, OP_NOT); break;
+        case TOKEN_MINUS: emit_op(parser, OP_NEGATE); break;
         default:
             return; // Unreachable.
     }
 }
 
-static void number(bool UNUSED(can_assign)) {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(BOX_NUMBER(value));
+static void number(Parser* parser, bool UNUSED(can_assign)) {
+    double value = strtod(parser->previous.start, NULL);
+    emit_constant(parser, BOX_NUMBER(value));
 }
 
-static void string(bool UNUSED(can_assign)) {
-    size_t length = parser.previous.length - 2;
-    emit_constant(BOX_OBJ(copy_string(parser.previous.start + 1, length)));
+static void string(Parser* parser, bool UNUSED(can_assign)) {
+    size_t length = parser->previous.length - 2;
+    emit_constant(parser, BOX_OBJ(copy_string(parser->vm, parser->previous.start + 1, length)));
 }
 
-static uint8_t identifier_constant(Token* name) {
-    return make_constant(BOX_OBJ(copy_string(name->start, name->length)));
+static uint8_t identifier_constant(Parser* parser, Token* name) {
+    return make_constant(parser, BOX_OBJ(copy_string(parser->vm, name->start, name->length)));
+}
+
+static uint16_t identifier_global(Parser* parser, Token* name) {
+    size_t slot = global_slot(parser->vm, copy_string(parser->vm, name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 static bool identifier_equals(Token* a, Token* b) {
@@ -320,30 +552,30 @@ static bool identifier_equals(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void add_local(Token name) {
-    if (current->local_count == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void add_local(Parser* parser, Token name) {
+    if (parser->compiler->local_count == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
 }
 
-static void mark_initialized() {
-    if (current->scope_depth == 0) {
+static void mark_initialized(Parser* parser) {
+    if (parser->compiler->scope_depth == 0) {
         return;
     }
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+    parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-static int resolve_local(Compiler* compiler, Token* name) {
+static int resolve_local(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->local_count - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifier_equals(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -351,7 +583,7 @@ static int resolve_local(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static size_t add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
+static size_t add_upvalue(Parser* parser, Compiler* compiler, uint8_t index, bool is_local) {
     size_t upvalue_count = compiler->function->upvalue_count;
 
     for (size_t i = 0; i < upvalue_count; i++) {
@@ -362,7 +594,7 @@ static size_t add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
     }
 
     if (upvalue_count == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -371,84 +603,89 @@ static size_t add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
     return compiler->function->upvalue_count++;
 }
 
-static int resolve_upvalue(Compiler* compiler, Token* name) {
+static int resolve_upvalue(Parser* parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) {
         return -1;
     }
 
-    int local = resolve_local(compiler->enclosing, name);
+    int local = resolve_local(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
 }
 
-static void declare_variable() {
-    if (current->scope_depth == 0) {
+static void declare_variable(Parser* parser) {
+    if (parser->compiler->scope_depth == 0) {
         return;
     }
-    Token* name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < (int)current->scope_depth) {
+    Token* name = &parser->previous;
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < (int)parser->compiler->scope_depth) {
             break;
         }
         if (identifier_equals(name, &local->name)) {
-            error("Already variable with this name in this scope.");
+            error(parser, "Already variable with this name in this scope.");
         }
     }
-    add_local(*name);
+    add_local(parser, *name);
 }
 
-static void define_variable(uint8_t global) {
-    if (current->scope_depth > 0) {
-        mark_initialized();
+static void define_variable(Parser* parser, uint16_t global) {
+    if (parser->compiler->scope_depth > 0) {
+        mark_initialized(parser);
         return;
     }
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_global(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t parse_variable(const char* error_message) {
-    consume(TOKEN_IDENT, error_message);
-    declare_variable();
-    if (current->scope_depth > 0) {
+static uint16_t parse_variable(Parser* parser, const char* error_message) {
+    consume(parser, TOKEN_IDENT, error_message);
+    declare_variable(parser);
+    if (parser->compiler->scope_depth > 0) {
         return 0;
     }
-    return identifier_constant(&parser.previous);
+    return identifier_global(parser, &parser->previous);
 }
 
-static void named_variable(Token name, bool can_assign) {
+static void named_variable(Parser* parser, Token name, bool can_assign) {
     uint8_t get_op, set_op;
-    int arg = resolve_local(current, &name);
+    int arg = resolve_local(parser, parser->compiler, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
-    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+    } else if ((arg = resolve_upvalue(parser, parser->compiler, &name)) != -1) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        uint16_t slot = identifier_global(parser, &name);
+        if (can_assign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            emit_global(parser, OP_SET_GLOBAL, slot);
+        } else {
+            emit_global(parser, OP_GET_GLOBAL, slot);
+        }
+        return;
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(set_op, (uint8_t)arg);
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_bytes(parser, set_op, (uint8_t)arg);
     } else {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_bytes(parser, get_op, (uint8_t)arg);
     }
 }
 
-static void variable(bool can_assign) {
-    named_variable(parser.previous, can_assign);
+static void variable(Parser* parser, bool can_assign) {
+    named_variable(parser, parser->previous, can_assign);
 }
 
 static Token synthetic_token(const char* text) {
@@ -458,233 +695,247 @@ static Token synthetic_token(const char* text) {
     return token;
 }
 
-static void this_(bool UNUSED(can_assign)) {
-    if (current_class == NULL) {
-        error("Can't use 'this' outside of a class.");
+static void this_(Parser* parser, bool UNUSED(can_assign)) {
+    if (parser->klass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
-    variable(false);
+    variable(parser, false);
 }
 
-static void literal(bool UNUSED(can_assign)) {
-    switch (parser.previous.type) {
-        case TOKEN_NIL:   emit_byte(OP_NIL); break;
-        case TOKEN_TRUE:  emit_byte(OP_TRUE); break;
-        case TOKEN_FALSE: emit_byte(OP_FALSE); break;
+static void literal(Parser* parser, bool UNUSED(can_assign)) {
+    switch (parser->previous.type) {
+        case TOKEN_NIL:   emit_op(parser, OP_NIL); break;
+        case TOKEN_TRUE:  emit_op(parser, OP_TRUE); break;
+        case TOKEN_FALSE: emit_op(parser, OP_FALSE); break;
         default:
             return; // Unreachable.
     }
 }
 
-static void log_and(bool UNUSED(can_assign)) {
-    size_t end_jump = emit_jump(OP_JUMP_IF_FALSE);
+static void log_and(Parser* parser, bool UNUSED(can_assign)) {
+    size_t end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
 
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
+    emit_op(parser, OP_POP);
+    parse_precedence(parser, PREC_AND);
 
-    patch_jump(end_jump);
+    patch_jump(parser, end_jump);
 }
 
-static void log_or(bool UNUSED(can_assign)) {
-    size_t else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    size_t end_jump = emit_jump(OP_JUMP);
+static void log_or(Parser* parser, bool UNUSED(can_assign)) {
+    size_t else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    size_t end_jump = emit_jump(parser, OP_JUMP);
 
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
-    parse_precedence(PREC_OR);
+    patch_jump(parser, else_jump);
+    emit_op(parser, OP_POP);
+    parse_precedence(parser, PREC_OR);
 
-    patch_jump(end_jump);
+    patch_jump(parser, end_jump);
 }
 
-static void grouping(bool UNUSED(can_assign)) {
-    expression();
-    consume(TOKEN_RPAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool UNUSED(can_assign)) {
+    expression(parser);
+    consume(parser, TOKEN_RPAREN, "Expect ')' after expression.");
 }
 
-static void expression() {
-    parse_precedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static uint8_t argument_list() {
+static uint8_t argument_list(Parser* parser) {
     uint8_t arg_count = 0;
-    if (!check(TOKEN_RPAREN)) {
+    if (!check(parser, TOKEN_RPAREN)) {
         do {
-            expression();
+            expression(parser);
             if (arg_count == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             arg_count++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RPAREN, "Expet ')' after arguments.");
+    consume(parser, TOKEN_RPAREN, "Expet ')' after arguments.");
     return arg_count;
 }
 
-static void call(bool UNUSED(can_assign)) {
-    uint8_t arg_count = argument_list();
-    emit_bytes(OP_CALL, arg_count);
+static void call(Parser* parser, bool UNUSED(can_assign)) {
+    uint8_t arg_count = argument_list(parser);
+    emit_bytes(parser, OP_CALL, arg_count);
 }
 
-static void super_(bool UNUSED(can_assign)) {
-    if (current_class == NULL) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!current_class->has_superclass) {
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool UNUSED(can_assign)) {
+    if (parser->klass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->klass->has_superclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENT, "Expect superclass method name.");
-    uint8_t idx = identifier_constant(&parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENT, "Expect superclass method name.");
+    uint8_t idx = identifier_constant(parser, &parser->previous);
 
-    named_variable(synthetic_token("this"), false);
-    if (match(TOKEN_LPAREN)) {
-        uint8_t arg_count = argument_list();
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, idx);
-        emit_byte(arg_count);
+    named_variable(parser, synthetic_token("this"), false);
+    if (match(parser, TOKEN_LPAREN)) {
+        uint8_t arg_count = argument_list(parser);
+        named_variable(parser, synthetic_token("super"), false);
+        emit_bytes(parser, OP_SUPER_INVOKE, idx);
+        emit_byte(parser, arg_count);
     } else {
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, idx);
+        named_variable(parser, synthetic_token("super"), false);
+        emit_bytes(parser, OP_GET_SUPER, idx);
     }
 }
 
-static void dot(bool can_assign) {
-    consume(TOKEN_IDENT, "Expect property name after '.'.");
-    uint8_t name_idx = identifier_constant(&parser.previous);
+static void dot(Parser* parser, bool can_assign) {
+    consume(parser, TOKEN_IDENT, "Expect property name after '.'.");
+    uint8_t name_idx = identifier_constant(parser, &parser->previous);
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(OP_SET_PROPERTY, name_idx);
-    } else if (match(TOKEN_LPAREN)) {
-        uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name_idx);
-        emit_byte(arg_count);
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_bytes(parser, OP_SET_PROPERTY, name_idx);
+        emit_inline_cache(parser);
+    } else if (match(parser, TOKEN_LPAREN)) {
+        uint8_t arg_count = argument_list(parser);
+        emit_bytes(parser, OP_INVOKE, name_idx);
+        emit_byte(parser, arg_count);
+        emit_inline_cache(parser);
     } else {
-        emit_bytes(OP_GET_PROPERTY, name_idx);
+        emit_bytes(parser, OP_GET_PROPERTY, name_idx);
+        emit_inline_cache(parser);
     }
 }
 
-static void block() {
-    while (!check(TOKEN_RBRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RBRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
-    consume(TOKEN_RBRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RBRACE, "Expect '}' after block.");
 }
 
-static void expression_statement() {
-    expression();
-    consume(TOKEN_SEMI, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+static void expression_statement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMI, "Expect ';' after expression.");
+    emit_op(parser, OP_POP);
 }
 
-static void print_statement() {
-    expression();
-    consume(TOKEN_SEMI, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+static void print_statement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMI, "Expect ';' after value.");
+    emit_op(parser, OP_PRINT);
 }
 
-static void if_statement() {
-    consume(TOKEN_LPAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RPAREN, "Expect ')' after condition.");
+static void if_statement(Parser* parser) {
+    consume(parser, TOKEN_LPAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RPAREN, "Expect ')' after condition.");
 
-    size_t then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
-    size_t else_jump = emit_jump(OP_JUMP);
-    patch_jump(then_jump);
+    size_t then_jump = emit_jump(parser, OP_POP_JUMP_IF_FALSE);
+    statement(parser);
 
-    emit_byte(OP_POP);
-    if (match(TOKEN_ELSE)) {
-        statement();
+    if (match(parser, TOKEN_ELSE)) {
+        size_t else_jump = emit_jump(parser, OP_JUMP);
+        patch_jump(parser, then_jump);
+        statement(parser);
+        patch_jump(parser, else_jump);
+    } else {
+        patch_jump(parser, then_jump);
     }
-    patch_jump(else_jump);
 }
 
-static void while_statement() {
-    size_t loop_start = current_chunk()->count;
+static void while_statement(Parser* parser) {
+    size_t loop_start = mark_jump_target(parser);
 
-    consume(TOKEN_LPAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RPAREN, "Expect ')' after condition.");
+    consume(parser, TOKEN_LPAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RPAREN, "Expect ')' after condition.");
 
-    size_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
-    emit_loop(loop_start);
+    size_t exit_jump = emit_jump(parser, OP_POP_JUMP_IF_FALSE);
+    statement(parser);
+    emit_loop(parser, loop_start);
 
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, exit_jump);
 }
 
-static void for_statement() {
-    begin_scope();
+static void for_statement(Parser* parser) {
+    begin_scope(parser);
 
-    consume(TOKEN_LPAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMI)) {
+    consume(parser, TOKEN_LPAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMI)) {
         // no initializer
-    } else if (match(TOKEN_VAR)) {
-        var_declaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        var_declaration(parser);
     } else {
-        expression_statement();
+        expression_statement(parser);
     }
 
-    size_t loop_start = current_chunk()->count;
+    size_t loop_start = mark_jump_target(parser);
     int exit_jump = -1;
-    if (!match(TOKEN_SEMI)) {
-        expression();
-        consume(TOKEN_SEMI, "Expect ';' after loop condition.");
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+    if (!match(parser, TOKEN_SEMI)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMI, "Expect ';' after loop condition.");
+        exit_jump = emit_jump(parser, OP_POP_JUMP_IF_FALSE);
     }
 
-    if (!match(TOKEN_RPAREN)) {
-        size_t body_jump = emit_jump(OP_JUMP);
-        size_t increment_start = current_chunk()->count;
+    if (!match(parser, TOKEN_RPAREN)) {
+        size_t body_jump = emit_jump(parser, OP_JUMP);
+        size_t increment_start = mark_jump_target(parser);
 
-        expression();
-        emit_byte(OP_POP);
-        consume(TOKEN_RPAREN, "Expect ')' after for clauses.");
+        expression(parser);
+        emit_op(parser, OP_POP);
+        consume(parser, TOKEN_RPAREN, "Expect ')' after for clauses.");
 
-        emit_loop(loop_start);
+        emit_loop(parser, loop_start);
         loop_start = increment_start;
-        patch_jump(body_jump);
+        patch_jump(parser, body_jump);
     }
 
-    statement();
-    emit_loop(loop_start);
+    statement(parser);
+    emit_loop(parser, loop_start);
     if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        patch_jump(parser, exit_jump);
     }
 
-    end_scope();
+    end_scope(parser);
 }
 
-static void return_statement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void return_statement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMI)) {
-        emit_return();
+    if (match(parser, TOKEN_SEMI)) {
+        emit_return(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
+        }
+        expression(parser);
+        consume(parser, TOKEN_SEMI, "Expect ';' after return value.");
+        // A call right before the return reuses this function's frame. The
+        // OP_RETURN stays for callees that don't push one, like natives.
+        Chunk* chunk = current_chunk(parser);
+        int last = parser->compiler->last_instruction;
+        if (last != -1) {
+            uint8_t* op = &chunk->code[last];
+            size_t length = chunk->count - (size_t)last;
+            if (*op == OP_CALL && length == 2) {
+                *op = OP_TAIL_CALL;
+            } else if (*op == OP_INVOKE && length == 5) {
+                *op = OP_TAIL_INVOKE;
+            } else if (*op == OP_SUPER_INVOKE && length == 3) {
+                *op = OP_TAIL_SUPER_INVOKE;
+            }
         }
-        expression();
-        consume(TOKEN_SEMI, "Expect ';' after return value.");
-        emit_byte(OP_RETURN);
+        emit_op(parser, OP_RETURN);
     }
 }
 
-static void synchronize() {
-    parser.panic_mode = false;
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMI) {
+static void synchronize(Parser* parser) {
+    parser->panic_mode = false;
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMI) {
             return;
         }
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -697,170 +948,170 @@ static void synchronize() {
             default:
                 ; // nothing to do
         }
-        advance();
-    }
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        print_statement();
-    } else if (match(TOKEN_IF)) {
-        if_statement();
-    } else if (match(TOKEN_WHILE)) {
-        while_statement();
-    } else if (match(TOKEN_FOR)) {
-        for_statement();
-    } else if (match(TOKEN_RETURN)) {
-        return_statement();
-    } else if (match(TOKEN_LBRACE)) {
-        begin_scope();
-        block();
-        end_scope();
+        advance(parser);
+    }
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        print_statement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        if_statement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        while_statement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        for_statement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        return_statement(parser);
+    } else if (match(parser, TOKEN_LBRACE)) {
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     } else {
-        expression_statement();
+        expression_statement(parser);
     }
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
     Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
+    init_compiler(parser, &compiler, type);
+    begin_scope(parser);
 
-    consume(TOKEN_LPAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RPAREN)) {
+    consume(parser, TOKEN_LPAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RPAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                error_at_current("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                error_at_current(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t param_idx = parse_variable("Expect parameter name.");
-            define_variable(param_idx);
-        } while (match(TOKEN_COMMA));
+            uint16_t param_idx = parse_variable(parser, "Expect parameter name.");
+            define_variable(parser, param_idx);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RPAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_RPAREN, "Expect ')' after parameters.");
 
-    consume(TOKEN_LBRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_LBRACE, "Expect '{' before function body.");
+    block(parser);
 
-    ObjFunction* function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(BOX_OBJ(function)));
+    ObjFunction* function = end_compiler(parser);
+    emit_bytes(parser, OP_CLOSURE, make_constant(parser, BOX_OBJ(function)));
 
     for (size_t i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method() {
-    consume(TOKEN_IDENT, "Expect method name.");
-    uint8_t idx = identifier_constant(&parser.previous);
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENT, "Expect method name.");
+    uint8_t idx = identifier_constant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
-    function(type);
+    function(parser, type);
 
-    emit_bytes(OP_METHOD, idx);
+    emit_bytes(parser, OP_METHOD, idx);
 }
 
-static void var_declaration() {
-    uint8_t idx = parse_variable("Expect variable name.");
-    if (match(TOKEN_EQUAL)) {
-        expression();
+static void var_declaration(Parser* parser) {
+    uint16_t idx = parse_variable(parser, "Expect variable name.");
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emit_byte(OP_NIL);
+        emit_op(parser, OP_NIL);
     }
-    consume(TOKEN_SEMI, "Expect ';' after variable declaration.");
-    define_variable(idx);
+    consume(parser, TOKEN_SEMI, "Expect ';' after variable declaration.");
+    define_variable(parser, idx);
 }
 
-static void fun_declaration() {
-    uint8_t idx = parse_variable("Expect function name.");
-    mark_initialized();
-    function(TYPE_FUNCTION);
-    define_variable(idx);
+static void fun_declaration(Parser* parser) {
+    uint16_t idx = parse_variable(parser, "Expect function name.");
+    mark_initialized(parser);
+    function(parser, TYPE_FUNCTION);
+    define_variable(parser, idx);
 }
 
-static void class_declaration() {
-    consume(TOKEN_IDENT, "Expect class name.");
-    Token class_name = parser.previous;
-    uint8_t name_idx = identifier_constant(&parser.previous);
-    declare_variable();
+static void class_declaration(Parser* parser) {
+    consume(parser, TOKEN_IDENT, "Expect class name.");
+    Token class_name = parser->previous;
+    uint8_t name_idx = identifier_constant(parser, &parser->previous);
+    declare_variable(parser);
 
-    emit_bytes(OP_CLASS, name_idx);
-    define_variable(name_idx);
+    emit_bytes(parser, OP_CLASS, name_idx);
+    define_variable(parser, parser->compiler->scope_depth > 0 ? 0 : identifier_global(parser, &class_name));
 
     ClassCompiler class_compiler;
     class_compiler.name = class_name;
-    class_compiler.enclosing = current_class;
+    class_compiler.enclosing = parser->klass;
     class_compiler.has_superclass = false;
-    current_class = &class_compiler;
+    parser->klass = &class_compiler;
 
-    if (match(TOKEN_LT)) {
-        consume(TOKEN_IDENT, "Expect superclass name.");
-        variable(false);
-        if (identifier_equals(&class_name, &parser.previous)) {
-            error("A class can't inherit from itself.");
+    if (match(parser, TOKEN_LT)) {
+        consume(parser, TOKEN_IDENT, "Expect superclass name.");
+        variable(parser, false);
+        if (identifier_equals(&class_name, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
-        begin_scope();
-        add_local(synthetic_token("super"));
-        define_variable(0);
-        named_variable(class_name, false);
-        emit_byte(OP_INHERIT);
+        begin_scope(parser);
+        add_local(parser, synthetic_token("super"));
+        define_variable(parser, 0);
+        named_variable(parser, class_name, false);
+        emit_op(parser, OP_INHERIT);
         class_compiler.has_superclass = true;
     }
 
-    named_variable(class_name, false);
-    consume(TOKEN_LBRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RBRACE) && !check(TOKEN_EOF)) {
-        method();
+    named_variable(parser, class_name, false);
+    consume(parser, TOKEN_LBRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RBRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RBRACE, "Expect '}' after class body.");
-    emit_byte(OP_POP);
+    consume(parser, TOKEN_RBRACE, "Expect '}' after class body.");
+    emit_op(parser, OP_POP);
 
     if (class_compiler.has_superclass) {
-        end_scope();
+        end_scope(parser);
     }
 
-    current_class = current_class->enclosing;
+    parser->klass = parser->klass->enclosing;
 }
 
-static void declaration() {
-    if (match(TOKEN_CLASS)) {
-        class_declaration();
-    } else if (match(TOKEN_FUN)) {
-        fun_declaration();
-    } else if (match(TOKEN_VAR)) {
-        var_declaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        class_declaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        fun_declaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        var_declaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panic_mode) {
-        synchronize();
+    if (parser->panic_mode) {
+        synchronize(parser);
     }
 }
 
-static void parse_precedence(Precedence precedence) {
-    advance();
-    ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+static void parse_precedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
     if (prefix_rule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(can_assign);
+    prefix_rule(parser, can_assign);
 
-    while (precedence <= get_rule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+    while (precedence <= get_rule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -912,26 +1163,35 @@ static ParseRule* get_rule(TokenType type) {
     return &rules[type];
 }
 
-ObjFunction* compile(const char* source) {
-    Compiler compiler;
-    init_scanner(source);
-    init_compiler(&compiler, TYPE_SCRIPT);
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser;
+    parser.vm = vm;
+    init_scanner(&parser.scanner, source);
     parser.had_error = false;
     parser.panic_mode = false;
+    parser.compiler = NULL;
+    parser.klass = NULL;
+    vm->parser = &parser;
 
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    Compiler compiler;
+    init_compiler(&parser, &compiler, TYPE_SCRIPT);
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    ObjFunction* function = end_compiler();
+    ObjFunction* function = end_compiler(&parser);
+    vm->parser = NULL;
     return parser.had_error ? NULL : function;
 }
 
-void compiler_mark_roots() {
-    Compiler* compiler = current;
+void compiler_mark_roots(VM* vm) {
+    if (vm->parser == NULL) {
+        return;
+    }
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL) {
-        gc_mark_object((Obj*)compiler->function);
+        gc_mark_object(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
@@ -3,5 +3,5 @@
 #include "common.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
-void compiler_mark_roots();
+ObjFunction* compile(VM* vm, const char* source);
+void compiler_mark_roots(VM* vm);
@@ -3,43 +3,88 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
-static size_t constant_instruction(const char* name, Chunk* chunk, size_t offset) {
+static void constant_instruction(const char* name, Chunk* chunk, size_t offset) {
     uint8_t idx = chunk->code[offset + 1];
     printf("%-16s %4d '", name, idx);
     print_value(chunk->constants.values[idx]);
     printf("'\n");
-    return offset + 2;
 }
 
-static size_t byte_instruction(const char* name, Chunk* chunk, size_t offset) {
+static void byte_instruction(const char* name, Chunk* chunk, size_t offset) {
     uint8_t slot = chunk->code[offset + 1];
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
 }
 
-static size_t jump_instruction(const char* name, int sign, Chunk* chunk, size_t offset) {
+static void two_byte_instruction(const char* name, Chunk* chunk, size_t offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+}
+
+static void byte_constant_instruction(const char* name, Chunk* chunk, size_t offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t idx = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, idx);
+    print_value(chunk->constants.values[idx]);
+    printf("'\n");
+}
+
+static void global_instruction(VM* vm, const char* name, Chunk* chunk, size_t offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    print_value(vm->global_names.values[slot]);
+    printf("'\n");
+}
+
+static void jump_instruction(const char* name, int sign, Chunk* chunk, size_t offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
     printf("%-16s %4zu -> %zu\n", name, offset, offset + 3 + sign * jump);
-    return offset + 3;
 }
 
-static size_t invoke_instruction(const char* name, Chunk* chunk, size_t offset) {
+static void loop_instruction(const char* name, Chunk* chunk, size_t offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint16_t loop = (uint16_t)(chunk->code[offset + 3] << 8);
+    loop |= chunk->code[offset + 4];
+    printf("%-16s %4zu -> %zu (loop %d)\n", name, offset, offset + 5 - jump, loop);
+}
+
+static void invoke_instruction(const char* name, Chunk* chunk, size_t offset) {
     uint8_t idx = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, arg_count, idx);
     print_value(chunk->constants.values[idx]);
     printf("'\n");
-    return offset + 3;
 }
 
-static size_t simple_instruction(const char* name, size_t offset) {
+static void property_instruction(const char* name, Chunk* chunk, size_t offset) {
+    uint8_t idx = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, idx);
+    print_value(chunk->constants.values[idx]);
+    printf("' (cache %d)\n", cache);
+}
+
+static void cached_invoke_instruction(const char* name, Chunk* chunk, size_t offset) {
+    uint8_t idx = chunk->code[offset + 1];
+    uint8_t arg_count = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, arg_count, idx);
+    print_value(chunk->constants.values[idx]);
+    printf("' (cache %d)\n", cache);
+}
+
+static void simple_instruction(const char* name) {
     printf("%s\n", name);
-    return offset + 1;
 }
 
-int disassemble_instruction(Chunk* chunk, size_t offset) {
+int disassemble_instruction(VM* vm, Chunk* chunk, size_t offset) {
     printf("%04zu ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
         printf("   | ");
@@ -50,105 +95,194 @@ int disassemble_instruction(Chunk* chunk, size_t offset) {
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
+            constant_instruction("OP_CONSTANT", chunk, offset);
+            break;
         case OP_NIL:
-            return simple_instruction("OP_NIL", offset);
+            simple_instruction("OP_NIL");
+            break;
         case OP_TRUE:
-            return simple_instruction("OP_TRUE", offset);
+            simple_instruction("OP_TRUE");
+            break;
         case OP_FALSE:
-            return simple_instruction("OP_FALSE", offset);
+            simple_instruction("OP_FALSE");
+            break;
         case OP_POP:
-            return simple_instruction("OP_POP", offset);
+            simple_instruction("OP_POP");
+            break;
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            global_instruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
+            break;
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            global_instruction(vm, "OP_SET_GLOBAL", chunk, offset);
+            break;
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            global_instruction(vm, "OP_GET_GLOBAL", chunk, offset);
+            break;
         case OP_SET_LOCAL:
-            return byte_instruction("OP_SET_LOCAL", chunk, offset);
+            byte_instruction("OP_SET_LOCAL", chunk, offset);
+            break;
         case OP_GET_LOCAL:
-            return byte_instruction("OP_GET_LOCAL", chunk, offset);
+            byte_instruction("OP_GET_LOCAL", chunk, offset);
+            break;
         case OP_SET_UPVALUE:
-            return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+            byte_instruction("OP_SET_UPVALUE", chunk, offset);
+            break;
         case OP_GET_UPVALUE:
-            return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+            byte_instruction("OP_GET_UPVALUE", chunk, offset);
+            break;
         case OP_SET_PROPERTY:
-            return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+            property_instruction("OP_SET_PROPERTY", chunk, offset);
+            break;
         case OP_GET_PROPERTY:
-            return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+            property_instruction("OP_GET_PROPERTY", chunk, offset);
+            break;
         case OP_GET_SUPER:
-            return constant_instruction("OP_GET_SUPER", chunk, offset);
+            constant_instruction("OP_GET_SUPER", chunk, offset);
+            break;
         case OP_EQUAL:
-            return simple_instruction("OP_EQUAL", offset);
+            simple_instruction("OP_EQUAL");
+            break;
         case OP_LESS:
-            return simple_instruction("OP_LESS", offset);
+            simple_instruction("OP_LESS");
+            break;
         case OP_GREATER:
-            return simple_instruction("OP_GREATER", offset);
+            simple_instruction("OP_GREATER");
+            break;
         case OP_ADD:
-            return simple_instruction("OP_ADD", offset);
+            simple_instruction("OP_ADD");
+            break;
         case OP_SUBTRACT:
-            return simple_instruction("OP_SUBTRACT", offset);
+            simple_instruction("OP_SUBTRACT");
+            break;
         case OP_MULTIPLY:
-            return simple_instruction("OP_MULTIPLY", offset);
+            simple_instruction("OP_MULTIPLY");
+            break;
         case OP_DIVIDE:
-            return simple_instruction("OP_DIVIDE", offset);
+            simple_instruction("OP_DIVIDE");
+            break;
         case OP_NEGATE:
-            return simple_instruction("OP_NEGATE", offset);
+            simple_instruction("OP_NEGATE");
+            break;
+        case OP_CONCAT:
+            byte_instruction("OP_CONCAT", chunk, offset);
+            break;
+        case OP_CONCAT_CHECK:
+            two_byte_instruction("OP_CONCAT_CHECK", chunk, offset);
+            break;
         case OP_NOT:
-            return simple_instruction("OP_NOT", offset);
+            simple_instruction("OP_NOT");
+            break;
         case OP_PRINT:
-            return simple_instruction("OP_PRINT", offset);
+            simple_instruction("OP_PRINT");
+            break;
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", -1, chunk, offset);
+            loop_instruction("OP_LOOP", chunk, offset);
+            break;
         case OP_JUMP:
-            return jump_instruction("OP_JUMP", 1, chunk, offset);
+            jump_instruction("OP_JUMP", 1, chunk, offset);
+            break;
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+            break;
         case OP_CALL:
-            return byte_instruction("OP_CALL", chunk, offset);
+            byte_instruction("OP_CALL", chunk, offset);
+            break;
+        case OP_TAIL_CALL:
+            byte_instruction("OP_TAIL_CALL", chunk, offset);
+            break;
         case OP_INVOKE:
-            return invoke_instruction("OP_INVOKE", chunk, offset);
+            cached_invoke_instruction("OP_INVOKE", chunk, offset);
+            break;
+        case OP_TAIL_INVOKE:
+            cached_invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
+            break;
         case OP_SUPER_INVOKE:
-            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+            invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+            break;
+        case OP_TAIL_SUPER_INVOKE:
+            invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+            break;
         case OP_CLOSURE: {
-            offset++;
-            uint8_t idx = chunk->code[offset++];
+            uint8_t idx = chunk->code[offset + 1];
             printf("%-16s %4d ", "OP_CLOSURE", idx);
             print_value(chunk->constants.values[idx]);
             printf("\n");
 
             ObjFunction* function = RAW_FUNCTION(chunk->constants.values[idx]);
             for (size_t j = 0; j < function->upvalue_count; j++) {
-                uint8_t is_local = chunk->code[offset++];
-                uint8_t index = chunk->code[offset++];
+                uint8_t is_local = chunk->code[offset + 2 + 2 * j];
+                uint8_t index = chunk->code[offset + 3 + 2 * j];
                 printf("%04zu    |                     %s %d\n",
-                        offset - 2, is_local ? "local" : "upvalue", index);
+                        offset + 2 + 2 * j, is_local ? "local" : "upvalue", index);
             }
-
-            return offset;
+            break;
         }
         case OP_CLOSE_UPVALUE:
-            return simple_instruction("OP_CLOSE_UPVALUE", offset);
+            simple_instruction("OP_CLOSE_UPVALUE");
+            break;
         case OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
+            simple_instruction("OP_RETURN");
+            break;
         case OP_CLASS:
-            return constant_instruction("OP_CLASS", chunk, offset);
+            constant_instruction("OP_CLASS", chunk, offset);
+            break;
         case OP_INHERIT:
-            return simple_instruction("OP_INHERIT", offset);
+            simple_instruction("OP_INHERIT");
+            break;
         case OP_METHOD:
-            return constant_instruction("OP_METHOD", chunk, offset);
+            constant_instruction("OP_METHOD", chunk, offset);
+            break;
+        case OP_GET_LOCAL_2:
+            two_byte_instruction("OP_GET_LOCAL_2", chunk, offset);
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            byte_constant_instruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+            break;
+        case OP_SET_LOCAL_POP:
+            byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            jump_instruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            jump_instruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+            break;
+        case OP_ADD_NUM:
+            simple_instruction("OP_ADD_NUM");
+            break;
+        case OP_ADD_STR:
+            simple_instruction("OP_ADD_STR");
+            break;
+        case OP_SUBTRACT_NUM:
+            simple_instruction("OP_SUBTRACT_NUM");
+            break;
+        case OP_MULTIPLY_NUM:
+            simple_instruction("OP_MULTIPLY_NUM");
+            break;
+        case OP_DIVIDE_NUM:
+            simple_instruction("OP_DIVIDE_NUM");
+            break;
+        case OP_LESS_NUM:
+            simple_instruction("OP_LESS_NUM");
+            break;
+        case OP_GREATER_NUM:
+            simple_instruction("OP_GREATER_NUM");
+            break;
         default:
             printf("unknown opcode %d\n", instruction);
             return offset + 1;
     }
+    return offset + instruction_length(chunk, offset);
 }
 
-void disassemble_chunk(Chunk* chunk, const char* name) {
+void disassemble_chunk(VM* vm, Chunk* chunk, const char* name) {
     printf("=== %s ===\n", name);
 
     size_t offset = 0;
     while (offset < chunk->count) {
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(vm, chunk, offset);
     }
 }
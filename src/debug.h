@@ -3,5 +3,5 @@
 #include "common.h"
 #include "chunk.h"
 
-void disassemble_chunk(Chunk* chunk, const char* name);
-int disassemble_instruction(Chunk* chunk, size_t offset);
+void disassemble_chunk(VM* vm, Chunk* chunk, const char* name);
+int disassemble_instruction(VM* vm, Chunk* chunk, size_t offset);
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+// The block header is padded to a whole granule so cells stay aligned.
+#define HEAP_HEADER_SIZE \
+    ((sizeof(HeapBlock) + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1))
+
+static size_t size_class(size_t size) {
+    return (size - 1) / HEAP_GRANULE;
+}
+
+static bool is_small(size_t size) {
+    return size != 0 && size <= HEAP_MAX_SMALL;
+}
+
+static size_t block_cells(size_t cell_size) {
+    return (HEAP_BLOCK_SIZE - HEAP_HEADER_SIZE) / cell_size;
+}
+
+static uint8_t* block_cell(HeapBlock* block, size_t index) {
+    return (uint8_t*)block + HEAP_HEADER_SIZE + index * block->cell_size;
+}
+
+static void* check(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "[lox] error: failed to reallocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void init_class(HeapClass* klass) {
+    klass->free_cells = NULL;
+    klass->bump = NULL;
+    klass->bump_end = NULL;
+    klass->blocks = NULL;
+}
+
+void init_heap(Heap* heap) {
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        init_class(&heap->objects[i]);
+        init_class(&heap->data[i]);
+    }
+    heap->evacuated = NULL;
+    heap->object_capacity = 0;
+    heap->object_bytes = 0;
+}
+
+static void free_blocks(HeapBlock* block) {
+    while (block != NULL) {
+        HeapBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void free_heap(Heap* heap) {
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        free_blocks(heap->objects[i].blocks);
+        free_blocks(heap->data[i].blocks);
+    }
+    free_blocks(heap->evacuated);
+    init_heap(heap);
+}
+
+void heap_clear_marks(Heap* heap) {
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        for (HeapBlock* block = heap->objects[i].blocks; block != NULL; block = block->next) {
+            memset(block->marks, 0, sizeof(block->marks));
+        }
+    }
+}
+
+// Starts a new block for a class whose free cells and bump space have run
+// out.
+static HeapBlock* new_block(HeapClass* klass, size_t index) {
+    HeapBlock* block = check(aligned_alloc(HEAP_BLOCK_SIZE, HEAP_BLOCK_SIZE));
+    block->cell_size = (index + 1) * HEAP_GRANULE;
+    block->evacuated = false;
+    memset(block->marks, 0, sizeof(block->marks));
+    block->next = klass->blocks;
+    klass->blocks = block;
+
+    klass->bump = block_cell(block, 0);
+    klass->bump_end = block_cell(block, block_cells(block->cell_size));
+    return block;
+}
+
+static void* allocate_cell(HeapClass* klass, size_t index) {
+    HeapCell* cell = klass->free_cells;
+    if (cell != NULL) {
+        klass->free_cells = cell->next;
+        return cell;
+    }
+    if (klass->bump == klass->bump_end) {
+        new_block(klass, index);
+    }
+    void* ptr = klass->bump;
+    klass->bump += (index + 1) * HEAP_GRANULE;
+    return ptr;
+}
+
+static void free_cell(HeapClass* klass, void* ptr, size_t index) {
+    HeapCell* cell = (HeapCell*)ptr;
+#ifdef DEBUG_STRESS_GC
+    // Stale pointers into a freed cell now read garbage.
+    memset(cell, 0xbd, (index + 1) * HEAP_GRANULE);
+#else
+    (void)index;
+#endif
+    cell->next = klass->free_cells;
+    klass->free_cells = cell;
+}
+
+void* heap_allocate(Heap* heap, size_t size) {
+    if (!is_small(size)) {
+        return check(malloc(size));
+    }
+    size_t index = size_class(size);
+    return allocate_cell(&heap->data[index], index);
+}
+
+void heap_free(Heap* heap, void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!is_small(size)) {
+        free(ptr);
+        return;
+    }
+    size_t index = size_class(size);
+    free_cell(&heap->data[index], ptr, index);
+}
+
+void* heap_reallocate(Heap* heap, void* ptr, size_t old_size, size_t new_size) {
+    if (new_size == 0) {
+        heap_free(heap, ptr, old_size);
+        return NULL;
+    }
+    if (ptr == NULL) {
+        return heap_allocate(heap, new_size);
+    }
+    if (!is_small(old_size) && !is_small(new_size)) {
+        return check(realloc(ptr, new_size));
+    }
+    // A cell already big enough for the new size is kept.
+    if (is_small(old_size) && is_small(new_size) && size_class(old_size) == size_class(new_size)) {
+        return ptr;
+    }
+    void* result = heap_allocate(heap, new_size);
+    memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    heap_free(heap, ptr, old_size);
+    return result;
+}
+
+void* heap_allocate_object(Heap* heap, size_t size) {
+    size_t index = size_class(size);
+    HeapClass* klass = &heap->objects[index];
+    if (klass->free_cells == NULL && klass->bump == klass->bump_end) {
+        HeapBlock* block = new_block(klass, index);
+        heap->object_capacity += block_cells(block->cell_size) * block->cell_size;
+    }
+    heap->object_bytes += (index + 1) * HEAP_GRANULE;
+    return allocate_cell(klass, index);
+}
+
+void heap_free_object(Heap* heap, void* ptr, size_t size) {
+    size_t index = size_class(size);
+    heap->object_bytes -= (index + 1) * HEAP_GRANULE;
+    free_cell(&heap->objects[index], ptr, index);
+}
+
+static size_t count_marks(HeapBlock* block) {
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(block->marks) / sizeof(block->marks[0]); i++) {
+        count += (size_t)__builtin_popcountll(block->marks[i]);
+    }
+    return count;
+}
+
+// Rebuilds each object class from its blocks' mark bits. Sparse blocks are
+// set aside; the free cells of the others are relinked in address order.
+size_t heap_begin_evacuation(Heap* heap) {
+    size_t evacuated = 0;
+    heap->object_capacity = 0;
+    heap->object_bytes = 0;
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        HeapClass* klass = &heap->objects[i];
+        HeapBlock* block = klass->blocks;
+        init_class(klass);
+        while (block != NULL) {
+            HeapBlock* next = block->next;
+            size_t cells = block_cells(block->cell_size);
+            size_t live = count_marks(block);
+            if (live * 100 < cells * HEAP_EVACUATE_OCCUPANCY) {
+                block->evacuated = true;
+                block->next = heap->evacuated;
+                heap->evacuated = block;
+                evacuated++;
+            } else {
+                block->next = klass->blocks;
+                klass->blocks = block;
+                heap->object_capacity += cells * block->cell_size;
+                heap->object_bytes += live * block->cell_size;
+                for (size_t j = cells; j > 0; j--) {
+                    uint8_t* cell = block_cell(block, j - 1);
+                    if (!heap_is_marked(cell)) {
+                        free_cell(klass, cell, i);
+                    }
+                }
+            }
+            block = next;
+        }
+    }
+    return evacuated;
+}
+
+void heap_end_evacuation(Heap* heap) {
+    free_blocks(heap->evacuated);
+    heap->evacuated = NULL;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "common.h"
+
+// Small allocations are carved out of blocks, each holding cells of one
+// size class. Larger ones go to malloc. Blocks are aligned to their size,
+// so a cell's block is found by masking its address.
+#define HEAP_BLOCK_SIZE (16 * 1024)
+#define HEAP_GRANULE 8
+#define HEAP_MAX_SMALL 256
+#define HEAP_SIZE_CLASSES (HEAP_MAX_SMALL / HEAP_GRANULE)
+// Compaction empties object blocks with fewer live cells than this percentage.
+#define HEAP_EVACUATE_OCCUPANCY 50
+
+typedef struct HeapBlock {
+    struct HeapBlock* next;
+    size_t cell_size;
+    // Set on a block compaction is moving the objects out of.
+    bool evacuated;
+    // The collector's mark bits, one per granule, kept off the objects so
+    // marking does not write to them.
+    uint64_t marks[HEAP_BLOCK_SIZE / HEAP_GRANULE / 64];
+} HeapBlock;
+
+// A freed cell holds a link to the next free cell of its class.
+typedef struct HeapCell {
+    struct HeapCell* next;
+} HeapCell;
+
+typedef struct {
+    HeapCell* free_cells;
+    // The unused tail of the newest block.
+    uint8_t* bump;
+    uint8_t* bump_end;
+    HeapBlock* blocks;
+} HeapClass;
+
+typedef struct {
+    // Old objects get blocks of their own, which hold nothing the collector
+    // cannot find and move.
+    HeapClass objects[HEAP_SIZE_CLASSES];
+    HeapClass data[HEAP_SIZE_CLASSES];
+    // Object blocks a compaction is emptying.
+    HeapBlock* evacuated;
+    // Bytes in object cells, and in use.
+    size_t object_capacity;
+    size_t object_bytes;
+} Heap;
+
+void init_heap(Heap* heap);
+void free_heap(Heap* heap);
+// Sizes are the caller's to remember: a cell has no header.
+void* heap_allocate(Heap* heap, size_t size);
+void heap_free(Heap* heap, void* ptr, size_t size);
+void* heap_reallocate(Heap* heap, void* ptr, size_t old_size, size_t new_size);
+// Objects must fit HEAP_MAX_SMALL bytes.
+void* heap_allocate_object(Heap* heap, size_t size);
+void heap_free_object(Heap* heap, void* ptr, size_t size);
+void heap_clear_marks(Heap* heap);
+// With every live object marked and every unmarked object cell free, picks
+// the sparse object blocks to evacuate and returns how many there are.
+size_t heap_begin_evacuation(Heap* heap);
+// Frees the evacuated blocks once nothing refers into them.
+void heap_end_evacuation(Heap* heap);
+
+static inline HeapBlock* heap_block(const void* ptr) {
+    return (HeapBlock*)((uintptr_t)ptr & ~(uintptr_t)(HEAP_BLOCK_SIZE - 1));
+}
+
+static inline bool heap_is_evacuated(const void* ptr) {
+    return heap_block(ptr)->evacuated;
+}
+
+// The mark bit of a cell returned for at most HEAP_MAX_SMALL bytes.
+static inline uint64_t* heap_mark_word(const void* ptr, uint64_t* bit) {
+    size_t granule = ((uintptr_t)ptr & (HEAP_BLOCK_SIZE - 1)) / HEAP_GRANULE;
+    *bit = (uint64_t)1 << (granule % 64);
+    return &heap_block(ptr)->marks[granule / 64];
+}
+
+static inline bool heap_is_marked(const void* ptr) {
+    uint64_t bit;
+    return (*heap_mark_word(ptr, &bit) & bit) != 0;
+}
+
+static inline void heap_set_mark(const void* ptr) {
+    uint64_t bit;
+    *heap_mark_word(ptr, &bit) |= bit;
+}
+
+// For threads marking together. Returns whether this call set the bit.
+static inline bool heap_set_mark_atomic(const void* ptr) {
+    uint64_t bit;
+    uint64_t* word = heap_mark_word(ptr, &bit);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+        return false;
+    }
+    return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) == 0;
+}
@@ -0,0 +1,684 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "x64.h"
+
+#ifdef JIT
+
+#define NO_TARGET UINT32_MAX
+
+struct JitCode {
+    uint8_t* code;
+    uint8_t* body; // code for the first instruction
+    size_t size;
+    uint32_t* targets; // native offset for each instruction start in the chunk
+};
+
+// Value stack helpers. The top of the stack is at [TOP - 8].
+
+static void emit_peek(Assembler* as, Reg dst, int distance) {
+    emit_load(as, dst, TOP, -8 * (distance + 1));
+}
+
+static void emit_push(Assembler* as, Reg src) {
+    emit_store(as, TOP, 0, src);
+    emit_add_imm(as, TOP, sizeof(Value));
+}
+
+static void emit_drop(Assembler* as, int count) {
+    emit_sub_imm(as, TOP, count * (int)sizeof(Value));
+}
+
+// Jumps to a slow path unless reg holds a number. Clobbers RDX.
+static size_t emit_number_guard(Assembler* as, Reg reg) {
+    emit_mov(as, RDX, reg);
+    emit_rr(as, 0x21, RDX, QNAN_R); // and
+    emit_cmp(as, RDX, QNAN_R);
+    return emit_jcc(as, CC_E);
+}
+
+// Turns the flag in AL into BOX_TRUE or BOX_FALSE in RAX.
+static void emit_box_bool(Assembler* as) {
+    emit_movzx8(as, RAX);
+    emit_mov_imm(as, RCX, BOX_FALSE);
+    emit_rr(as, 0x01, RAX, RCX); // add
+}
+
+// Hands the instruction at offset over to jit_fallback(), leaving compiled
+// code if it reports anything but JIT_CONTINUE.
+static void emit_fallback(Assembler* as, size_t offset) {
+    emit_mov_ptr(as, RAX, as->chunk->code + offset + 1);
+    emit_store(as, FRAME, offsetof(CallFrame, ip), RAX);
+    emit_store(as, TOP_PTR, 0, TOP);
+    emit_mov_ptr(as, RDI, as->vm);
+    emit_mov(as, RSI, FRAME);
+    emit_call(as, (uintptr_t)jit_fallback);
+    emit_load(as, TOP, TOP_PTR, 0);
+    emit(as, 0x85); // test eax, eax
+    emit(as, 0xc0);
+    patch_to(as, emit_jcc(as, CC_NE), as->leave);
+}
+
+// Finishes a fast path whose guards jump to the generic fallback.
+static void emit_slow_path(Assembler* as, size_t* guards, int guard_count, size_t offset) {
+    size_t done = emit_jmp(as);
+    for (int i = 0; i < guard_count; i++) {
+        patch_here(as, guards[i]);
+    }
+    emit_fallback(as, offset);
+    patch_here(as, done);
+}
+
+// Falls through if RAX is falsey, jumps to the returned patch otherwise.
+static void emit_jump_if_false(Assembler* as, size_t target) {
+    emit_mov_imm(as, RCX, BOX_NIL);
+    emit_cmp(as, RAX, RCX);
+    add_patch(as, emit_jcc(as, CC_E), target);
+    emit_mov_imm(as, RCX, BOX_FALSE);
+    emit_cmp(as, RAX, RCX);
+    add_patch(as, emit_jcc(as, CC_E), target);
+}
+
+uint8_t* jit_resume_point(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    if (function->jit == NULL) {
+        return NULL;
+    }
+    return function->jit->code + function->jit->targets[frame->ip - function->chunk.code];
+}
+
+// Finds where compiled code continues after a call or return changed the top
+// frame. Returns NULL if that frame has to run in the interpreter.
+static uint8_t* switch_frame(VM* vm, CallFrame** frame_out) {
+    *frame_out = &vm->frames[vm->frame_count - 1];
+    return jit_resume_point(*frame_out);
+}
+
+static void emit_prologue(Assembler* as) {
+    // JitStatus entry(CallFrame* frame, void* target)
+    emit_push_reg(as, RBP);
+    emit_push_reg(as, RBX);
+    emit_push_reg(as, R12);
+    emit_push_reg(as, R13);
+    emit_push_reg(as, R14);
+    emit_push_reg(as, R15);
+    emit_sub_imm(as, RSP, 8); // keep calls 16-byte aligned
+    emit_mov(as, FRAME, RDI);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit_mov_ptr(as, TOP_PTR, &as->vm->stack_top);
+    emit_load(as, TOP, TOP_PTR, 0);
+    emit_mov_imm(as, QNAN_R, QNAN);
+    emit(as, 0xff); // jmp rsi
+    emit(as, 0xe6);
+
+    // jit_fallback() returned the JitStatus in EAX. A frame change jumps
+    // straight into the new frame's code when it has some, so compiled
+    // functions call and return to each other without leaving native code.
+    as->leave = as->count;
+    emit(as, 0x83); // cmp eax, JIT_EXIT_FRAME
+    emit(as, 0xf8);
+    emit(as, JIT_EXIT_FRAME);
+    size_t not_frame = emit_jcc(as, CC_NE);
+    emit_mov_ptr(as, RDI, as->vm);
+    emit(as, 0x48); // lea rsi, [rsp]
+    emit(as, 0x8d);
+    emit(as, 0x34);
+    emit(as, 0x24);
+    emit_call(as, (uintptr_t)switch_frame);
+    emit(as, 0x48); // test rax, rax
+    emit(as, 0x85);
+    emit(as, 0xc0);
+    size_t interpreted = emit_jcc(as, CC_E);
+    emit_load(as, FRAME, RSP, 0);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit(as, 0xff); // jmp rax
+    emit(as, 0xe0);
+    patch_here(as, interpreted);
+    emit(as, 0xb8); // mov eax, JIT_EXIT_FRAME
+    emit32(as, JIT_EXIT_FRAME);
+
+    // Every exit jumps here with its JitStatus in EAX.
+    patch_here(as, not_frame);
+    as->exit = as->count;
+    emit_store(as, TOP_PTR, 0, TOP);
+    emit_add_imm(as, RSP, 8);
+    emit_pop_reg(as, R15);
+    emit_pop_reg(as, R14);
+    emit_pop_reg(as, R13);
+    emit_pop_reg(as, R12);
+    emit_pop_reg(as, RBX);
+    emit_pop_reg(as, RBP);
+    emit(as, 0xc3); // ret
+}
+
+static uint16_t read_short(Chunk* chunk, size_t offset) {
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static void emit_arith(Assembler* as, uint8_t sse_op, size_t offset) {
+    size_t guards[2];
+    emit_peek(as, RAX, 1);
+    emit_peek(as, RCX, 0);
+    guards[0] = emit_number_guard(as, RAX);
+    guards[1] = emit_number_guard(as, RCX);
+    emit_to_xmm(as, 0, RAX);
+    emit_to_xmm(as, 1, RCX);
+    emit_sse(as, sse_op);
+    emit_from_xmm(as, RAX, 0);
+    emit_store(as, TOP, -16, RAX);
+    emit_drop(as, 1);
+    emit_slow_path(as, guards, 2, offset);
+}
+
+// Sums count numbers from the left, the way run() would add them a pair at
+// a time. Strings and errors go to the fallback.
+static void emit_concat(Assembler* as, uint8_t count, size_t offset) {
+    size_t guards[UINT8_MAX];
+    emit_peek(as, RAX, count - 1);
+    guards[0] = emit_number_guard(as, RAX);
+    emit_to_xmm(as, 0, RAX);
+    for (uint8_t i = 1; i < count; i++) {
+        emit_peek(as, RCX, count - 1 - i);
+        guards[i] = emit_number_guard(as, RCX);
+        emit_to_xmm(as, 1, RCX);
+        emit_sse(as, SSE_ADD);
+    }
+    emit_from_xmm(as, RAX, 0);
+    emit_store(as, TOP, -8 * count, RAX);
+    emit_drop(as, count - 1);
+    emit_slow_path(as, guards, count, offset);
+}
+
+// Numbers pass inline; anything else is left to the VM to check.
+static void emit_concat_check(Assembler* as, uint8_t count, uint8_t unchecked, size_t offset) {
+    size_t guards[UINT8_MAX];
+    emit_peek(as, RAX, count - 1);
+    guards[0] = emit_number_guard(as, RAX);
+    for (uint8_t i = 0; i < unchecked; i++) {
+        emit_peek(as, RAX, i);
+        guards[i + 1] = emit_number_guard(as, RAX);
+    }
+    emit_slow_path(as, guards, unchecked + 1, offset);
+}
+
+// Leaves the numbers a and b in XMM0 and XMM1, guards included.
+static void emit_load_operands(Assembler* as, size_t* guards) {
+    emit_peek(as, RAX, 1);
+    emit_peek(as, RCX, 0);
+    guards[0] = emit_number_guard(as, RAX);
+    guards[1] = emit_number_guard(as, RCX);
+    emit_to_xmm(as, 0, RAX);
+    emit_to_xmm(as, 1, RCX);
+}
+
+static void emit_compare(Assembler* as, bool less, size_t offset) {
+    size_t guards[2];
+    emit_load_operands(as, guards);
+    // a < b is b > a, which also comes out false for NaN.
+    if (less) {
+        emit_ucomisd(as, 1, 0);
+    } else {
+        emit_ucomisd(as, 0, 1);
+    }
+    emit_setcc(as, CC_A, RAX);
+    emit_box_bool(as);
+    emit_store(as, TOP, -16, RAX);
+    emit_drop(as, 1);
+    emit_slow_path(as, guards, 2, offset);
+}
+
+static void emit_compare_jump(Assembler* as, bool less, size_t offset, size_t target) {
+    size_t guards[2];
+    emit_load_operands(as, guards);
+    emit_drop(as, 2);
+    if (less) {
+        emit_ucomisd(as, 1, 0);
+    } else {
+        emit_ucomisd(as, 0, 1);
+    }
+    add_patch(as, emit_jcc(as, CC_BE), target);
+    emit_slow_path(as, guards, 2, offset);
+}
+
+// Jumps to one of the two patches written to slow if reg holds a string
+// that is not interned, with RSI holding the object tag mask. Clobbers RDX.
+static void emit_lazy_string_guard(Assembler* as, Reg reg, size_t* slow) {
+    emit_mov(as, RDX, reg);
+    emit_rr(as, 0x21, RDX, RSI); // and
+    emit_cmp(as, RDX, RSI);
+    size_t not_object = emit_jcc(as, CC_NE);
+    emit_mov(as, RDX, reg);
+    emit_rr(as, 0x31, RDX, RSI); // xor, unboxing the Obj*
+    emit_mem_imm(as, false, 7, RDX, offsetof(Obj, type), OBJ_STRING); // cmp
+    size_t not_string = emit_jcc(as, CC_NE);
+    emit_mem_imm(as, true, 7, RDX, offsetof(ObjString, chars), 0); // cmp
+    slow[0] = emit_jcc(as, CC_E);
+    emit_mem_imm(as, true, 7, RDX, offsetof(ObjString, hash), 0); // cmp
+    slow[1] = emit_jcc(as, CC_E);
+    patch_here(as, not_object);
+    patch_here(as, not_string);
+}
+
+// Other values are equal only if their bits are, except that strings not
+// interned yet are compared by their characters in jit_fallback().
+static void emit_equal(Assembler* as, size_t offset) {
+    size_t slow[4];
+    emit_peek(as, RAX, 1);
+    emit_peek(as, RCX, 0);
+    size_t not_number_a = emit_number_guard(as, RAX);
+    size_t not_number_b = emit_number_guard(as, RCX);
+    emit_to_xmm(as, 0, RAX);
+    emit_to_xmm(as, 1, RCX);
+    emit_ucomisd(as, 0, 1);
+    emit_setcc(as, CC_E, RAX);
+    emit_setcc(as, CC_NP, RDX);
+    emit(as, 0x20); // and al, dl
+    emit(as, 0xd0);
+    size_t done = emit_jmp(as);
+    patch_here(as, not_number_a);
+    patch_here(as, not_number_b);
+    emit_cmp(as, RAX, RCX);
+    size_t same = emit_jcc(as, CC_E);
+    emit_mov_imm(as, RSI, SIGN_BIT | QNAN);
+    emit_lazy_string_guard(as, RAX, &slow[0]);
+    emit_lazy_string_guard(as, RCX, &slow[2]);
+    emit_rr(as, 0x31, RAX, RAX); // xor, false
+    size_t different = emit_jmp(as);
+    patch_here(as, same);
+    emit_setcc(as, CC_E, RAX);
+    patch_here(as, done);
+    patch_here(as, different);
+    emit_box_bool(as);
+    emit_store(as, TOP, -16, RAX);
+    emit_drop(as, 1);
+    emit_slow_path(as, slow, 4, offset);
+}
+
+// Calls to compiled closures push the frame and jump straight to the
+// callee's code. Everything else goes through call_value().
+static void emit_call_op(Assembler* as, size_t offset, size_t next) {
+    uint8_t arg_count = as->chunk->code[offset + 1];
+    int32_t callee = -8 * (arg_count + 1);
+    size_t slow[7];
+
+    emit_load(as, RAX, TOP, callee);
+    emit_mov_imm(as, RCX, SIGN_BIT | QNAN);
+    emit_mov(as, RDX, RAX);
+    emit_rr(as, 0x21, RDX, RCX); // and
+    emit_cmp(as, RDX, RCX);
+    slow[0] = emit_jcc(as, CC_NE);
+    emit_rr(as, 0x31, RAX, RCX); // xor, unboxing the Obj*
+    emit_mem_imm(as, false, 7, RAX, offsetof(Obj, type), OBJ_CLOSURE); // cmp
+    slow[1] = emit_jcc(as, CC_NE);
+    emit_load(as, RCX, RAX, offsetof(ObjClosure, function));
+    emit_mem_imm(as, true, 7, RCX, offsetof(ObjFunction, arity), arg_count); // cmp
+    slow[2] = emit_jcc(as, CC_NE);
+    emit_load(as, RDX, RCX, offsetof(ObjFunction, jit));
+    emit_test(as, RDX);
+    slow[3] = emit_jcc(as, CC_E);
+    // Growing either stack or hitting the depth limit is call()'s job.
+    emit_mov_ptr(as, RSI, &as->vm->frame_count);
+    emit_load(as, RDI, RSI, 0);
+    emit_mem(as, 0x3b, RDI, RSI, offsetof(VM, frame_capacity) - offsetof(VM, frame_count)); // cmp
+    slow[4] = emit_jcc(as, CC_AE);
+    emit_mem(as, 0x3b, RDI, RSI, offsetof(VM, max_frames) - offsetof(VM, frame_count)); // cmp
+    slow[5] = emit_jcc(as, CC_AE);
+    // The end of the callee's frame: its slots plus max_stack values.
+    emit_load(as, R8, RCX, offsetof(ObjFunction, max_stack));
+    emit_rr(as, 0x01, R8, R8); // add, three times to scale by sizeof(Value)
+    emit_rr(as, 0x01, R8, R8);
+    emit_rr(as, 0x01, R8, R8);
+    emit_rr(as, 0x01, R8, TOP); // add
+    emit_add_imm(as, R8, callee);
+    emit_mem(as, 0x3b, R8, RSI, offsetof(VM, stack_limit) - offsetof(VM, frame_count)); // cmp
+    slow[6] = emit_jcc(as, CC_A);
+
+    emit_mov_ptr(as, R8, as->chunk->code + next);
+    emit_store(as, FRAME, offsetof(CallFrame, ip), R8);
+    emit_add_imm(as, RDI, 1);
+    emit_store(as, RSI, 0, RDI);
+    emit_add_imm(as, FRAME, sizeof(CallFrame));
+    emit_store(as, FRAME, offsetof(CallFrame, closure), RAX);
+    emit_load(as, R8, RCX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emit_store(as, FRAME, offsetof(CallFrame, ip), R8);
+    emit_mov(as, SLOTS, TOP);
+    emit_add_imm(as, SLOTS, callee);
+    emit_store(as, FRAME, offsetof(CallFrame, slots), SLOTS);
+    size_t resume = emit_lea_rip(as, R8);
+    emit_store(as, FRAME, offsetof(CallFrame, jit_return), R8);
+    emit_load(as, RAX, RDX, offsetof(JitCode, body));
+    emit(as, 0xff); // jmp rax
+    emit(as, 0xe0);
+
+    size_t done = emit_jmp(as);
+    for (int i = 0; i < 7; i++) {
+        patch_here(as, slow[i]);
+    }
+    emit_fallback(as, offset);
+    patch_here(as, done);
+    patch_here(as, resume);
+}
+
+// Returns to a compiled caller that called directly, unless upvalues need
+// closing.
+static void emit_return_op(Assembler* as, size_t offset) {
+    size_t slow[2];
+    emit_load(as, RAX, FRAME, offsetof(CallFrame, jit_return));
+    emit_test(as, RAX);
+    slow[0] = emit_jcc(as, CC_E);
+    emit_mov_ptr(as, RCX, &as->vm->open_upvalues);
+    emit_load(as, RCX, RCX, 0);
+    emit_test(as, RCX);
+    size_t no_upvalues = emit_jcc(as, CC_E);
+    emit_load(as, RCX, RCX, offsetof(ObjUpvalue, location));
+    emit_cmp(as, RCX, SLOTS);
+    slow[1] = emit_jcc(as, CC_AE);
+    patch_here(as, no_upvalues);
+
+    emit_peek(as, RCX, 0);
+    emit_mov_ptr(as, RDX, &as->vm->frame_count);
+    emit_load(as, RSI, RDX, 0);
+    emit_sub_imm(as, RSI, 1);
+    emit_store(as, RDX, 0, RSI);
+    emit_store(as, SLOTS, 0, RCX);
+    emit_mov(as, TOP, SLOTS);
+    emit_add_imm(as, TOP, sizeof(Value));
+    emit_sub_imm(as, FRAME, sizeof(CallFrame));
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit(as, 0xff); // jmp rax
+    emit(as, 0xe0);
+
+    patch_here(as, slow[0]);
+    patch_here(as, slow[1]);
+    emit_fallback(as, offset);
+}
+
+static void emit_global_address(Assembler* as) {
+    emit_mov_ptr(as, RAX, &as->vm->global_values.values);
+    emit_load(as, RAX, RAX, 0);
+}
+
+// Jumps to the returned patch while the collector is marking, so that stores
+// take the fallback and its write barriers.
+static size_t emit_marking_check(Assembler* as) {
+    emit_mov_ptr(as, RDX, &as->vm->gc_phase);
+    emit_mem_imm(as, false, 7, RDX, 0, GC_MARKING); // cmp
+    return emit_jcc(as, CC_E);
+}
+
+static void emit_upvalue_address(Assembler* as, uint8_t slot) {
+    emit_load(as, RAX, FRAME, offsetof(CallFrame, closure));
+    emit_load(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+    emit_load(as, RAX, RAX, slot * sizeof(ObjUpvalue*));
+    emit_load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void emit_instruction(Assembler* as, size_t offset) {
+    Chunk* chunk = as->chunk;
+    uint8_t* code = chunk->code;
+    size_t next = offset + instruction_length(chunk, offset);
+
+    switch (code[offset]) {
+        case OP_CONSTANT:
+            emit_mov_ptr(as, RAX, &chunk->constants.values[code[offset + 1]]);
+            emit_load(as, RAX, RAX, 0);
+            emit_push(as, RAX);
+            break;
+        case OP_NIL:
+            emit_mov_imm(as, RAX, BOX_NIL);
+            emit_push(as, RAX);
+            break;
+        case OP_TRUE:
+            emit_mov_imm(as, RAX, BOX_TRUE);
+            emit_push(as, RAX);
+            break;
+        case OP_FALSE:
+            emit_mov_imm(as, RAX, BOX_FALSE);
+            emit_push(as, RAX);
+            break;
+        case OP_POP:
+            emit_drop(as, 1);
+            break;
+        case OP_DEFINE_GLOBAL: {
+            size_t marking = emit_marking_check(as);
+            emit_global_address(as);
+            emit_peek(as, RCX, 0);
+            emit_store(as, RAX, read_short(chunk, offset + 1) * sizeof(Value), RCX);
+            emit_drop(as, 1);
+            emit_slow_path(as, &marking, 1, offset);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL: {
+            int32_t disp = read_short(chunk, offset + 1) * sizeof(Value);
+            size_t slow[2];
+            int slow_count = 0;
+            if (code[offset] == OP_SET_GLOBAL) {
+                slow[slow_count++] = emit_marking_check(as);
+            }
+            emit_global_address(as);
+            emit_load(as, RCX, RAX, disp);
+            emit_mov_imm(as, RDX, BOX_UNDEFINED);
+            emit_cmp(as, RCX, RDX);
+            slow[slow_count++] = emit_jcc(as, CC_E);
+            if (code[offset] == OP_GET_GLOBAL) {
+                emit_push(as, RCX);
+            } else {
+                emit_peek(as, RCX, 0);
+                emit_store(as, RAX, disp, RCX);
+            }
+            emit_slow_path(as, slow, slow_count, offset);
+            break;
+        }
+        case OP_SET_LOCAL:
+            emit_peek(as, RAX, 0);
+            emit_store(as, SLOTS, code[offset + 1] * sizeof(Value), RAX);
+            break;
+        case OP_GET_LOCAL:
+            emit_load(as, RAX, SLOTS, code[offset + 1] * sizeof(Value));
+            emit_push(as, RAX);
+            break;
+        case OP_SET_UPVALUE: {
+            // Young objects, and anything while marking, take the fallback
+            // for its write barrier.
+            size_t slow[2];
+            slow[0] = emit_marking_check(as);
+            emit_peek(as, RCX, 0);
+            emit_mov_imm(as, RDX, SIGN_BIT | QNAN);
+            emit_mov(as, RAX, RCX);
+            emit_rr(as, 0x21, RAX, RDX); // and
+            emit_cmp(as, RAX, RDX);
+            size_t not_object = emit_jcc(as, CC_NE);
+            emit_mov(as, RAX, RCX);
+            emit_rr(as, 0x31, RAX, RDX); // xor, unboxing the Obj*
+            emit_mov_ptr(as, RDX, &as->vm->nursery);
+            emit_mem(as, 0x3b, RAX, RDX, 0); // cmp
+            size_t old = emit_jcc(as, CC_B);
+            emit_mem(as, 0x3b, RAX, RDX, offsetof(VM, nursery_end) - offsetof(VM, nursery)); // cmp
+            slow[1] = emit_jcc(as, CC_B);
+            patch_here(as, not_object);
+            patch_here(as, old);
+            emit_upvalue_address(as, code[offset + 1]);
+            emit_store(as, RAX, 0, RCX);
+            emit_slow_path(as, slow, 2, offset);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            emit_upvalue_address(as, code[offset + 1]);
+            emit_load(as, RAX, RAX, 0);
+            emit_push(as, RAX);
+            break;
+        case OP_EQUAL:
+            emit_equal(as, offset);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            emit_compare(as, true, offset);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            emit_compare(as, false, offset);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            emit_arith(as, 0x58, offset);
+            break;
+        case OP_CONCAT:
+            emit_concat(as, code[offset + 1], offset);
+            break;
+        case OP_CONCAT_CHECK:
+            emit_concat_check(as, code[offset + 1], code[offset + 2], offset);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            emit_arith(as, 0x5c, offset);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            emit_arith(as, 0x59, offset);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            emit_arith(as, 0x5e, offset);
+            break;
+        case OP_NEGATE: {
+            emit_peek(as, RAX, 0);
+            size_t guard = emit_number_guard(as, RAX);
+            emit_mov_imm(as, RCX, SIGN_BIT);
+            emit_rr(as, 0x31, RAX, RCX); // xor
+            emit_store(as, TOP, -8, RAX);
+            emit_slow_path(as, &guard, 1, offset);
+            break;
+        }
+        case OP_NOT:
+            emit_peek(as, RAX, 0);
+            emit_mov_imm(as, RDX, BOX_NIL);
+            emit_cmp(as, RAX, RDX);
+            emit_setcc(as, CC_E, RCX);
+            emit_mov_imm(as, RDX, BOX_FALSE);
+            emit_cmp(as, RAX, RDX);
+            emit_setcc(as, CC_E, RDX);
+            emit(as, 0x08); // or cl, dl
+            emit(as, 0xd1);
+            emit_mov(as, RAX, RCX);
+            emit_box_bool(as);
+            emit_store(as, TOP, -8, RAX);
+            break;
+        case OP_LOOP: {
+            // Counts the back-edge and lets the tracing JIT take over once
+            // the loop is hot.
+            LoopSite* site = &chunk->loops[read_short(chunk, offset + 3)];
+            emit_mov_ptr(as, RAX, &site->countdown);
+            emit(as, 0x83); // sub dword [rax], 1
+            emit(as, 0x28);
+            emit(as, 0x01);
+            add_patch(as, emit_jcc(as, CC_NE), next - read_short(chunk, offset + 1));
+            emit_fallback(as, offset);
+            break;
+        }
+        case OP_JUMP:
+            add_patch(as, emit_jmp(as), next + read_short(chunk, offset + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            emit_peek(as, RAX, 0);
+            emit_jump_if_false(as, next + read_short(chunk, offset + 1));
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            emit_peek(as, RAX, 0);
+            emit_drop(as, 1);
+            emit_jump_if_false(as, next + read_short(chunk, offset + 1));
+            break;
+        case OP_GET_LOCAL_2:
+            emit_load(as, RAX, SLOTS, code[offset + 1] * sizeof(Value));
+            emit_push(as, RAX);
+            emit_load(as, RAX, SLOTS, code[offset + 2] * sizeof(Value));
+            emit_push(as, RAX);
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            emit_load(as, RAX, SLOTS, code[offset + 1] * sizeof(Value));
+            emit_push(as, RAX);
+            emit_mov_ptr(as, RAX, &chunk->constants.values[code[offset + 2]]);
+            emit_load(as, RAX, RAX, 0);
+            emit_push(as, RAX);
+            break;
+        case OP_SET_LOCAL_POP:
+            emit_peek(as, RAX, 0);
+            emit_drop(as, 1);
+            emit_store(as, SLOTS, code[offset + 1] * sizeof(Value), RAX);
+            break;
+        case OP_CALL:
+            emit_call_op(as, offset, next);
+            break;
+        case OP_RETURN:
+            emit_return_op(as, offset);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            emit_compare_jump(as, true, offset, next + read_short(chunk, offset + 1));
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            emit_compare_jump(as, false, offset, next + read_short(chunk, offset + 1));
+            break;
+        default:
+            // Calls, returns, property access and everything that allocates.
+            emit_fallback(as, offset);
+            break;
+    }
+}
+
+bool jit_compile(VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+    as.vm = vm;
+    as.chunk = chunk;
+    as.targets = x64_grow(NULL, sizeof(uint32_t) * (chunk->count + 1));
+    for (size_t i = 0; i <= chunk->count; i++) {
+        as.targets[i] = NO_TARGET;
+    }
+
+    emit_prologue(&as);
+    for (size_t offset = 0; offset < chunk->count;
+            offset += instruction_length(chunk, offset)) {
+        as.targets[offset] = (uint32_t)as.count;
+        emit_instruction(&as, offset);
+    }
+    for (size_t i = 0; i < as.patch_count; i++) {
+        patch_to(&as, as.patches[i].at, as.targets[as.patches[i].target]);
+    }
+    free(as.patches);
+
+    uint8_t* code = x64_install(&as);
+    free(as.code);
+    if (code == NULL) {
+        free(as.targets);
+        return false;
+    }
+
+    JitCode* jit = x64_grow(NULL, sizeof(JitCode));
+    jit->code = code;
+    jit->body = code + as.targets[0];
+    jit->size = as.count;
+    jit->targets = as.targets;
+    function->jit = jit;
+    return true;
+}
+
+void jit_free(JitCode* jit) {
+    if (jit == NULL) {
+        return;
+    }
+    x64_release(jit->code, jit->size);
+    free(jit->targets);
+    free(jit);
+}
+
+JitStatus jit_enter(VM* vm, CallFrame* frame) {
+    JitCode* jit = frame->closure->function->jit;
+    JitStatus (*entry)(CallFrame*, void*);
+    memcpy(&entry, &jit->code, sizeof(entry));
+    return entry(frame, switch_frame(vm, &frame));
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls a function needs before the baseline JIT compiles it.
+#define JIT_HOT_CALLS 100
+
+typedef enum {
+    JIT_CONTINUE,   // keep running compiled code
+    JIT_EXIT_FRAME, // a call or return changed the top frame
+    JIT_EXIT_ERROR,
+    JIT_EXIT_DONE,  // the script returned
+} JitStatus;
+
+bool jit_compile(VM* vm, ObjFunction* function);
+void jit_free(JitCode* code);
+JitStatus jit_enter(VM* vm, CallFrame* frame);
+// Native code for the instruction at frame->ip, or NULL if not compiled.
+uint8_t* jit_resume_point(CallFrame* frame);
+
+// Runs the instruction whose opcode is at frame->ip[-1] the way run() would.
+// Compiled code calls it for everything it does not handle inline.
+JitStatus jit_fallback(VM* vm, CallFrame* frame);
+
+#endif
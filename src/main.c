@@ -5,6 +5,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 #define ERR_USAGE 64
@@ -41,20 +42,37 @@ static char* read_file(const char* path) {
     return buffer;
 }
 
-static void run_file(const char* path) {
+// Returns the process's exit status.
+static int run_file(VM* vm, const char* path) {
     char* source = read_file(path);
-    InterpretResult result = vm_interpret(source);
+    InterpretResult result = vm_interpret(vm, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) {
-        exit(ERR_DATAERR);
+        return ERR_DATAERR;
     }
     if (result == INTERPRET_RUNTIME_ERROR) {
-        exit(ERR_SOFTWARE);
+        return ERR_SOFTWARE;
+    }
+    return 0;
+}
+
+// Writes the collector's statistics to path, or to stderr for "-".
+static void write_gc_stats(VM* vm, const char* path) {
+    FILE* file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[lox] error: could not open file '%s'\n", path);
+        return;
+    }
+    char* json = gc_stats_json(vm);
+    fprintf(file, "%s\n", json);
+    free(json);
+    if (file != stderr) {
+        fclose(file);
     }
 }
 
-static void run_repl() {
+static void run_repl(VM* vm) {
     char line[REPL_LINE_MAX];
     while (true) {
         printf("> ");
@@ -62,22 +80,117 @@ static void run_repl() {
             printf("\n");
             break;
         }
-        vm_interpret(line);
+        vm_interpret(vm, line);
     }
 }
 
+static void usage() {
+    fprintf(stderr, "Usage: clox [--no-jit | --force-jit] [--max-depth=N] [--gc-budget=N] [--gc-threads=N]\n"
+            "            [--gc-compact=PERCENT] [--gc-target=PERCENT] [--gc-min-heap=SIZE]\n"
+            "            [--gc-max-heap=SIZE] [--gc-stats=PATH] [path]\n"
+            "Each --gc- option can also be set from the environment, as LOX_GC_BUDGET\n"
+            "and so on. SIZE takes a K, M or G suffix; a zero --gc-max-heap means none.\n"
+            "--gc-stats writes the collector's statistics as JSON on exit, to stderr for -.\n");
+    exit(ERR_USAGE);
+}
+
+// A collector setting, from a flag or else an environment variable.
+typedef struct {
+    const char* flag;
+    const char* env;
+    size_t* field;
+    size_t min;
+    size_t max;
+    bool is_size; // takes a K, M or G suffix
+} GcOption;
+
+static bool parse_option(const GcOption* option, const char* text) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    if (option->is_size && *end != '\0' && end[1] == '\0') {
+        int shift = *end == 'K' || *end == 'k' ? 10
+                : *end == 'M' || *end == 'm' ? 20
+                : *end == 'G' || *end == 'g' ? 30 : -1;
+        if (shift < 0 || value > (SIZE_MAX >> shift)) {
+            return false;
+        }
+        value <<= shift;
+        end++;
+    }
+    if (*end != '\0' || value < option->min || value > option->max) {
+        return false;
+    }
+    *option->field = (size_t)value;
+    return true;
+}
+
 int main(int argc, const char* argv[]) {
-    init_vm();
+    VM vm;
+    init_vm(&vm);
+
+    GcOption options[] = {
+        {"--gc-budget=", "LOX_GC_BUDGET", &vm.gc_budget, 0, SIZE_MAX, false},
+        {"--gc-threads=", "LOX_GC_THREADS", &vm.gc_threads, 1, GC_MAX_THREADS, false},
+        {"--gc-compact=", "LOX_GC_COMPACT", &vm.gc_compact, 0, 100, false},
+        {"--gc-target=", "LOX_GC_TARGET", &vm.gc_target, 0, 99, false},
+        {"--gc-min-heap=", "LOX_GC_MIN_HEAP", &vm.gc_min_heap, 0, SIZE_MAX, true},
+        {"--gc-max-heap=", "LOX_GC_MAX_HEAP", &vm.gc_max_heap, 0, SIZE_MAX, true},
+    };
+    size_t option_count = sizeof(options) / sizeof(options[0]);
+    for (size_t i = 0; i < option_count; i++) {
+        const char* value = getenv(options[i].env);
+        if (value != NULL && !parse_option(&options[i], value)) {
+            fprintf(stderr, "[lox] error: invalid %s '%s'\n", options[i].env, value);
+            exit(ERR_USAGE);
+        }
+    }
 
-    if (argc == 1) {
-        run_repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    // Where to write the collector's statistics on exit; "-" is stderr.
+    const char* stats_path = getenv("LOX_GC_STATS");
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--no-jit") == 0) {
+            vm.jit_mode = JIT_MODE_OFF;
+        } else if (strcmp(argv[arg], "--force-jit") == 0) {
+            vm.jit_mode = JIT_MODE_FORCE;
+        } else if (strncmp(argv[arg], "--max-depth=", 12) == 0) {
+            char* end;
+            unsigned long depth = strtoul(argv[arg] + 12, &end, 10);
+            if (*end != '\0' || depth == 0) {
+                usage();
+            }
+            vm.max_frames = depth;
+        } else if (strncmp(argv[arg], "--gc-stats=", 11) == 0) {
+            stats_path = argv[arg] + 11;
+        } else {
+            size_t i = 0;
+            while (i < option_count && strncmp(argv[arg], options[i].flag, strlen(options[i].flag)) != 0) {
+                i++;
+            }
+            if (i == option_count || !parse_option(&options[i], argv[arg] + strlen(options[i].flag))) {
+                usage();
+            }
+        }
+    }
+    // The first cycle waits for the minimum heap like every later one.
+    vm.gc_threshold = vm.gc_min_heap;
+
+    int status = 0;
+    if (arg == argc) {
+        run_repl(&vm);
+    } else if (arg == argc - 1) {
+        status = run_file(&vm, argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(ERR_USAGE);
+        usage();
     }
 
-    free_vm();
-    return 0;
+    if (stats_path != NULL) {
+        write_gc_stats(&vm, stats_path);
+    }
+    free_vm(&vm);
+    return status;
 }
@@ -1,7 +1,15 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -10,95 +18,371 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bounds on how far pacing lets the heap grow past what a cycle left.
+#define GC_MIN_GROWTH 1.25
+#define GC_MAX_GROWTH 4.0
+#define GC_DEFAULT_TARGET 5
+#define GC_DEFAULT_MIN_HEAP (1024 * 1024)
+#define GC_NURSERY_SIZE (1024 * 1024)
+// Gray objects a marking thread keeps to itself before offering some to the
+// others.
+#define GC_SHARE_BATCH 64
+// Below this heap size, marking on one thread beats starting the others.
+#define GC_PARALLEL_MIN_HEAP (4 * 1024 * 1024)
+// Object cells below which the heap is never worth compacting.
+#ifdef DEBUG_STRESS_GC
+// Any heap with a block in it, which keeps the comparison meaningful.
+#define GC_COMPACT_MIN_HEAP 1
+#else
+#define GC_COMPACT_MIN_HEAP (1024 * 1024)
+#endif
+// Objects swept per safepoint, when no budget is set, and per old-generation
+// allocation while a sweep is under way.
+#define GC_SWEEP_SLICE 1024
+#define GC_SWEEP_PER_ALLOCATION 8
+
+// Mark bits live in heap blocks, so every old object must fit a cell.
+_Static_assert(sizeof(ObjFunction) <= HEAP_MAX_SMALL, "ObjFunction outgrew the heap cells");
+_Static_assert(sizeof(ObjClass) <= HEAP_MAX_SMALL, "ObjClass outgrew the heap cells");
+_Static_assert(sizeof(ObjShape) <= HEAP_MAX_SMALL, "ObjShape outgrew the heap cells");
+
+// One marking thread's gray objects: a private stack it pushes and pops
+// without locking, and a shared one the other threads steal from.
+typedef struct {
+    VM* vm;
+    ObjArray local;
+    ObjArray shared;
+    pthread_mutex_t lock;
+    struct ParallelMark* mark;
+    size_t index;
+} GcWorker;
+
+typedef struct ParallelMark {
+    GcWorker* workers;
+    size_t count;
+    // Threads that hold gray objects or are trying to steal some.
+    atomic_size_t active;
+} ParallelMark;
 
-void* reallocate(void* prev_ptr, size_t old_size, size_t new_size) {
-    vm.bytes_allocated += new_size - old_size;
+// The marking thread the calling thread is, if any.
+static _Thread_local GcWorker* current_worker = NULL;
+
+// Allocation never collects: objects the VM is still wiring up are only
+// reachable from C locals. It asks for a collection instead, which the
+// interpreter runs at its next safepoint.
+static void account(VM* vm, size_t old_size, size_t new_size) {
+    vm->bytes_allocated += new_size - old_size;
 
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
-        gc_collect();
+        vm->gc_pending = true;
 #endif
-        if (vm.bytes_allocated > vm.gc_threshold) {
-            gc_collect();
+        if (vm->bytes_allocated > vm->gc_threshold ||
+                (vm->gc_max_heap != 0 && vm->bytes_allocated > vm->gc_max_heap)) {
+            vm->gc_pending = true;
         }
     }
+}
 
-    if (new_size == 0) {
-        free(prev_ptr);
-        return NULL;
-    }
-    void* ptr = realloc(prev_ptr, new_size);
-    if (ptr == NULL) {
-        fprintf(stderr, "[lox] error: failed to reallocate memory\n");
-        exit(1);
-    }
-    return ptr;
+void* reallocate(VM* vm, void* prev_ptr, size_t old_size, size_t new_size) {
+    account(vm, old_size, new_size);
+    return heap_reallocate(&vm->heap, prev_ptr, old_size, new_size);
 }
 
-static void free_object(Obj* object) {
+// Old objects have object cells to themselves, where compaction can find
+// them.
+static Obj* allocate_old(VM* vm, size_t size) {
+    account(vm, 0, size);
+    return (Obj*)heap_allocate_object(&vm->heap, size);
+}
+
+static void free_old(VM* vm, Obj* object, size_t size) {
+    account(vm, size, 0);
+    heap_free_object(&vm->heap, object, size);
+}
+
+#define FREE_OBJ(vm, type, object) free_old(vm, object, sizeof(type))
+
+static void free_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (string->chars != NULL && !string_is_inline(string)) {
+                FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            }
+            free_old(vm, object, string_size(string));
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            free_chunk(&function->chunk);
-            FREE(ObjFunction, object);
+            free_chunk(vm, &function->chunk);
+#ifdef JIT
+            jit_free(function->jit);
+#endif
+            FREE_OBJ(vm, ObjFunction, object);
             break;
         }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(vm, ObjUpvalue, object);
             break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalue_count);
+            FREE_OBJ(vm, ObjClosure, object);
             break;
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJ(vm, ObjNative, object);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            free_table(&klass->methods);
-            FREE(ObjClass, object);
+            free_table(vm, &klass->methods);
+            FREE_OBJ(vm, ObjClass, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            free_table(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inline_fields) {
+                FREE_ARRAY(vm, Value, instance->fields, instance->field_capacity);
+            }
+            free_old(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance->inline_capacity);
             break;
         }
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(vm, ObjBoundMethod, object);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            free_table(vm, &shape->transitions);
+            FREE_OBJ(vm, ObjShape, object);
+            break;
+        }
+        case OBJ_WEAK_REF:
+            FREE_OBJ(vm, ObjWeakRef, object);
+            break;
+        case OBJ_WEAK_MAP: {
+            ObjWeakMap* map = (ObjWeakMap*)object;
+            free_table(vm, &map->table);
+            FREE_OBJ(vm, ObjWeakMap, object);
             break;
         }
     }
 }
 
-void free_objects() {
-    Obj* object = vm.objects;
+static void gc_sweep_step(VM* vm, size_t budget);
+
+static void push_object(ObjArray* array, Obj* object) {
+    if (array->capacity < array->count + 1) {
+        array->capacity = GROW_CAPACITY(array->capacity);
+        array->objects = realloc(array->objects, sizeof(Obj*) * array->capacity);
+        if (array->objects == NULL) {
+            exit(1);
+        }
+    }
+    array->objects[array->count++] = object;
+}
+
+// Frees what a young object owns outside the nursery. The object itself goes
+// when the nursery is reset.
+static void free_young_object(VM* vm, Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->chars != NULL && !string_is_inline(string)) {
+                FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalue_count);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            if (instance->fields != instance->inline_fields) {
+                FREE_ARRAY(vm, Value, instance->fields, instance->field_capacity);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void init_gc(VM* vm) {
+    init_heap(&vm->heap);
+    vm->objects = NULL;
+    vm->nursery = malloc(GC_NURSERY_SIZE);
+    if (vm->nursery == NULL) {
+        fprintf(stderr, "[lox] error: failed to allocate the nursery\n");
+        exit(1);
+    }
+    vm->nursery_top = vm->nursery;
+    vm->nursery_end = vm->nursery + GC_NURSERY_SIZE;
+    vm->sweeping = NULL;
+    vm->remembered = (ObjArray){NULL, 0, 0};
+    vm->young_owners = (ObjArray){NULL, 0, 0};
+    vm->weak_objects = (ObjArray){NULL, 0, 0};
+    vm->gc_pending = false;
+    vm->gc_phase = GC_IDLE;
+    vm->gc_budget = 0;
+    vm->gc_threads = 1;
+    vm->gc_compact = 0;
+    vm->gc_compact_pending = false;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->bytes_allocated = 0;
+    vm->gc_target = GC_DEFAULT_TARGET;
+    vm->gc_min_heap = GC_DEFAULT_MIN_HEAP;
+    vm->gc_max_heap = 0;
+    vm->gc_threshold = vm->gc_min_heap;
+    vm->gc_live = 0;
+    vm->gc_time = 0;
+    vm->gc_period_start = clock();
+    memset(&vm->gc_stats, 0, sizeof(vm->gc_stats));
+}
+
+static void free_list(VM* vm, Obj* object) {
     while (object != NULL) {
         Obj* next = object->next;
-        free_object(object);
+        free_object(vm, object);
         object = next;
     }
-    free(vm.gray_stack);
 }
 
-void gc_mark_object(Obj* object) {
-    if (object == NULL) {
+void free_objects(VM* vm) {
+    free_list(vm, vm->objects);
+    for (size_t i = 0; i < vm->young_owners.count; i++) {
+        free_young_object(vm, vm->young_owners.objects[i]);
+    }
+    free(vm->young_owners.objects);
+    free(vm->weak_objects.objects);
+    free(vm->remembered.objects);
+    free(vm->nursery);
+    free(vm->gray_stack);
+    free_heap(&vm->heap);
+}
+
+static bool can_be_young(ObjType type) {
+    switch (type) {
+        case OBJ_STRING:
+        case OBJ_UPVALUE:
+        case OBJ_CLOSURE:
+        case OBJ_INSTANCE:
+        case OBJ_BOUND_METHOD:
+            return true;
+        default:
+            // Functions, classes, shapes and natives live as long as the
+            // program's code does. Weak refs and maps must stay old too:
+            // gc_forward_weak() forwards every tracked weak object, which
+            // would promote one that died young instead of dropping it.
+            return false;
+    }
+}
+
+// Objects start out in the nursery, except for long-lived types, anything
+// the compiler makes and anything that does not fit.
+Obj* gc_allocate_object(VM* vm, size_t size, ObjType type) {
+    vm->gc_stats.allocations[type]++;
+    vm->gc_stats.allocated_bytes[type] += size;
+    if (can_be_young(type) && vm->parser == NULL) {
+        size_t aligned = (size + 7) & ~(size_t)7;
+        if (aligned <= (size_t)(vm->nursery_end - vm->nursery_top)) {
+            Obj* object = (Obj*)vm->nursery_top;
+            vm->nursery_top += aligned;
+            object->type = type;
+            object->is_remembered = true;
+            object->next = NULL;
+#ifdef DEBUG_STRESS_GC
+            vm->gc_pending = true;
+#endif
+            return object;
+        }
+        // Whatever else this instruction allocates goes old too, and the
+        // safepoint sees a full nursery.
+        vm->nursery_top = vm->nursery_end;
+        vm->gc_pending = true;
+    }
+
+    // Old objects pay for the sweep, so it keeps ahead of the mutator.
+    if (vm->gc_phase == GC_SWEEPING) {
+        gc_sweep_step(vm, GC_SWEEP_PER_ALLOCATION);
+    }
+    Obj* object = allocate_old(vm, size);
+    object->type = type;
+    object->is_remembered = false;
+    object->next = vm->objects;
+    vm->objects = object;
+    // Its fields are about to be set without write barriers.
+    if (type != OBJ_STRING && type != OBJ_NATIVE) {
+        gc_remember(vm, object);
+    }
+    // Objects allocated during marking are live, and get traced once the
+    // interpreter reaches a safepoint and has filled them in. During a sweep
+    // they are marked so the sweep leaves them be.
+    if (vm->gc_phase == GC_MARKING) {
+        gc_mark_object(vm, object);
+    } else if (vm->gc_phase == GC_SWEEPING) {
+        heap_set_mark(object);
+    }
+    return object;
+}
+
+// Young objects that own memory, and young strings, which the string table
+// refers to, are listed so a minor collection can deal with the dead ones
+// without walking the nursery.
+void gc_own_memory(VM* vm, Obj* object) {
+    if (gc_is_young(vm, object)) {
+        push_object(&vm->young_owners, object);
+    }
+}
+
+// Weak references and maps are listed so the collector can clear them
+// without tracing through them. They are always old.
+void gc_track_weak(VM* vm, Obj* object) {
+    push_object(&vm->weak_objects, object);
+}
+
+void gc_remember(VM* vm, Obj* object) {
+    if (object->is_remembered) {
         return;
     }
-    if (object->is_marked) {
+    object->is_remembered = true;
+    push_object(&vm->remembered, object);
+}
+
+static void gc_push_gray(VM* vm, Obj* object) {
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack = realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
+        if (vm->gray_stack == NULL) {
+            exit(1);
+        }
+    }
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+// Young objects are never marked: the minor collection that ends marking
+// promotes the live ones and traces them.
+void gc_mark_object(VM* vm, Obj* object) {
+    if (object == NULL || gc_is_young(vm, object)) {
+        return;
+    }
+    if (current_worker != NULL) {
+        // Marking threads race to mark shared objects; the winner traces it.
+        if (heap_set_mark_atomic(object)) {
+            push_object(&current_worker->local, object);
+        }
+        return;
+    }
+    if (heap_is_marked(object)) {
         return;
     }
 #ifdef DEBUG_LOG_GC
@@ -106,31 +390,35 @@ void gc_mark_object(Obj* object) {
     print_value(BOX_OBJ(object));
     printf("\n");
 #endif
-    object->is_marked = true;
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack = realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
-        if (vm.gray_stack == NULL) {
-            exit(1);
-        }
-    }
-    vm.gray_stack[vm.gray_count++] = object;
+    heap_set_mark(object);
+    gc_push_gray(vm, object);
 }
 
-void gc_mark_value(Value value) {
+void gc_mark_value(VM* vm, Value value) {
     if (!IS_OBJ(value)) {
         return;
     }
-    gc_mark_object(RAW_OBJ(value));
+    gc_mark_object(vm, RAW_OBJ(value));
 }
 
-static void gc_mark_array(ValueArray* array) {
+static void gc_mark_array(VM* vm, ValueArray* array) {
     for (size_t i = 0; i < array->count; i++) {
-        gc_mark_value(array->values[i]);
+        gc_mark_value(vm, array->values[i]);
     }
 }
 
-static void gc_blacken_object(Obj* object) {
+static void gc_mark_caches(VM* vm, Chunk* chunk) {
+    for (size_t i = 0; i < chunk->cache_count; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        for (size_t j = 0; j < cache->count; j++) {
+            gc_mark_object(vm, (Obj*)cache->entries[j].shape);
+            gc_mark_object(vm, (Obj*)cache->entries[j].transition);
+            gc_mark_object(vm, (Obj*)cache->entries[j].method);
+        }
+    }
+}
+
+static void gc_blacken_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     print_value(BOX_OBJ(object));
@@ -139,103 +427,858 @@ static void gc_blacken_object(Obj* object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            gc_mark_value(bound->receiver);
-            gc_mark_object((Obj*)bound->method);
+            gc_mark_value(vm, bound->receiver);
+            gc_mark_object(vm, (Obj*)bound->method);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            gc_mark_object((Obj*)instance->klass);
-            table_mark_reachable(&instance->fields);
+            gc_mark_object(vm, (Obj*)instance->klass);
+            gc_mark_object(vm, (Obj*)instance->shape);
+            for (size_t i = 0; i < instance->shape->field_count; i++) {
+                gc_mark_value(vm, instance->fields[i]);
+            }
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            gc_mark_object((Obj*)klass->name);
-            table_mark_reachable(&klass->methods);
+            gc_mark_object(vm, (Obj*)klass->name);
+            table_mark_reachable(vm, &klass->methods);
+            gc_mark_object(vm, (Obj*)klass->shape);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            gc_mark_object((Obj*)closure->function);
+            gc_mark_object(vm, (Obj*)closure->function);
             for (size_t i = 0; i < closure->upvalue_count; i++) {
-                gc_mark_object((Obj*)closure->upvalues[i]);
+                gc_mark_object(vm, (Obj*)closure->upvalues[i]);
             }
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            gc_mark_object((Obj*)function->name);
-            gc_mark_array(&function->chunk.constants);
+            gc_mark_object(vm, (Obj*)function->name);
+            gc_mark_array(vm, &function->chunk.constants);
+            gc_mark_caches(vm, &function->chunk);
             break;
         }
         case OBJ_UPVALUE:
-            gc_mark_value(((ObjUpvalue*)object)->closed);
+            gc_mark_value(vm, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            gc_mark_object(vm, (Obj*)shape->parent);
+            gc_mark_object(vm, (Obj*)shape->name);
+            table_mark_reachable(vm, &shape->transitions);
+            break;
+        }
+        case OBJ_WEAK_MAP: {
+            // The keys are weak; see gc_clear_weak.
+            Table* table = &((ObjWeakMap*)object)->table;
+            size_t capacity = table_current_capacity(table);
+            for (size_t i = 0; i < capacity; i++) {
+                gc_mark_value(vm, table->entries[i].value);
+            }
             break;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->chars == NULL) {
+                gc_mark_object(vm, (Obj*)string->left);
+                gc_mark_object(vm, (Obj*)string->right);
+            }
+            break;
+        }
+        case OBJ_WEAK_REF:
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
 
-static void gc_mark_roots() {
-    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-        gc_mark_value(*slot);
+// The roots stores into which have no barrier. They are marked again at the
+// end of an incremental cycle.
+static void gc_mark_stack_roots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
+        gc_mark_value(vm, *slot);
     }
-    for (size_t i = 0; i < vm.frame_count; i++) {
-        gc_mark_object((Obj*)vm.frames[i].closure);
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        gc_mark_object(vm, (Obj*)vm->frames[i].closure);
     }
-    for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
-        gc_mark_object((Obj*)upvalue);
+    for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        gc_mark_object(vm, (Obj*)upvalue);
     }
-    table_mark_reachable(&vm.globals);
-    compiler_mark_roots();
-    gc_mark_object((Obj*)vm.init_string);
 }
 
-static void gc_trace_references() {
-    while (vm.gray_count > 0) {
-        Obj* object = vm.gray_stack[--vm.gray_count];
-        gc_blacken_object(object);
+static void gc_mark_roots(VM* vm) {
+    gc_mark_stack_roots(vm);
+    table_mark_reachable(vm, &vm->global_slots);
+    gc_mark_array(vm, &vm->global_names);
+    gc_mark_array(vm, &vm->global_values);
+    compiler_mark_roots(vm);
+    gc_mark_object(vm, (Obj*)vm->init_string);
+}
+
+// Moves up to half of from's objects, and at least one, to the top of to.
+static void move_objects(ObjArray* from, ObjArray* to) {
+    size_t count = (from->count + 1) / 2;
+    for (size_t i = 0; i < count; i++) {
+        push_object(to, from->objects[--from->count]);
     }
 }
 
-static void gc_sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->is_marked) {
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
+// Offers a batch of a growing private stack to the other threads.
+static void gc_share(GcWorker* worker) {
+    if (worker->local.count < 2 * GC_SHARE_BATCH) {
+        return;
+    }
+    pthread_mutex_lock(&worker->lock);
+    if (worker->shared.count == 0) {
+        for (size_t i = 0; i < GC_SHARE_BATCH; i++) {
+            push_object(&worker->shared, worker->local.objects[--worker->local.count]);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Takes gray objects from the worker's own shared stack, or failing that
+// steals half of another thread's.
+static bool gc_steal(GcWorker* worker) {
+    ParallelMark* mark = worker->mark;
+    for (size_t i = 0; i < mark->count; i++) {
+        GcWorker* victim = &mark->workers[(worker->index + i) % mark->count];
+        pthread_mutex_lock(&victim->lock);
+        bool found = victim->shared.count > 0;
+        if (found) {
+            if (victim == worker) {
+                while (victim->shared.count > 0) {
+                    move_objects(&victim->shared, &worker->local);
+                }
+            } else {
+                move_objects(&victim->shared, &worker->local);
+            }
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Traces until every thread is out of gray objects. A thread only goes
+// idle with both of its stacks empty, and only the owner fills its shared
+// stack, so once no thread is active there is nothing left to mark.
+static void* gc_mark_worker(void* arg) {
+    GcWorker* worker = (GcWorker*)arg;
+    ParallelMark* mark = worker->mark;
+    current_worker = worker;
+    while (true) {
+        while (worker->local.count > 0) {
+            gc_blacken_object(worker->vm, worker->local.objects[--worker->local.count]);
+            gc_share(worker);
+        }
+        if (gc_steal(worker)) {
+            continue;
+        }
+        atomic_fetch_sub(&mark->active, 1);
+        bool stolen = false;
+        while (!stolen && atomic_load(&mark->active) > 0) {
+            atomic_fetch_add(&mark->active, 1);
+            stolen = gc_steal(worker);
+            if (!stolen) {
+                atomic_fetch_sub(&mark->active, 1);
+                sched_yield();
+            }
+        }
+        if (!stolen) {
+            break;
+        }
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+// Drains the gray stack on gc_threads threads, the calling one included.
+static void gc_trace_parallel(VM* vm) {
+    ParallelMark mark;
+    mark.count = vm->gc_threads;
+    mark.workers = malloc(sizeof(GcWorker) * mark.count);
+    pthread_t* threads = malloc(sizeof(pthread_t) * mark.count);
+    bool* started = malloc(sizeof(bool) * mark.count);
+    if (mark.workers == NULL || threads == NULL || started == NULL) {
+        exit(1);
+    }
+    atomic_init(&mark.active, mark.count);
+
+    for (size_t i = 0; i < mark.count; i++) {
+        GcWorker* worker = &mark.workers[i];
+        worker->vm = vm;
+        worker->local = (ObjArray){NULL, 0, 0};
+        worker->shared = (ObjArray){NULL, 0, 0};
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->mark = &mark;
+        worker->index = i;
+    }
+    for (size_t i = 0; i < vm->gray_count; i++) {
+        push_object(&mark.workers[i % mark.count].shared, vm->gray_stack[i]);
+    }
+    vm->gray_count = 0;
+
+    for (size_t i = 1; i < mark.count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, gc_mark_worker, &mark.workers[i]) == 0;
+        if (!started[i]) {
+            // The others steal its share.
+            atomic_fetch_sub(&mark.active, 1);
+        }
+    }
+    gc_mark_worker(&mark.workers[0]);
+    for (size_t i = 1; i < mark.count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (size_t i = 0; i < mark.count; i++) {
+        free(mark.workers[i].local.objects);
+        free(mark.workers[i].shared.objects);
+        pthread_mutex_destroy(&mark.workers[i].lock);
+    }
+    free(started);
+    free(threads);
+    free(mark.workers);
+}
+
+// Blackens up to budget gray objects. Returns the budget left.
+static size_t gc_trace_references(VM* vm, size_t budget) {
+    if (budget == SIZE_MAX && vm->gc_threads > 1 && vm->bytes_allocated >= GC_PARALLEL_MIN_HEAP) {
+        gc_trace_parallel(vm);
+        return budget;
+    }
+    while (budget > 0 && vm->gray_count > 0) {
+        Obj* object = vm->gray_stack[--vm->gray_count];
+        gc_blacken_object(vm, object);
+        budget--;
+    }
+    return budget;
+}
+
+// Sweeps up to budget objects off the list marking left behind. Survivors
+// rejoin the objects list, where objects allocated meanwhile already are.
+static size_t gc_sweep(VM* vm, size_t budget) {
+    while (budget > 0 && *vm->sweeping != NULL) {
+        Obj* object = *vm->sweeping;
+        if (heap_is_marked(object)) {
+            vm->sweeping = &object->next;
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
+            *vm->sweeping = object->next;
+            size_t before = vm->bytes_allocated;
+            free_object(vm, object);
+            vm->gc_stats.bytes_reclaimed += before - vm->bytes_allocated;
+        }
+        budget--;
+    }
+    return budget;
+}
+
+static size_t young_size(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:       return string_size((ObjString*)object);
+        case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+        case OBJ_CLOSURE:      return sizeof(ObjClosure);
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inline_capacity;
+        default:
+            return 0; // Never young.
+    }
+}
+
+// Fixes the pointers a moved object had into itself.
+static void fix_interior(Obj* object, Obj* copy) {
+    if (object->type == OBJ_STRING) {
+        ObjString* string = (ObjString*)copy;
+        if (string_is_inline((ObjString*)object)) {
+            string->chars = string->inline_chars;
+        }
+    } else if (object->type == OBJ_INSTANCE) {
+        ObjInstance* instance = (ObjInstance*)copy;
+        if (((ObjInstance*)object)->fields == ((ObjInstance*)object)->inline_fields) {
+            instance->fields = instance->inline_fields;
+        }
+    } else if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+        if (upvalue->location == &((ObjUpvalue*)object)->closed) {
+            upvalue->location = &upvalue->closed;
+        }
+    }
+}
+
+// Copies a surviving young object into the old generation, the first time
+// it is reached, and queues the copy to have its own fields forwarded.
+// During compaction, old objects in evacuated blocks have moved too.
+// Returns where the object lives now.
+Obj* gc_forward(VM* vm, Obj* object) {
+    if (object == NULL) {
+        return object;
+    }
+    if (!gc_is_young(vm, object)) {
+        if (vm->gc_phase == GC_COMPACTING && heap_is_evacuated(object)) {
+            return object->next;
+        }
+        return object;
+    }
+    if (object->next != NULL) {
+        return object->next;
+    }
+
+    size_t size = young_size(object);
+    Obj* copy = allocate_old(vm, size);
+    vm->gc_stats.bytes_promoted += size;
+    memcpy(copy, object, size);
+    copy->is_remembered = false;
+    // While marking, the copy stays gray for the marker to trace.
+    if (vm->gc_phase != GC_IDLE) {
+        heap_set_mark(copy);
+    }
+    copy->next = vm->objects;
+    vm->objects = copy;
+    object->next = copy;
+    fix_interior(object, copy);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif
+    gc_push_gray(vm, copy);
+    return copy;
+}
+
+void gc_forward_value(VM* vm, Value* slot) {
+    if (!IS_OBJ(*slot)) {
+        return;
+    }
+    Obj* object = RAW_OBJ(*slot);
+    Obj* moved = gc_forward(vm, object);
+    if (moved != object) {
+        *slot = BOX_OBJ(moved);
+    }
+}
+
+#define FORWARD(vm, field) ((field) = (void*)gc_forward(vm, (Obj*)(field)))
+
+static void gc_forward_array(VM* vm, ValueArray* array) {
+    for (size_t i = 0; i < array->count; i++) {
+        gc_forward_value(vm, &array->values[i]);
+    }
+}
+
+// Points an old object's fields at wherever what they refer to lives now.
+// An upvalue's next link is left alone: only open upvalues use it, and the
+// open list is a root.
+static void gc_forward_fields(VM* vm, Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            gc_forward_value(vm, &bound->receiver);
+            FORWARD(vm, bound->method);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FORWARD(vm, instance->klass);
+            FORWARD(vm, instance->shape);
+            for (size_t i = 0; i < instance->shape->field_count; i++) {
+                gc_forward_value(vm, &instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            FORWARD(vm, klass->name);
+            table_forward(vm, &klass->methods);
+            FORWARD(vm, klass->shape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FORWARD(vm, closure->function);
+            for (size_t i = 0; i < closure->upvalue_count; i++) {
+                FORWARD(vm, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            Chunk* chunk = &function->chunk;
+            FORWARD(vm, function->name);
+            gc_forward_array(vm, &chunk->constants);
+            for (size_t i = 0; i < chunk->cache_count; i++) {
+                InlineCache* cache = &chunk->caches[i];
+                for (size_t j = 0; j < cache->count; j++) {
+                    FORWARD(vm, cache->entries[j].shape);
+                    FORWARD(vm, cache->entries[j].transition);
+                    FORWARD(vm, cache->entries[j].method);
+                }
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            gc_forward_value(vm, &((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            FORWARD(vm, shape->parent);
+            FORWARD(vm, shape->name);
+            table_forward(vm, &shape->transitions);
+            break;
+        }
+        case OBJ_WEAK_MAP: {
+            // The keys are weak; see gc_forward_weak.
+            Table* table = &((ObjWeakMap*)object)->table;
+            size_t capacity = table_current_capacity(table);
+            for (size_t i = 0; i < capacity; i++) {
+                gc_forward_value(vm, &table->entries[i].value);
+            }
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->chars == NULL) {
+                FORWARD(vm, string->left);
+                FORWARD(vm, string->right);
+            }
+            break;
+        }
+        case OBJ_WEAK_REF:
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+static bool is_dead_young(VM* vm, Obj* object) {
+    return gc_is_young(vm, object) && object->next == NULL;
+}
+
+// Runs once everything strongly reachable has been forwarded. Weak targets
+// and keys that were young and not promoted are dead and dropped; the rest
+// are pointed at where they live now.
+static void gc_forward_weak(VM* vm) {
+    for (size_t i = 0; i < vm->weak_objects.count; i++) {
+        Obj* object = gc_forward(vm, vm->weak_objects.objects[i]);
+        vm->weak_objects.objects[i] = object;
+        if (object->type == OBJ_WEAK_REF) {
+            ObjWeakRef* ref = (ObjWeakRef*)object;
+            if (IS_OBJ(ref->target) && is_dead_young(vm, RAW_OBJ(ref->target))) {
+                ref->target = BOX_NIL;
+            } else {
+                gc_forward_value(vm, &ref->target);
+            }
+            continue;
+        }
+        Table* table = &((ObjWeakMap*)object)->table;
+        size_t capacity = table_current_capacity(table);
+        for (size_t j = 0; j < capacity; j++) {
+            Entry* entry = &table->entries[j];
+            if (entry->key == NULL) {
+                continue;
+            }
+            if (is_dead_young(vm, (Obj*)entry->key)) {
+                table_delete(table, entry->key);
             } else {
-                vm.objects = object;
+                entry->key = (ObjString*)gc_forward(vm, (Obj*)entry->key);
+            }
+        }
+    }
+}
+
+// Runs once marking is done, before the sweep frees anything. Weak objects
+// that are dead themselves leave the list; the others lose the targets and
+// keys marking did not reach.
+static void gc_clear_weak(VM* vm) {
+    size_t kept = 0;
+    for (size_t i = 0; i < vm->weak_objects.count; i++) {
+        Obj* object = vm->weak_objects.objects[i];
+        if (!heap_is_marked(object)) {
+            continue;
+        }
+        vm->weak_objects.objects[kept++] = object;
+        if (object->type == OBJ_WEAK_REF) {
+            ObjWeakRef* ref = (ObjWeakRef*)object;
+            if (IS_OBJ(ref->target) && !heap_is_marked(RAW_OBJ(ref->target))) {
+                ref->target = BOX_NIL;
             }
-            free_object(unreached);
+        } else {
+            table_remove_unreachable(vm, &((ObjWeakMap*)object)->table);
         }
     }
+    vm->weak_objects.count = kept;
+}
+
+// Collection never happens while compiling, so the compiler has no roots
+// here.
+static void gc_forward_roots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
+        gc_forward_value(vm, slot);
+    }
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        FORWARD(vm, vm->frames[i].closure);
+    }
+    for (ObjUpvalue** link = &vm->open_upvalues; *link != NULL; link = &(*link)->next) {
+        FORWARD(vm, *link);
+    }
+    table_forward(vm, &vm->global_slots);
+    gc_forward_array(vm, &vm->global_names);
+    gc_forward_array(vm, &vm->global_values);
+    FORWARD(vm, vm->init_string);
 }
 
-void gc_collect() {
+// Promotes the live young objects. Only the roots, the remembered set and
+// the survivors are visited; dead young objects cost nothing unless they
+// own memory.
+static void gc_minor(VM* vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+#endif
+    size_t young = (size_t)(vm->nursery_top - vm->nursery);
+    size_t promoted = vm->gc_stats.bytes_promoted;
+
+    // Copies are queued on the gray stack above whatever marking left there
+    // and scanned in place.
+    size_t scan = vm->gray_count;
+    size_t first_copy = scan;
+    gc_forward_roots(vm);
+    for (size_t i = 0; i < vm->remembered.count; i++) {
+        Obj* object = vm->remembered.objects[i];
+        object->is_remembered = false;
+        gc_forward_fields(vm, object);
+    }
+    vm->remembered.count = 0;
+    while (scan < vm->gray_count) {
+        gc_forward_fields(vm, vm->gray_stack[scan++]);
+    }
+    if (vm->gc_phase != GC_MARKING) {
+        vm->gray_count = first_copy;
+    }
+    gc_forward_weak(vm);
+
+    for (size_t i = 0; i < vm->young_owners.count; i++) {
+        Obj* object = vm->young_owners.objects[i];
+        if (object->type == OBJ_STRING && string_is_interned((ObjString*)object)) {
+            table_delete(&vm->strings, (ObjString*)object);
+            if (object->next != NULL) {
+                table_set(vm, &vm->strings, (ObjString*)object->next, BOX_NIL);
+            }
+        }
+        if (object->next == NULL) {
+            free_young_object(vm, object);
+        }
+    }
+    vm->young_owners.count = 0;
+
+#ifdef DEBUG_STRESS_GC
+    // Stale pointers into the nursery now read garbage.
+    memset(vm->nursery, 0xbd, (size_t)(vm->nursery_top - vm->nursery));
+#endif
+    vm->nursery_top = vm->nursery;
+    vm->gc_stats.minor_collections++;
+    vm->gc_stats.bytes_reclaimed += young - (vm->gc_stats.bytes_promoted - promoted);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   nursery held %zu bytes, old generation now %zu\n", young, vm->bytes_allocated);
+#endif
+}
+
+static void gc_begin_cycle(VM* vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
 #endif
+    vm->gc_phase = GC_MARKING;
+    heap_clear_marks(&vm->heap);
+    gc_mark_roots(vm);
+}
 
-    gc_mark_roots();
-    gc_trace_references();
-    gc_sweep();
+// Ends marking once the gray stack runs dry. Live young objects are
+// promoted and traced, and the roots without barriers marked again; this
+// final part is not bounded by the budget.
+static void gc_finish_marking(VM* vm) {
+    gc_minor(vm);
+    gc_mark_stack_roots(vm);
+    gc_trace_references(vm, SIZE_MAX);
+    // The string table holds its strings weakly, like a weak map's keys.
+    table_remove_unreachable(vm, &vm->strings);
+    gc_clear_weak(vm);
+    vm->sweeping = &vm->objects;
+    vm->gc_phase = GC_SWEEPING;
+}
 
-    vm.gc_threshold = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+static bool gc_fragmented(VM* vm) {
+    Heap* heap = &vm->heap;
+    if (vm->gc_compact == 0 || heap->object_capacity < GC_COMPACT_MIN_HEAP) {
+        return false;
+    }
+    return (heap->object_capacity - heap->object_bytes) * 100 > heap->object_capacity * vm->gc_compact;
+}
+
+// Sets where the next cycle starts. The mutator's allocation rate and the
+// cost of a cycle carry over from one period to the next, so the share of
+// CPU time collection takes falls in proportion as the headroom above the
+// live heap grows. The last headroom is scaled by how far its share was
+// from the target.
+static void gc_pace(VM* vm) {
+    size_t live = vm->bytes_allocated;
+    clock_t now = clock();
+    double growth = GC_HEAP_GROW_FACTOR;
+    if (vm->gc_target > 0 && vm->gc_live > 0 && vm->gc_threshold > vm->gc_live && live > 0) {
+        double gc = (double)vm->gc_time;
+        double mutator = (double)(now - vm->gc_period_start) - gc;
+        double target = vm->gc_target / 100.0;
+        double headroom = (double)(vm->gc_threshold - vm->gc_live);
+        if (mutator > 0) {
+            headroom *= (gc / mutator) / (target / (1 - target));
+            growth = 1 + headroom / live;
+        } else {
+            growth = GC_MAX_GROWTH;
+        }
+        growth = growth < GC_MIN_GROWTH ? GC_MIN_GROWTH : growth > GC_MAX_GROWTH ? GC_MAX_GROWTH : growth;
+    }
 
+    vm->gc_threshold = (size_t)(live * growth);
+    if (vm->gc_threshold < vm->gc_min_heap) {
+        vm->gc_threshold = vm->gc_min_heap;
+    }
+    if (vm->gc_max_heap != 0 && vm->gc_threshold > vm->gc_max_heap) {
+        vm->gc_threshold = vm->gc_max_heap;
+    }
+    vm->gc_live = live;
+    vm->gc_time = 0;
+    vm->gc_period_start = now;
+}
+
+static void gc_finish_cycle(VM* vm) {
+    vm->gc_phase = GC_IDLE;
+    vm->gc_stats.major_collections++;
+    gc_pace(vm);
+    // The sweep may end outside a safepoint, so compaction waits for one.
+    if (gc_fragmented(vm)) {
+        vm->gc_compact_pending = true;
+        vm->gc_pending = true;
+    }
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-            before - vm.bytes_allocated, before, vm.bytes_allocated, vm.gc_threshold);
+    printf("   heap now %zu bytes, next at %zu\n", vm->bytes_allocated, vm->gc_threshold);
+#endif
+}
+
+static void gc_sweep_step(VM* vm, size_t budget) {
+    gc_sweep(vm, budget);
+    if (*vm->sweeping == NULL) {
+        vm->sweeping = NULL;
+        gc_finish_cycle(vm);
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void record_pause(GcStats* stats, uint64_t ns) {
+    stats->pauses++;
+    stats->pause_total_ns += ns;
+    if (ns > stats->pause_max_ns) {
+        stats->pause_max_ns = ns;
+    }
+    size_t bucket = 0;
+    for (uint64_t us = ns / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    stats->pause_histogram[bucket]++;
+}
+
+// Finishes any cycle in progress, then runs a whole new one, so everything
+// dead by now is freed.
+static void gc_full(VM* vm) {
+    gc_minor(vm);
+    if (vm->gc_phase == GC_MARKING) {
+        gc_trace_references(vm, SIZE_MAX);
+        gc_finish_marking(vm);
+    }
+    if (vm->gc_phase == GC_SWEEPING) {
+        gc_sweep_step(vm, SIZE_MAX);
+    }
+    gc_begin_cycle(vm);
+    gc_trace_references(vm, SIZE_MAX);
+    gc_finish_marking(vm);
+    gc_sweep_step(vm, SIZE_MAX);
+}
+
+// Moves the live objects out of sparse object blocks into the free cells of
+// the others, then updates every reference and releases the emptied
+// blocks. A whole collection runs first, so every live object is marked and
+// every unmarked object cell is free. Moved objects leave their new address
+// in their old cell's next field.
+static void gc_compact(VM* vm) {
+    gc_full(vm);
+    vm->gc_compact_pending = false;
+    vm->gc_stats.compactions++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+    size_t capacity = vm->heap.object_capacity;
 #endif
+    vm->gc_phase = GC_COMPACTING;
+    if (heap_begin_evacuation(&vm->heap) > 0) {
+        Obj* object = vm->objects;
+        vm->objects = NULL;
+        while (object != NULL) {
+            Obj* next = object->next;
+            if (heap_is_evacuated(object)) {
+                size_t size = heap_block(object)->cell_size;
+                Obj* copy = (Obj*)heap_allocate_object(&vm->heap, size);
+                memcpy(copy, object, size);
+                fix_interior(object, copy);
+                object->next = copy;
+                object = copy;
+            }
+            object->next = vm->objects;
+            vm->objects = object;
+            object = next;
+        }
+
+        gc_forward_roots(vm);
+        table_forward(vm, &vm->strings);
+        for (Obj* moved = vm->objects; moved != NULL; moved = moved->next) {
+            gc_forward_fields(vm, moved);
+        }
+        gc_forward_weak(vm);
+        heap_end_evacuation(&vm->heap);
+    }
+    vm->gc_phase = GC_IDLE;
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   object cells went from %zu to %zu bytes\n", capacity, vm->heap.object_capacity);
+#endif
+}
+
+// Runs at safepoints when allocation asked for it. The nursery is collected
+// once full. The old generation is marked a slice of gc_budget objects at a
+// time, or all at once if the budget is zero, in a cycle that starts once it
+// has grown past gc_threshold. Sweeping is always lazy: the pause that ends
+// marking frees nothing, and dead objects are freed a slice per safepoint
+// and a few per old-generation allocation. Returns false if the heap is
+// still over gc_max_heap after a whole collection.
+bool gc_collect(VM* vm) {
+#ifdef DEBUG_STRESS_GC
+    bool stress = true;
+#else
+    bool stress = false;
+#endif
+    uint64_t pause_start = now_ns();
+    size_t budget = vm->gc_budget == 0 ? SIZE_MAX : vm->gc_budget;
+    if (stress || vm->nursery_top == vm->nursery_end) {
+        gc_minor(vm);
+    }
+    // Pacing only counts the old generation's cost: minor collections cost
+    // the same however big the old generation gets.
+    clock_t start = clock();
+    if (vm->gc_compact_pending && vm->gc_phase == GC_IDLE) {
+        gc_compact(vm);
+    }
+    if (vm->gc_phase == GC_SWEEPING) {
+        gc_sweep_step(vm, stress ? SIZE_MAX : budget == SIZE_MAX ? GC_SWEEP_SLICE : budget);
+    } else if (vm->gc_phase == GC_MARKING) {
+        gc_trace_references(vm, budget);
+        if (vm->gray_count == 0) {
+            gc_finish_marking(vm);
+        }
+    }
+    if (vm->gc_phase == GC_IDLE && (stress || vm->bytes_allocated > vm->gc_threshold)) {
+        gc_begin_cycle(vm);
+        if (vm->gc_budget == 0) {
+            gc_trace_references(vm, SIZE_MAX);
+            gc_finish_marking(vm);
+        }
+    }
+    // Last resort before failing.
+    bool within_limit = true;
+    if (vm->gc_max_heap != 0 && vm->bytes_allocated > vm->gc_max_heap) {
+        gc_full(vm);
+        within_limit = vm->bytes_allocated <= vm->gc_max_heap;
+    }
+    vm->gc_time += clock() - start;
+    record_pause(&vm->gc_stats, now_ns() - pause_start);
+
+    // A cycle in progress gets a slice at every safepoint.
+    vm->gc_pending = vm->gc_phase != GC_IDLE || vm->gc_compact_pending;
+    return within_limit;
+}
+
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t capacity;
+} StatsBuffer;
+
+static void append(StatsBuffer* buffer, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (buffer->length + needed + 1 > buffer->capacity) {
+        while (buffer->length + needed + 1 > buffer->capacity) {
+            buffer->capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+        }
+        buffer->chars = realloc(buffer->chars, buffer->capacity);
+        if (buffer->chars == NULL) {
+            exit(1);
+        }
+    }
+    va_start(args, format);
+    vsnprintf(buffer->chars + buffer->length, buffer->capacity - buffer->length, format, args);
+    va_end(args);
+    buffer->length += needed;
+}
+
+static const char* type_names[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_NATIVE] = "native",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "bound_method",
+    [OBJ_SHAPE] = "shape",
+    [OBJ_WEAK_REF] = "weak_ref",
+    [OBJ_WEAK_MAP] = "weak_map",
+};
+
+char* gc_stats_json(VM* vm) {
+    GcStats* stats = &vm->gc_stats;
+    StatsBuffer buffer = {NULL, 0, 0};
+    append(&buffer, "{\"minor_collections\": %zu, \"major_collections\": %zu, \"compactions\": %zu, ",
+            stats->minor_collections, stats->major_collections, stats->compactions);
+    append(&buffer, "\"pauses\": %zu, \"pause_total_ns\": %llu, \"pause_max_ns\": %llu, ",
+            stats->pauses, (unsigned long long)stats->pause_total_ns,
+            (unsigned long long)stats->pause_max_ns);
+    // Each bucket is keyed by the exclusive upper bound of its pauses.
+    append(&buffer, "\"pause_histogram_us\": {");
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (i == GC_PAUSE_BUCKETS - 1) {
+            append(&buffer, "\"inf\": %zu}, ", stats->pause_histogram[i]);
+        } else {
+            append(&buffer, "\"%llu\": %zu, ", 1ull << i, stats->pause_histogram[i]);
+        }
+    }
+    append(&buffer, "\"bytes_promoted\": %zu, \"bytes_reclaimed\": %zu, ",
+            stats->bytes_promoted, stats->bytes_reclaimed);
+    append(&buffer, "\"live_bytes\": %zu, \"heap_bytes\": %zu, ", vm->gc_live, vm->bytes_allocated);
+    append(&buffer, "\"types\": {");
+    for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+        append(&buffer, "%s\"%s\": {\"allocations\": %zu, \"bytes\": %zu}", i == 0 ? "" : ", ",
+                type_names[i], stats->allocations[i], stats->allocated_bytes[i]);
+    }
+    append(&buffer, "}}");
+    return buffer.chars;
 }
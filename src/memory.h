@@ -3,24 +3,62 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, ptr) \
-    reallocate(ptr, sizeof(type), 0);
+#define FREE(vm, type, ptr) \
+    reallocate(vm, ptr, sizeof(type), 0);
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, prev_ptr, old_count, new_count) \
-    (type*)reallocate(prev_ptr, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define GROW_ARRAY(vm, type, prev_ptr, old_count, new_count) \
+    (type*)reallocate(vm, prev_ptr, sizeof(type) * (old_count), sizeof(type) * (new_count))
 
-#define FREE_ARRAY(type, ptr, old_count) \
-    reallocate(ptr, sizeof(type) * (old_count), 0)
+#define FREE_ARRAY(vm, type, ptr, old_count) \
+    reallocate(vm, ptr, sizeof(type) * (old_count), 0)
 
-void* reallocate(void* prev_ptr, size_t old_size, size_t new_size);
-void free_objects();
-void gc_collect();
-void gc_mark_value(Value value);
-void gc_mark_object(Obj* object);
+void* reallocate(VM* vm, void* prev_ptr, size_t old_size, size_t new_size);
+void init_gc(VM* vm);
+void free_objects(VM* vm);
+Obj* gc_allocate_object(VM* vm, size_t size, ObjType type);
+void gc_own_memory(VM* vm, Obj* object);
+void gc_remember(VM* vm, Obj* object);
+void gc_track_weak(VM* vm, Obj* object);
+bool gc_collect(VM* vm);
+// The collector's statistics as a JSON object, which the caller frees.
+char* gc_stats_json(VM* vm);
+void gc_mark_value(VM* vm, Value value);
+void gc_mark_object(VM* vm, Obj* object);
+Obj* gc_forward(VM* vm, Obj* object);
+void gc_forward_value(VM* vm, Value* slot);
+
+static inline bool gc_is_young(VM* vm, Obj* object) {
+    return (uint8_t*)object >= vm->nursery && (uint8_t*)object < vm->nursery_end;
+}
+
+// Must follow every store of value into a field of owner. Young values get
+// the owner remembered for minor collections; while marking, old ones are
+// shaded so an already traced owner cannot hide them from the marker.
+static inline void gc_write_barrier(VM* vm, Obj* owner, Value value) {
+    if (!IS_OBJ(value)) {
+        return;
+    }
+    Obj* object = RAW_OBJ(value);
+    if (gc_is_young(vm, object)) {
+        if (!owner->is_remembered) {
+            gc_remember(vm, owner);
+        }
+    } else if (vm->gc_phase == GC_MARKING && !heap_is_marked(object)) {
+        gc_mark_object(vm, object);
+    }
+}
+
+// The same for stores into globals, which are marked once per cycle.
+static inline void gc_root_barrier(VM* vm, Value value) {
+    if (vm->gc_phase == GC_MARKING && IS_OBJ(value)) {
+        gc_mark_object(vm, RAW_OBJ(value));
+    }
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "object.h"
@@ -6,122 +7,436 @@
 #include "table.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) \
-    (type*)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type) \
+    (type*)allocate_object(vm, sizeof(type), object_type)
 
-static Obj* allocate_object(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+// The most fields an instance holds inline.
+#define INSTANCE_INLINE_MAX ((HEAP_MAX_SMALL - sizeof(ObjInstance)) / sizeof(Value))
+// Concatenations shorter than this are copied out at once.
+#define ROPE_MIN_LENGTH 64
+// The longest string whose characters fit inline in a heap cell.
+#define STRING_INLINE_MAX (HEAP_MAX_SMALL - sizeof(ObjString) - 1)
+
+static Obj* allocate_object(VM* vm, size_t size, ObjType type) {
+    Obj* object = gc_allocate_object(vm, size, type);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
 #endif
     return object;
 }
 
-static ObjString* allocate_string(char* chars, size_t length, size_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Takes ownership of chars, which are interned unless hash is zero.
+static ObjString* allocate_string(VM* vm, char* chars, size_t length, size_t hash) {
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    stack_push(BOX_OBJ(string));
-    table_set(&vm.strings, string, BOX_NIL);
-    stack_pop();
+    string->right = NULL;
+    gc_own_memory(vm, (Obj*)string);
+    if (hash != 0) {
+        stack_push(vm, BOX_OBJ(string));
+        table_set(vm, &vm->strings, string, BOX_NIL);
+        stack_pop(vm);
+    }
+    return string;
+}
+
+// Interns a copy of chars held in the object itself. Interned strings never
+// let go of their characters, so an inline string stays one.
+static ObjString* allocate_inline_string(VM* vm, const char* chars, size_t length, size_t hash) {
+    ObjString* string = (ObjString*)allocate_object(vm,
+            sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->chars = string->inline_chars;
+    memcpy(string->inline_chars, chars, length);
+    string->inline_chars[length] = '\0';
+    string->hash = hash;
+    string->right = NULL;
+    // Young strings are listed for the string table's sake.
+    gc_own_memory(vm, (Obj*)string);
+    stack_push(vm, BOX_OBJ(string));
+    table_set(vm, &vm->strings, string, BOX_NIL);
+    stack_pop(vm);
     return string;
 }
 
-// FNV-1a hash function
+// Mixes in a word at a time, read with memcpy since keys need not be
+// aligned. The last few bytes go in as one word made of two overlapping
+// reads, which the length in the seed tells apart. The final
+// avalanche is MurmurHash3's, so every input bit reaches the low bits
+// tables index by.
 static size_t hash_string(const char* key, size_t length) {
-    size_t hash = 2166136261;
-    for (size_t i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ length;
+    uint64_t word;
+    for (; length >= sizeof(word); key += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, key, sizeof(word));
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+        hash ^= hash >> 32;
+    }
+    if (length >= 4) {
+        uint32_t low, high;
+        memcpy(&low, key, sizeof(low));
+        memcpy(&high, key + length - 4, sizeof(high));
+        word = (uint64_t)low << 32 | high;
+    } else if (length > 0) {
+        word = (uint64_t)(uint8_t)key[0] << 16 | (uint64_t)(uint8_t)key[length / 2] << 8 |
+               (uint8_t)key[length - 1];
+    } else {
+        word = 0;
     }
-    return hash;
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    // Zero marks a string not yet interned.
+    return hash == 0 ? 1 : (size_t)hash;
 }
 
-ObjString* copy_string(const char* chars, size_t length) {
+ObjString* copy_string(VM* vm, const char* chars, size_t length) {
     size_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL) {
         return interned;
     }
+    if (length <= STRING_INLINE_MAX) {
+        return allocate_inline_string(vm, chars, length, hash);
+    }
 
-    char* heap_chars = ALLOCATE(char, length + 1);
+    char* heap_chars = ALLOCATE(vm, char, length + 1);
     memcpy(heap_chars, chars, length);
     heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    return allocate_string(vm, heap_chars, length, hash);
 }
 
-ObjString* take_string(char* chars, size_t length) {
-    size_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+// Strings built at run time are hashed and interned when first compared or
+// used as a key, which many never are. Below this length hashing costs less
+// than keeping a string around only to find its twin later.
+#define LAZY_HASH_MIN_LENGTH 16
+
+// Builds a string out of a concatenation's characters.
+static ObjString* new_string(VM* vm, const char* chars, size_t length) {
+    if (length < LAZY_HASH_MIN_LENGTH) {
+        return copy_string(vm, chars, length);
+    }
+    char* heap_chars = ALLOCATE(vm, char, length + 1);
+    memcpy(heap_chars, chars, length);
+    heap_chars[length] = '\0';
+    return allocate_string(vm, heap_chars, length, 0);
+}
+
+// The string holding the characters, for one that has let go of them.
+static ObjString* resolve(ObjString* string) {
+    return string->chars == NULL && string->right == NULL ? string->left : string;
+}
+
+static bool is_rope(ObjString* string) {
+    return string->chars == NULL && string->right != NULL;
+}
+
+ObjString* concat_strings(VM* vm, ObjString* a, ObjString* b) {
+    a = resolve(a);
+    b = resolve(b);
+    size_t length = a->length + b->length;
+    if (length < ROPE_MIN_LENGTH) {
+        // Too short to hold a rope, so both halves are flat.
+        char buffer[ROPE_MIN_LENGTH];
+        memcpy(buffer, a->chars, a->length);
+        memcpy(buffer + a->length, b->chars, b->length);
+        return new_string(vm, buffer, length);
+    }
+    if (a->length == 0) {
+        return b;
+    }
+    if (b->length == 0) {
+        return a;
+    }
+    if (is_rope(a) && b->length < ROPE_MIN_LENGTH) {
+        // Appending a piece at a time would make a rope per piece. A short
+        // right half takes the new piece instead, and the rope above it is
+        // the only new node.
+        ObjString* right = resolve(a->right);
+        if (right->chars != NULL && right->length + b->length < ROPE_MIN_LENGTH) {
+            char buffer[ROPE_MIN_LENGTH];
+            memcpy(buffer, right->chars, right->length);
+            memcpy(buffer + right->length, b->chars, b->length);
+            ObjString* left = a->left;
+            b = new_string(vm, buffer, right->length + b->length);
+            a = left;
+        }
+    }
+
+    ObjString* rope = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+    rope->length = length;
+    rope->chars = NULL;
+    rope->left = a;
+    rope->right = b;
+    gc_write_barrier(vm, (Obj*)rope, BOX_OBJ(a));
+    gc_write_barrier(vm, (Obj*)rope, BOX_OBJ(b));
+    return rope;
+}
+
+// Short results are copied out once. Long ones are built as ropes, the same
+// as a chain of concat_strings() calls.
+ObjString* concat_string_values(VM* vm, Value* strings, size_t count) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        length += RAW_STRING(strings[i])->length;
+    }
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjString* result = RAW_STRING(strings[0]);
+        for (size_t i = 1; i < count; i++) {
+            result = concat_strings(vm, result, RAW_STRING(strings[i]));
+        }
+        return result;
+    }
+
+    char buffer[ROPE_MIN_LENGTH];
+    char* end = buffer;
+    for (size_t i = 0; i < count; i++) {
+        ObjString* string = resolve(RAW_STRING(strings[i]));
+        memcpy(end, string->chars, string->length);
+        end += string->length;
+    }
+    return new_string(vm, buffer, length);
+}
+
+// Copies a rope's characters into dest from the right, with an explicit
+// stack of left halves. Ropes built by appending in a loop lean left, so
+// the stack stays short however deep they are.
+static void rope_copy(ObjString* rope, char* dest) {
+    ObjString** stack = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char* end = dest + rope->length;
+    ObjString* string = rope;
+    while (true) {
+        if (is_rope(string)) {
+            if (capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                stack = realloc(stack, sizeof(ObjString*) * capacity);
+                if (stack == NULL) {
+                    exit(1);
+                }
+            }
+            stack[count++] = string->left;
+            string = string->right;
+            continue;
+        }
+        ObjString* flat = resolve(string);
+        end -= flat->length;
+        memcpy(end, flat->chars, flat->length);
+        if (count == 0) {
+            break;
+        }
+        string = stack[--count];
+    }
+    free(stack);
+}
+
+// Copies a rope's characters out of its halves and lets go of them.
+static void flatten_rope(VM* vm, ObjString* string) {
+    char* chars = ALLOCATE(vm, char, string->length + 1);
+    rope_copy(string, chars);
+    chars[string->length] = '\0';
+    string->chars = chars;
+    string->hash = 0;
+    string->right = NULL;
+    gc_own_memory(vm, (Obj*)string);
+}
+
+// Returns a string with the same characters and the characters in hand,
+// copying a rope's out the first time. Halves that are ropes keep their
+// characters too: a string built up a piece at a time is the left half of
+// every rope made from it, and each of those would walk it again.
+ObjString* string_flatten(VM* vm, ObjString* string) {
+    if (!is_rope(string)) {
+        return resolve(string);
+    }
+    if (is_rope(string->left)) {
+        flatten_rope(vm, string->left);
+    }
+    if (is_rope(string->right)) {
+        flatten_rope(vm, string->right);
+    }
+    flatten_rope(vm, string);
+    return string;
+}
+
+// Returns the interned string with the same characters, hashing and
+// interning this one if there is none yet.
+ObjString* string_intern(VM* vm, ObjString* string) {
+    string = string_flatten(vm, string);
+    if (string->hash != 0) {
+        return string;
+    }
+    size_t hash = hash_string(string->chars, string->length);
+    ObjString* interned = table_find_string(&vm->strings, string->chars, string->length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, string->chars, string->length + 1);
+        string->chars = NULL;
+        string->left = interned;
+        string->right = NULL;
+        gc_write_barrier(vm, (Obj*)string, BOX_OBJ(interned));
         return interned;
     }
-    return allocate_string(chars, length, hash);
+    string->hash = hash;
+    table_set(vm, &vm->strings, string, BOX_NIL);
+    return string;
 }
 
-ObjFunction* new_function() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* new_function(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->max_stack = 0;
     function->name = NULL;
     init_chunk(&function->chunk);
+#ifdef JIT
+    function->call_count = 0;
+    function->jit = NULL;
+#endif
     return function;
 }
 
-ObjUpvalue* new_upvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* new_upvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->closed = BOX_NIL;
     upvalue->next = NULL;
     return upvalue;
 }
 
-ObjClosure* new_closure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
+ObjClosure* new_closure(VM* vm, ObjFunction* function) {
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalue_count);
     for (size_t i = 0; i < function->upvalue_count; i++) {
         upvalues[i] = NULL;
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    if (closure->upvalue_count > 0) {
+        gc_own_memory(vm, (Obj*)closure);
+    }
     return closure;
 }
 
-ObjNative* new_native(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* new_native(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-ObjClass* new_class(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* new_class(VM* vm, ObjString* name) {
+    ObjShape* shape = new_shape(vm, NULL, NULL);
+    stack_push(vm, BOX_OBJ(shape));
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     init_table(&klass->methods);
+    klass->shape = shape;
+    klass->field_hint = 0;
+    stack_pop(vm);
     return klass;
 }
 
-ObjInstance* new_instance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* new_instance(VM* vm, ObjClass* klass) {
+    // Size the inline slots for as many fields as the class's instances have
+    // needed so far, so most instances never allocate a separate array. The
+    // instance has to fit a heap cell to get a mark bit.
+    size_t capacity = klass->field_hint;
+    if (capacity > INSTANCE_INLINE_MAX) {
+        capacity = INSTANCE_INLINE_MAX;
+    }
+    ObjInstance* instance = (ObjInstance*)allocate_object(vm, 
+            sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = klass->shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = capacity;
+    instance->inline_capacity = capacity;
     return instance;
 }
 
-ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
+ObjShape* new_shape(VM* vm, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    init_table(&shape->transitions);
+    return shape;
+}
+
+ObjWeakRef* new_weak_ref(VM* vm, Value target) {
+    ObjWeakRef* ref = ALLOCATE_OBJ(vm, ObjWeakRef, OBJ_WEAK_REF);
+    ref->target = target;
+    gc_track_weak(vm, (Obj*)ref);
+    return ref;
+}
+
+ObjWeakMap* new_weak_map(VM* vm) {
+    ObjWeakMap* map = ALLOCATE_OBJ(vm, ObjWeakMap, OBJ_WEAK_MAP);
+    init_table(&map->table);
+    gc_track_weak(vm, (Obj*)map);
+    return map;
+}
+
+bool shape_find_slot(ObjShape* shape, ObjString* name, size_t* slot) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            *slot = shape->field_count - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+ObjShape* shape_transition(VM* vm, ObjShape* shape, ObjString* name) {
+    Value next;
+    if (table_get(&shape->transitions, name, &next)) {
+        return (ObjShape*)RAW_OBJ(next);
+    }
+    ObjShape* child = new_shape(vm, shape, name);
+    stack_push(vm, BOX_OBJ(child));
+    table_set(vm, &shape->transitions, name, BOX_OBJ(child));
+    gc_write_barrier(vm, (Obj*)shape, BOX_OBJ(name));
+    stack_pop(vm);
+    return child;
+}
+
+// Moves the instance to a child of its shape, growing the field array when
+// the inline slots run out. The new slot starts out nil.
+void instance_transition(VM* vm, ObjInstance* instance, ObjShape* shape) {
+    size_t count = shape->field_count;
+    if (count > instance->field_capacity) {
+        size_t capacity = GROW_CAPACITY(instance->field_capacity);
+        Value* fields = ALLOCATE(vm, Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * instance->shape->field_count);
+        if (instance->fields != instance->inline_fields) {
+            FREE_ARRAY(vm, Value, instance->fields, instance->field_capacity);
+        } else {
+            gc_own_memory(vm, (Obj*)instance);
+        }
+        instance->fields = fields;
+        instance->field_capacity = capacity;
+    }
+    instance->fields[count - 1] = BOX_NIL;
+    instance->shape = shape;
+    if (count > instance->klass->field_hint) {
+        instance->klass->field_hint = count;
+    }
+}
+
 static void print_function(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -130,10 +445,28 @@ static void print_function(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+// Prints a rope without flattening it, for callers with no VM to allocate
+// through.
+static void print_string(ObjString* string) {
+    if (string->chars != NULL) {
+        printf("%s", string->chars);
+    } else if (string->right == NULL) {
+        printf("%s", string->left->chars);
+    } else {
+        char* chars = malloc(string->length);
+        if (chars == NULL) {
+            exit(1);
+        }
+        rope_copy(string, chars);
+        fwrite(chars, 1, string->length, stdout);
+        free(chars);
+    }
+}
+
 void print_object(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", RAW_CSTRING(value));
+            print_string(RAW_STRING(value));
             break;
         case OBJ_FUNCTION:
             print_function(RAW_FUNCTION(value));
@@ -156,5 +489,14 @@ void print_object(Value value) {
         case OBJ_BOUND_METHOD:
             print_function(RAW_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
+        case OBJ_WEAK_REF:
+            printf("<weak ref>");
+            break;
+        case OBJ_WEAK_MAP:
+            printf("<weak map>");
+            break;
     }
 }
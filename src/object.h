@@ -14,27 +14,72 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_WEAK_REF,
+    OBJ_WEAK_MAP,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_WEAK_MAP + 1)
+
 struct Obj {
     ObjType type;
-    bool is_marked;
+    // Set while a minor collection would find the object's references
+    // without a write barrier: always for young objects, and for old ones
+    // once they are in the remembered set.
+    bool is_remembered;
+    // The next old object, or for a young one its promoted copy once a minor
+    // collection has moved it.
     struct Obj* next;
 };
 
+// A growable list of objects the collector tracks on the side.
+typedef struct {
+    Obj** objects;
+    size_t count;
+    size_t capacity;
+} ObjArray;
+
+// A string is either flat, holding its characters, or a rope: the
+// concatenation of two strings, left as a tree until something needs the
+// characters. Strings the program builds are hashed and interned in
+// vm.strings only once they are compared or used as a key; flattening a
+// rope only copies its characters out. A string whose characters turn out
+// to be interned already lets go of them and points to that string.
+// Interned strings short enough to fit a heap cell hold their characters
+// inline.
 struct ObjString {
     Obj obj;
     size_t length;
+    // NULL for a rope, and for a string that points to its interned twin.
+    // Otherwise inline_chars or a separate array.
     char* chars;
-    size_t hash;
+    union {
+        // Zero until the string is interned. Hashes are never zero.
+        size_t hash;
+        // While chars is NULL: the halves of a rope, or the interned twin
+        // in left and NULL in right.
+        struct {
+            struct ObjString* left;
+            struct ObjString* right;
+        };
+    };
+    char inline_chars[];
 };
 
+typedef struct JitCode JitCode;
+
 typedef struct {
     Obj obj;
     size_t arity;
     size_t upvalue_count;
+    // The most stack slots a call uses, counting from its frame's first.
+    size_t max_stack;
     Chunk chunk;
     ObjString* name;
+#ifdef JIT
+    size_t call_count;
+    JitCode* jit;
+#endif
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -44,30 +89,47 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     size_t upvalue_count;
-} ObjClosure;
+};
 
-typedef Value (*NativeFn)(size_t arg_count, Value* args);
+typedef Value (*NativeFn)(VM* vm, size_t arg_count, Value* args);
 
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
-typedef struct {
+// Hidden class for instance layouts. Each shape adds one field to its parent
+// and is shared by every instance that gained the same fields in the same
+// order, so a field lookup is a shape check plus a slot index.
+struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name;
+    size_t field_count;
+    Table transitions;
+};
+
+struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
-} ObjClass;
+    ObjShape* shape;
+    size_t field_hint;
+};
 
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields;
+    size_t field_capacity;
+    size_t inline_capacity;
+    Value inline_fields[];
 } ObjInstance;
 
 typedef struct {
@@ -76,6 +138,21 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// Refers to an object without keeping it alive. The target reads as nil once
+// the collector has freed it.
+typedef struct {
+    Obj obj;
+    Value target;
+} ObjWeakRef;
+
+// A map from strings whose entries last as long as their keys are reachable
+// from elsewhere, as in the interned string table. Values are held strongly,
+// so one that refers to its own key keeps the entry.
+typedef struct {
+    Obj obj;
+    Table table;
+} ObjWeakMap;
+
 #define OBJ_TYPE(value)         (RAW_OBJ(value)->type)
 #define IS_STRING(value)        is_obj_type(value, OBJ_STRING)
 #define IS_FUNCTION(value)      is_obj_type(value, OBJ_FUNCTION)
@@ -84,6 +161,8 @@ typedef struct {
 #define IS_CLASS(value)         is_obj_type(value, OBJ_CLASS)
 #define IS_INSTANCE(value)      is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  is_obj_type(value, OBJ_BOUND_METHOD)
+#define IS_WEAK_REF(value)      is_obj_type(value, OBJ_WEAK_REF)
+#define IS_WEAK_MAP(value)      is_obj_type(value, OBJ_WEAK_MAP)
 
 #define RAW_STRING(value)       ((ObjString*)RAW_OBJ(value))
 #define RAW_CSTRING(value)      (((ObjString*)RAW_OBJ(value))->chars)
@@ -93,20 +172,44 @@ typedef struct {
 #define RAW_CLASS(value)        ((ObjClass*)RAW_OBJ(value))
 #define RAW_INSTANCE(value)     ((ObjInstance*)RAW_OBJ(value))
 #define RAW_BOUND_METHOD(value) ((ObjBoundMethod*)RAW_OBJ(value))
+#define RAW_WEAK_REF(value)     ((ObjWeakRef*)RAW_OBJ(value))
+#define RAW_WEAK_MAP(value)     ((ObjWeakMap*)RAW_OBJ(value))
 
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && RAW_OBJ(value)->type == type;
 }
 
-ObjString* copy_string(const char* chars, size_t length);
-ObjString* take_string(char* chars, size_t length);
+static inline bool string_is_interned(ObjString* string) {
+    return string->chars != NULL && string->hash != 0;
+}
+
+static inline bool string_is_inline(ObjString* string) {
+    return string->chars == string->inline_chars;
+}
+
+static inline size_t string_size(ObjString* string) {
+    return sizeof(ObjString) + (string_is_inline(string) ? string->length + 1 : 0);
+}
 
-ObjFunction* new_function();
-ObjUpvalue* new_upvalue(Value* slot);
-ObjClosure* new_closure(ObjFunction* function);
-ObjNative* new_native(NativeFn function);
-ObjClass* new_class(ObjString* name);
-ObjInstance* new_instance(ObjClass* klass);
-ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
+ObjString* copy_string(VM* vm, const char* chars, size_t length);
+ObjString* concat_strings(VM* vm, ObjString* a, ObjString* b);
+ObjString* concat_string_values(VM* vm, Value* strings, size_t count);
+ObjString* string_flatten(VM* vm, ObjString* string);
+ObjString* string_intern(VM* vm, ObjString* string);
+
+ObjFunction* new_function(VM* vm);
+ObjUpvalue* new_upvalue(VM* vm, Value* slot);
+ObjClosure* new_closure(VM* vm, ObjFunction* function);
+ObjNative* new_native(VM* vm, NativeFn function);
+ObjClass* new_class(VM* vm, ObjString* name);
+ObjInstance* new_instance(VM* vm, ObjClass* klass);
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, ObjClosure* method);
+ObjShape* new_shape(VM* vm, ObjShape* parent, ObjString* name);
+ObjWeakRef* new_weak_ref(VM* vm, Value target);
+ObjWeakMap* new_weak_map(VM* vm);
+
+bool shape_find_slot(ObjShape* shape, ObjString* name, size_t* slot);
+ObjShape* shape_transition(VM* vm, ObjShape* shape, ObjString* name);
+void instance_transition(VM* vm, ObjInstance* instance, ObjShape* shape);
 
 void print_object(Value value);
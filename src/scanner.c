@@ -3,22 +3,14 @@
 
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    size_t line;
-} Scanner;
-
-Scanner scanner;    // singleton
-
-void init_scanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void init_scanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
-static bool is_at_end() {
-    return *scanner.current == '\0';
+static bool is_at_end(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
 static bool is_digit(char c) {
@@ -35,70 +27,70 @@ static bool is_alphanumscore(char c) {
     return is_alphascore(c) || is_digit(c);
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
-static char peek_next() {
-    if (is_at_end()) {
+static char peek_next(Scanner* scanner) {
+    if (is_at_end(scanner)) {
         return '\0';
     }
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-    if (is_at_end()) {
+static bool match(Scanner* scanner, char expected) {
+    if (is_at_end(scanner)) {
         return false;
     }
-    if (*scanner.current != expected) {
+    if (*scanner->current != expected) {
         return false;
     }
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static Token make_token(TokenType type) {
+static Token make_token(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (size_t)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (size_t)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token error_token(const char* message) {
+static Token error_token(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERR;
     token.start = message;
     token.length = (size_t)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skip_whitespace() {
+static void skip_whitespace(Scanner* scanner) {
     while (true) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\t':
             case '\r':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             case '/':
-                if (peek_next() != '/') {
+                if (peek_next(scanner) != '/') {
                     return;
                 }
-                while (peek() != '\n' && !is_at_end()) {
-                    advance();
+                while (peek(scanner) != '\n' && !is_at_end(scanner)) {
+                    advance(scanner);
                 }
                 break;
             default:
@@ -107,125 +99,125 @@ static void skip_whitespace() {
     }
 }
 
-static TokenType check_keyword(size_t start, size_t length, const char* rest, TokenType type) {
-    bool same_len = ((size_t)(scanner.current - scanner.start) == start + length);
-    if (same_len && memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType check_keyword(Scanner* scanner, size_t start, size_t length, const char* rest, TokenType type) {
+    bool same_len = ((size_t)(scanner->current - scanner->start) == start + length);
+    if (same_len && memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
     return TOKEN_IDENT;
 }
 
-static TokenType identifier_type() {
-    switch (scanner.start[0]) {
-        case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
+static TokenType identifier_type(Scanner* scanner) {
+    switch (scanner->start[0]) {
+        case 'a': return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
+        case 'c': return check_keyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+        case 'e': return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return check_keyword(2, 1, "n", TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return check_keyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return check_keyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
-        case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
-        case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-        case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
+        case 'i': return check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+        case 'n': return check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return check_keyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'p': return check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 's': return check_keyword(scanner, 1, 4, "uper", TOKEN_SUPER);
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'h': return check_keyword(scanner, 2, 2, "is", TOKEN_THIS);
+                    case 'r': return check_keyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
-        case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
+        case 'v': return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENT;
 }
 
-static Token finish_identifier() {
-    while (is_alphanumscore(peek())) {
-        advance();
+static Token finish_identifier(Scanner* scanner) {
+    while (is_alphanumscore(peek(scanner))) {
+        advance(scanner);
     }
-    return make_token(identifier_type());
+    return make_token(scanner, identifier_type(scanner));
 }
 
-static Token finish_string() {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n') {
-            scanner.line++;
+static Token finish_string(Scanner* scanner) {
+    while (peek(scanner) != '"' && !is_at_end(scanner)) {
+        if (peek(scanner) == '\n') {
+            scanner->line++;
         }
-        advance();
+        advance(scanner);
     }
 
-    if (is_at_end()) {
-        return error_token("Unterminated string.");
+    if (is_at_end(scanner)) {
+        return error_token(scanner, "Unterminated string.");
     }
 
-    advance();  // consume closing quote
-    return make_token(TOKEN_STR);
+    advance(scanner);  // consume closing quote
+    return make_token(scanner, TOKEN_STR);
 }
 
-static Token finish_number() {
-    while (is_digit(peek())) {
-        advance();
+static Token finish_number(Scanner* scanner) {
+    while (is_digit(peek(scanner))) {
+        advance(scanner);
     }
 
-    if (peek() == '.' && is_digit(peek_next())) {
-        advance();  // consume decimal point
-        while (is_digit(peek())) {
-            advance();
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
+        advance(scanner);  // consume decimal point
+        while (is_digit(peek(scanner))) {
+            advance(scanner);
         }
     }
 
-    return make_token(TOKEN_NUM);
+    return make_token(scanner, TOKEN_NUM);
 }
 
-Token scan_token() {
-    skip_whitespace();
-    scanner.start = scanner.current;
+Token scan_token(Scanner* scanner) {
+    skip_whitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (is_at_end()) {
-        return make_token(TOKEN_EOF);
+    if (is_at_end(scanner)) {
+        return make_token(scanner, TOKEN_EOF);
     }
 
-    char c = advance();
+    char c = advance(scanner);
     if (is_digit(c)) {
-        return finish_number();
+        return finish_number(scanner);
     }
     if (is_alphascore(c)) {
-        return finish_identifier();
+        return finish_identifier(scanner);
     }
 
     switch (c) {
-        case '(': return make_token(TOKEN_LPAREN);
-        case ')': return make_token(TOKEN_RPAREN);
-        case '{': return make_token(TOKEN_LBRACE);
-        case '}': return make_token(TOKEN_RBRACE);
-        case ';': return make_token(TOKEN_SEMI);
-        case ',': return make_token(TOKEN_COMMA);
-        case '.': return make_token(TOKEN_DOT);
-        case '+': return make_token(TOKEN_PLUS);
-        case '-': return make_token(TOKEN_MINUS);
-        case '*': return make_token(TOKEN_STAR);
-        case '/': return make_token(TOKEN_SLASH);
+        case '(': return make_token(scanner, TOKEN_LPAREN);
+        case ')': return make_token(scanner, TOKEN_RPAREN);
+        case '{': return make_token(scanner, TOKEN_LBRACE);
+        case '}': return make_token(scanner, TOKEN_RBRACE);
+        case ';': return make_token(scanner, TOKEN_SEMI);
+        case ',': return make_token(scanner, TOKEN_COMMA);
+        case '.': return make_token(scanner, TOKEN_DOT);
+        case '+': return make_token(scanner, TOKEN_PLUS);
+        case '-': return make_token(scanner, TOKEN_MINUS);
+        case '*': return make_token(scanner, TOKEN_STAR);
+        case '/': return make_token(scanner, TOKEN_SLASH);
         case '!':
-            return make_token(match('=') ? TOKEN_NE : TOKEN_BANG);
+            return make_token(scanner, match(scanner, '=') ? TOKEN_NE : TOKEN_BANG);
         case '=':
-            return make_token(match('=') ? TOKEN_EE : TOKEN_EQUAL);
+            return make_token(scanner, match(scanner, '=') ? TOKEN_EE : TOKEN_EQUAL);
         case '<':
-            return make_token(match('=') ? TOKEN_LE : TOKEN_LT);
+            return make_token(scanner, match(scanner, '=') ? TOKEN_LE : TOKEN_LT);
         case '>':
-            return make_token(match('=') ? TOKEN_GE : TOKEN_GT);
+            return make_token(scanner, match(scanner, '=') ? TOKEN_GE : TOKEN_GT);
         case '"':
-            return finish_string();
+            return finish_string(scanner);
     }
 
-    return error_token("Unexpected character.");
+    return error_token(scanner, "Unexpected character.");
 }
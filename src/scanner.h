@@ -60,5 +60,11 @@ typedef struct {
     size_t line;
 } Token;
 
-void init_scanner(const char* source);
-Token scan_token();
+typedef struct {
+    const char* start;
+    const char* current;
+    size_t line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, const char* source);
+Token scan_token(Scanner* scanner);
@@ -5,6 +5,8 @@
 #include "memory.h"
 
 #define TABLE_MAX_LOAD 0.75
+// Pruning shrinks a table whose live entries fill less than this.
+#define TABLE_MIN_LOAD 0.25
 
 void init_table(Table* table) {
     table->count = 0;
@@ -12,9 +14,9 @@ void init_table(Table* table) {
     table->entries = NULL;
 }
 
-void free_table(Table* table) {
+void free_table(VM* vm, Table* table) {
     size_t capacity = table_current_capacity(table);
-    FREE_ARRAY(Entry, table->entries, capacity);
+    FREE_ARRAY(vm, Entry, table->entries, capacity);
     init_table(table);
 }
 
@@ -41,8 +43,8 @@ static Entry* find_entry(Entry* entries, size_t capacity_mask, ObjString* key) {
     }
 }
 
-static void adjust_capacity(Table* table, size_t capacity_mask) {
-    Entry* entries = ALLOCATE(Entry, capacity_mask + 1);
+static void adjust_capacity(VM* vm, Table* table, size_t capacity_mask) {
+    Entry* entries = ALLOCATE(vm, Entry, capacity_mask + 1);
     for (size_t i = 0; i <= capacity_mask; i++) {
         entries[i].key = NULL;
         entries[i].value = BOX_NIL;
@@ -61,7 +63,7 @@ static void adjust_capacity(Table* table, size_t capacity_mask) {
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, current_capacity);
+    FREE_ARRAY(vm, Entry, table->entries, current_capacity);
     table->entries = entries;
     table->capacity_mask = capacity_mask;
 }
@@ -80,11 +82,28 @@ bool table_get(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-bool table_set(Table* table, ObjString* key, Value value) {
+// Entries that are not tombstones.
+static size_t live_count(Table* table) {
+    size_t live = 0;
+    size_t capacity = table_current_capacity(table);
+    for (size_t i = 0; i < capacity; i++) {
+        if (table->entries[i].key != NULL) {
+            live++;
+        }
+    }
+    return live;
+}
+
+bool table_set(VM* vm, Table* table, ObjString* key, Value value) {
     size_t capacity = table_current_capacity(table);
     if (table->count + 1 > capacity * TABLE_MAX_LOAD) {
-        size_t capacity_mask = GROW_CAPACITY(capacity) - 1;
-        adjust_capacity(table, capacity_mask);
+        // Tombstones count towards the load. When they make up much of it,
+        // rehashing in place clears them without doubling.
+        size_t live = live_count(table);
+        if (capacity == 0 || live + 1 > capacity * TABLE_MAX_LOAD / 2) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        adjust_capacity(vm, table, capacity - 1);
     }
 
     Entry* entry = find_entry(table->entries, table->capacity_mask, key);
@@ -115,12 +134,12 @@ bool table_delete(Table* table, ObjString* key) {
     return true;
 }
 
-void table_add_all(Table* from, Table* to) {
+void table_add_all(VM* vm, Table* from, Table* to) {
     size_t from_capacity = table_current_capacity(from);
     for (size_t i = 0; i < from_capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            table_set(to, entry->key, entry->value);
+            table_set(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -146,21 +165,49 @@ ObjString* table_find_string(Table* table, const char* chars, size_t length, siz
     }
 }
 
-void table_mark_reachable(Table* table) {
+void table_mark_reachable(VM* vm, Table* table) {
     size_t capacity = table_current_capacity(table);
     for (size_t i = 0; i < capacity; i++) {
         Entry* entry = &table->entries[i];
-        gc_mark_object((Obj*)entry->key);
-        gc_mark_value(entry->value);
+        gc_mark_object(vm, (Obj*)entry->key);
+        gc_mark_value(vm, entry->value);
     }
 }
 
-void table_remove_unreachable(Table* table) {
+// Keys keep their hash when promoted, so entries stay where they are.
+void table_forward(VM* vm, Table* table) {
     size_t capacity = table_current_capacity(table);
     for (size_t i = 0; i < capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked) {
-            table_delete(table, entry->key);
+        entry->key = (ObjString*)gc_forward(vm, (Obj*)entry->key);
+        gc_forward_value(vm, &entry->value);
+    }
+}
+
+// Drops the entries whose keys the collector left unmarked, then rebuilds
+// the table without tombstones, at a smaller size if it has emptied out.
+void table_remove_unreachable(VM* vm, Table* table) {
+    size_t capacity = table_current_capacity(table);
+    size_t live = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) {
+            continue;
         }
+        if (heap_is_marked(entry->key)) {
+            live++;
+        } else {
+            entry->key = NULL;
+            entry->value = BOX_BOOL(true);
+        }
+    }
+    if (live == table->count) {
+        return;
+    }
+
+    size_t shrunk = capacity;
+    while (shrunk > 8 && live < shrunk * TABLE_MIN_LOAD) {
+        shrunk /= 2;
     }
+    adjust_capacity(vm, table, shrunk - 1);
 }
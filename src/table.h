@@ -15,14 +15,15 @@ typedef struct {
 } Table;
 
 void init_table(Table* table);
-void free_table(Table* table);
+void free_table(VM* vm, Table* table);
 size_t table_current_capacity(Table* table);
 
 bool table_get(Table* table, ObjString* key, Value* value);
-bool table_set(Table* table, ObjString* key, Value value);
+bool table_set(VM* vm, Table* table, ObjString* key, Value value);
 bool table_delete(Table* table, ObjString* key);
-void table_add_all(Table* from, Table* to);
+void table_add_all(VM* vm, Table* from, Table* to);
 
 ObjString* table_find_string(Table* table, const char* chars, size_t length, size_t hash);
-void table_mark_reachable(Table* table);
-void table_remove_unreachable(Table* table);
+void table_mark_reachable(VM* vm, Table* table);
+void table_forward(VM* vm, Table* table);
+void table_remove_unreachable(VM* vm, Table* table);
@@ -0,0 +1,1091 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "object.h"
+#include "x64.h"
+
+#ifdef JIT
+
+// Longest path through a loop the recorder follows.
+#define TRACE_MAX_LENGTH 512
+// Entry guard failures in a row after which a trace is thrown away.
+#define TRACE_MAX_BAILS 32
+
+// Traces keep numbers unboxed in XMM registers. Operand stack temporaries
+// use XMM0-XMM5 and XMM6 is scratch. Homes, the locals below the loop
+// header's stack height and the globals a trace touches, live in XMM8-XMM15
+// from entry until the trace exits.
+#define TEMP_COUNT 6
+#define SCRATCH    6
+#define HOME_BASE  8
+#define MAX_HOMES  8
+#define MAX_DEPTH  32
+
+struct Trace {
+    uint8_t* code;
+    size_t size;
+    size_t entry;  // offset of the entry point in code
+    size_t height; // stack slots in use at the loop header
+    uint32_t bails;
+};
+
+static bool is_falsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !RAW_BOOL(value));
+}
+
+static uint16_t read_short(uint8_t* ip) {
+    return (uint16_t)((ip[0] << 8) | ip[1]);
+}
+
+// Traces treat quickened instructions like the generic ones.
+static uint8_t generic_op(uint8_t op) {
+    switch (op) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:      return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:   return OP_DIVIDE;
+        case OP_LESS_NUM:     return OP_LESS;
+        case OP_GREATER_NUM:  return OP_GREATER;
+        default:              return op;
+    }
+}
+
+static double fold(uint8_t op, double a, double b) {
+    switch (op) {
+        case OP_ADD:      return a + b;
+        case OP_SUBTRACT: return a - b;
+        case OP_MULTIPLY: return a * b;
+        default:          return a / b;
+    }
+}
+
+// Recording -------------------------------------------------------------------
+
+typedef struct {
+    uint8_t* ips[TRACE_MAX_LENGTH];
+    size_t count;
+    size_t height;
+} Recording;
+
+static bool numbers_on_top(VM* vm) {
+    return IS_NUMBER(vm->stack_top[-1]) && IS_NUMBER(vm->stack_top[-2]);
+}
+
+// Locals below the header's height become homes, which hold numbers only.
+static bool readable_local(Recording* rec, Value* slots, uint8_t slot) {
+    return slot >= rec->height || IS_NUMBER(slots[slot]);
+}
+
+// Runs one iteration of the loop the way run() would, remembering each
+// instruction on the way. Anything a trace can't do stops the recording
+// before it runs, leaving frame->ip there for the interpreter.
+static bool record(VM* vm, CallFrame* frame, LoopSite* site, Recording* rec) {
+    Chunk* chunk = &frame->closure->function->chunk;
+    Value* slots = frame->slots;
+    uint16_t loops_seen[16];
+    size_t loops_seen_count = 0;
+
+    rec->count = 0;
+    rec->height = (size_t)(vm->stack_top - slots);
+    for (;;) {
+        if (rec->count == TRACE_MAX_LENGTH) {
+            return false;
+        }
+
+        uint8_t* ip = frame->ip;
+        uint8_t* next = ip + 1;
+        switch (generic_op(*ip)) {
+            case OP_CONSTANT: {
+                Value constant = chunk->constants.values[ip[1]];
+                if (!IS_NUMBER(constant)) {
+                    return false;
+                }
+                stack_push(vm, constant);
+                next = ip + 2;
+                break;
+            }
+            case OP_NIL:
+                stack_push(vm, BOX_NIL);
+                break;
+            case OP_TRUE:
+                stack_push(vm, BOX_TRUE);
+                break;
+            case OP_FALSE:
+                stack_push(vm, BOX_FALSE);
+                break;
+            case OP_POP:
+                stack_pop(vm);
+                break;
+            case OP_GET_LOCAL:
+                if (!readable_local(rec, slots, ip[1])) {
+                    return false;
+                }
+                stack_push(vm, slots[ip[1]]);
+                next = ip + 2;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                if (ip[1] < rec->height && !IS_NUMBER(vm->stack_top[-1])) {
+                    return false;
+                }
+                slots[ip[1]] = vm->stack_top[-1];
+                if (*ip == OP_SET_LOCAL_POP) {
+                    stack_pop(vm);
+                }
+                next = ip + 2;
+                break;
+            case OP_GET_LOCAL_2:
+                if (!readable_local(rec, slots, ip[1]) || !readable_local(rec, slots, ip[2])) {
+                    return false;
+                }
+                stack_push(vm, slots[ip[1]]);
+                stack_push(vm, slots[ip[2]]);
+                next = ip + 3;
+                break;
+            case OP_GET_LOCAL_CONSTANT: {
+                Value constant = chunk->constants.values[ip[2]];
+                if (!readable_local(rec, slots, ip[1]) || !IS_NUMBER(constant)) {
+                    return false;
+                }
+                stack_push(vm, slots[ip[1]]);
+                stack_push(vm, constant);
+                next = ip + 3;
+                break;
+            }
+            case OP_GET_GLOBAL: {
+                Value value = vm->global_values.values[read_short(ip + 1)];
+                if (!IS_NUMBER(value)) {
+                    return false;
+                }
+                stack_push(vm, value);
+                next = ip + 3;
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                Value* global = &vm->global_values.values[read_short(ip + 1)];
+                if (!IS_NUMBER(*global) || !IS_NUMBER(vm->stack_top[-1])) {
+                    return false;
+                }
+                *global = vm->stack_top[-1];
+                next = ip + 3;
+                break;
+            }
+            case OP_EQUAL: {
+                Value b = stack_pop(vm);
+                Value a = stack_pop(vm);
+                stack_push(vm, BOX_BOOL(values_equal(vm, a, b)));
+                break;
+            }
+            case OP_LESS:
+            case OP_GREATER: {
+                if (!numbers_on_top(vm)) {
+                    return false;
+                }
+                double b = RAW_NUMBER(stack_pop(vm));
+                double a = RAW_NUMBER(stack_pop(vm));
+                stack_push(vm, BOX_BOOL(generic_op(*ip) == OP_LESS ? a < b : a > b));
+                break;
+            }
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE: {
+                if (!numbers_on_top(vm)) {
+                    return false;
+                }
+                double b = RAW_NUMBER(stack_pop(vm));
+                double a = RAW_NUMBER(stack_pop(vm));
+                stack_push(vm, BOX_NUMBER(fold(generic_op(*ip), a, b)));
+                break;
+            }
+            case OP_CONCAT: {
+                Value* operands = vm->stack_top - ip[1];
+                for (uint8_t i = 0; i < ip[1]; i++) {
+                    if (!IS_NUMBER(operands[i])) {
+                        return false;
+                    }
+                }
+                double sum = RAW_NUMBER(operands[0]);
+                for (uint8_t i = 1; i < ip[1]; i++) {
+                    sum += RAW_NUMBER(operands[i]);
+                }
+                vm->stack_top = operands;
+                stack_push(vm, BOX_NUMBER(sum));
+                next = ip + 2;
+                break;
+            }
+            case OP_CONCAT_CHECK: {
+                Value* operands = vm->stack_top - ip[1];
+                for (uint8_t i = 0; i < ip[1]; i++) {
+                    if (!IS_NUMBER(operands[i])) {
+                        return false;
+                    }
+                }
+                next = ip + 3;
+                break;
+            }
+            case OP_NEGATE:
+                if (!IS_NUMBER(vm->stack_top[-1])) {
+                    return false;
+                }
+                vm->stack_top[-1] = BOX_NUMBER(-RAW_NUMBER(vm->stack_top[-1]));
+                break;
+            case OP_NOT:
+                vm->stack_top[-1] = BOX_BOOL(is_falsey(vm->stack_top[-1]));
+                break;
+            case OP_JUMP:
+                next = ip + 3 + read_short(ip + 1);
+                break;
+            case OP_JUMP_IF_FALSE:
+                next = ip + 3;
+                if (is_falsey(vm->stack_top[-1])) {
+                    next += read_short(ip + 1);
+                }
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+                next = ip + 3;
+                if (is_falsey(stack_pop(vm))) {
+                    next += read_short(ip + 1);
+                }
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER: {
+                if (!numbers_on_top(vm)) {
+                    return false;
+                }
+                double b = RAW_NUMBER(stack_pop(vm));
+                double a = RAW_NUMBER(stack_pop(vm));
+                next = ip + 3;
+                if (*ip == OP_JUMP_IF_NOT_LESS ? !(a < b) : !(a > b)) {
+                    next += read_short(ip + 1);
+                }
+                break;
+            }
+            case OP_LOOP: {
+                uint16_t loop = read_short(ip + 3);
+                next = ip + 5 - read_short(ip + 1);
+                if (&chunk->loops[loop] == site) {
+                    rec->ips[rec->count++] = ip;
+                    frame->ip = next;
+                    return true;
+                }
+                // Other back-edges, like a for loop's jump from its increment
+                // to its condition, may be taken once. A second time means
+                // an inner loop, which gets a trace of its own.
+                for (size_t i = 0; i < loops_seen_count; i++) {
+                    if (loops_seen[i] == loop) {
+                        return false;
+                    }
+                }
+                if (loops_seen_count == sizeof(loops_seen) / sizeof(loops_seen[0])) {
+                    return false;
+                }
+                loops_seen[loops_seen_count++] = loop;
+                break;
+            }
+            default:
+                // Calls, upvalues, objects and everything that allocates.
+                return false;
+        }
+        rec->ips[rec->count++] = ip;
+        frame->ip = next;
+    }
+}
+
+// Compiling -------------------------------------------------------------------
+
+typedef enum {
+    OPERAND_CONSTANT,
+    OPERAND_TEMP,
+    OPERAND_HOME,
+} OperandKind;
+
+// A number the trace holds. reg is a temporary's XMM register or the index
+// of a home.
+typedef struct {
+    OperandKind kind;
+    double number;
+    int reg;
+} Operand;
+
+typedef enum {
+    ENTRY_NUMBER,
+    ENTRY_BOOL,
+    ENTRY_NIL,
+    ENTRY_COMPARE,
+} EntryKind;
+
+// One operand stack slot above the loop header's height. Comparisons stay
+// pending until something needs them, so branches can test the flags.
+typedef struct {
+    EntryKind kind;
+    Operand left;    // the number, or the left side of a comparison
+    Operand right;
+    uint8_t compare; // OP_LESS, OP_GREATER or OP_EQUAL
+    bool boolean;    // the constant, or whether a comparison is negated
+} StackEntry;
+
+typedef struct {
+    bool global;
+    size_t index;
+    bool written;
+} Home;
+
+// A way out of the trace, with the stack the interpreter expects there.
+typedef struct {
+    size_t jumps[2];
+    int jump_count;
+    StackEntry* stack;
+    size_t depth;
+    uint8_t* ip;
+} Exit;
+
+typedef struct {
+    size_t at;
+    double number;
+} Constant;
+
+typedef struct {
+    Assembler as;
+    size_t height;
+    StackEntry stack[MAX_DEPTH];
+    size_t depth;
+    unsigned temps; // temporaries in use, one bit per register
+    Home homes[MAX_HOMES];
+    size_t home_count;
+    Exit* exits;
+    size_t exit_count;
+    size_t exit_capacity;
+    Constant* constants;
+    size_t constant_count;
+    size_t constant_capacity;
+    bool failed;
+} TraceCompiler;
+
+static Operand constant_operand(double number) {
+    Operand operand = {OPERAND_CONSTANT, number, 0};
+    return operand;
+}
+
+static Operand reg_operand(OperandKind kind, int reg) {
+    Operand operand = {kind, 0, reg};
+    return operand;
+}
+
+static StackEntry number_entry(Operand value) {
+    StackEntry entry = {ENTRY_NUMBER, value, value, OP_EQUAL, false};
+    return entry;
+}
+
+static StackEntry bool_entry(bool boolean) {
+    StackEntry entry = {ENTRY_BOOL, constant_operand(0), constant_operand(0), OP_EQUAL, boolean};
+    return entry;
+}
+
+static StackEntry nil_entry(void) {
+    StackEntry entry = {ENTRY_NIL, constant_operand(0), constant_operand(0), OP_EQUAL, false};
+    return entry;
+}
+
+static int operand_reg(Operand operand) {
+    return operand.kind == OPERAND_HOME ? HOME_BASE + operand.reg : operand.reg;
+}
+
+static int alloc_temp(TraceCompiler* tc) {
+    for (int reg = 0; reg < TEMP_COUNT; reg++) {
+        if (!(tc->temps & (1u << reg))) {
+            tc->temps |= 1u << reg;
+            return reg;
+        }
+    }
+    tc->failed = true;
+    return 0;
+}
+
+static void free_operand(TraceCompiler* tc, Operand operand) {
+    if (operand.kind == OPERAND_TEMP) {
+        tc->temps &= ~(1u << operand.reg);
+    }
+}
+
+static void free_entry(TraceCompiler* tc, StackEntry entry) {
+    if (entry.kind == ENTRY_NUMBER || entry.kind == ENTRY_COMPARE) {
+        free_operand(tc, entry.left);
+    }
+    if (entry.kind == ENTRY_COMPARE) {
+        free_operand(tc, entry.right);
+    }
+}
+
+static void push(TraceCompiler* tc, StackEntry entry) {
+    if (tc->depth == MAX_DEPTH) {
+        tc->failed = true;
+        free_entry(tc, entry);
+        return;
+    }
+    tc->stack[tc->depth++] = entry;
+}
+
+static StackEntry pop(TraceCompiler* tc) {
+    if (tc->depth == 0) {
+        tc->failed = true;
+        return nil_entry();
+    }
+    return tc->stack[--tc->depth];
+}
+
+// op xmm, [constant], with the constant placed after the code.
+static void emit_constant_op(TraceCompiler* tc, uint8_t prefix, uint8_t op, int dst, double number) {
+    if (tc->constant_count == tc->constant_capacity) {
+        tc->constant_capacity = tc->constant_capacity < 16 ? 16 : tc->constant_capacity * 2;
+        tc->constants = x64_grow(tc->constants, sizeof(Constant) * tc->constant_capacity);
+    }
+    tc->constants[tc->constant_count].at = emit_sse_rip(&tc->as, prefix, op, dst);
+    tc->constants[tc->constant_count].number = number;
+    tc->constant_count++;
+}
+
+static void emit_operand_op(TraceCompiler* tc, uint8_t prefix, uint8_t op, int dst, Operand src) {
+    if (src.kind == OPERAND_CONSTANT) {
+        emit_constant_op(tc, prefix, op, dst, src.number);
+    } else {
+        emit_sse_rr(&tc->as, prefix, op, dst, operand_reg(src));
+    }
+}
+
+static void move_operand(TraceCompiler* tc, int dst, Operand src) {
+    if (src.kind == OPERAND_CONSTANT) {
+        emit_constant_op(tc, 0xf2, SSE_MOVSD, dst, src.number);
+    } else if (operand_reg(src) != dst) {
+        emit_sse_rr(&tc->as, 0x66, SSE_MOVAPD, dst, operand_reg(src));
+    }
+}
+
+// A register holding the operand, loading constants into scratch.
+static int operand_in_reg(TraceCompiler* tc, Operand operand) {
+    if (operand.kind == OPERAND_CONSTANT) {
+        move_operand(tc, SCRATCH, operand);
+        return SCRATCH;
+    }
+    return operand_reg(operand);
+}
+
+// Temporaries belong to a single entry, so copies get their own.
+static StackEntry copy_entry(TraceCompiler* tc, StackEntry entry) {
+    if (entry.kind == ENTRY_COMPARE) {
+        tc->failed = true;
+    } else if (entry.kind == ENTRY_NUMBER && entry.left.kind == OPERAND_TEMP) {
+        int reg = alloc_temp(tc);
+        move_operand(tc, reg, entry.left);
+        return number_entry(reg_operand(OPERAND_TEMP, reg));
+    }
+    return entry;
+}
+
+static int home(TraceCompiler* tc, bool global, size_t index) {
+    for (size_t i = 0; i < tc->home_count; i++) {
+        if (tc->homes[i].global == global && tc->homes[i].index == index) {
+            return (int)i;
+        }
+    }
+    if (tc->home_count == MAX_HOMES) {
+        tc->failed = true;
+        return 0;
+    }
+    tc->homes[tc->home_count].global = global;
+    tc->homes[tc->home_count].index = index;
+    tc->homes[tc->home_count].written = false;
+    return (int)tc->home_count++;
+}
+
+static void detach_operand(TraceCompiler* tc, Operand* operand, int h) {
+    if (operand->kind == OPERAND_HOME && operand->reg == h) {
+        int reg = alloc_temp(tc);
+        move_operand(tc, reg, *operand);
+        *operand = reg_operand(OPERAND_TEMP, reg);
+    }
+}
+
+// Stack entries read homes lazily, so they take a copy before one changes.
+static void detach_home(TraceCompiler* tc, int h) {
+    for (size_t i = 0; i < tc->depth; i++) {
+        StackEntry* entry = &tc->stack[i];
+        if (entry->kind == ENTRY_NUMBER || entry->kind == ENTRY_COMPARE) {
+            detach_operand(tc, &entry->left, h);
+        }
+        if (entry->kind == ENTRY_COMPARE) {
+            detach_operand(tc, &entry->right, h);
+        }
+    }
+}
+
+static void store_home(TraceCompiler* tc, int h) {
+    if (tc->depth == 0 || tc->stack[tc->depth - 1].kind != ENTRY_NUMBER) {
+        tc->failed = true;
+        return;
+    }
+    Operand value = tc->stack[tc->depth - 1].left;
+    if (value.kind == OPERAND_HOME && value.reg == h) {
+        return;
+    }
+    detach_home(tc, h);
+    move_operand(tc, HOME_BASE + h, value);
+    tc->homes[h].written = true;
+}
+
+static void get_local(TraceCompiler* tc, uint8_t slot) {
+    if (slot < tc->height) {
+        push(tc, number_entry(reg_operand(OPERAND_HOME, home(tc, false, slot))));
+        return;
+    }
+    size_t position = slot - tc->height;
+    if (position >= tc->depth) {
+        tc->failed = true;
+        return;
+    }
+    push(tc, copy_entry(tc, tc->stack[position]));
+}
+
+static void set_local(TraceCompiler* tc, uint8_t slot) {
+    if (slot < tc->height) {
+        store_home(tc, home(tc, false, slot));
+        return;
+    }
+    size_t position = slot - tc->height;
+    if (position + 1 >= tc->depth) {
+        tc->failed = true;
+        return;
+    }
+    StackEntry value = copy_entry(tc, tc->stack[tc->depth - 1]);
+    free_entry(tc, tc->stack[position]);
+    tc->stack[position] = value;
+}
+
+static uint8_t sse_op(uint8_t op) {
+    switch (op) {
+        case OP_ADD:      return SSE_ADD;
+        case OP_SUBTRACT: return SSE_SUB;
+        case OP_MULTIPLY: return SSE_MUL;
+        default:          return SSE_DIV;
+    }
+}
+
+static void arith(TraceCompiler* tc, uint8_t op) {
+    StackEntry b = pop(tc);
+    StackEntry a = pop(tc);
+    if (a.kind != ENTRY_NUMBER || b.kind != ENTRY_NUMBER) {
+        tc->failed = true;
+        return;
+    }
+    if (a.left.kind == OPERAND_CONSTANT && b.left.kind == OPERAND_CONSTANT) {
+        push(tc, number_entry(constant_operand(fold(op, a.left.number, b.left.number))));
+        return;
+    }
+
+    // Reuse a temporary operand as the destination when there is one.
+    bool commutes = op == OP_ADD || op == OP_MULTIPLY;
+    if (commutes && a.left.kind != OPERAND_TEMP && b.left.kind == OPERAND_TEMP) {
+        StackEntry swap = a;
+        a = b;
+        b = swap;
+    }
+    int dst;
+    if (a.left.kind == OPERAND_TEMP) {
+        dst = a.left.reg;
+    } else {
+        dst = alloc_temp(tc);
+        move_operand(tc, dst, a.left);
+    }
+    emit_operand_op(tc, 0xf2, sse_op(op), dst, b.left);
+    free_operand(tc, b.left);
+    push(tc, number_entry(reg_operand(OPERAND_TEMP, dst)));
+}
+
+// Only numbers get recorded, so a concatenation is a chain of additions
+// from the left.
+static void concat(TraceCompiler* tc, uint8_t count) {
+    if (count > tc->depth) {
+        tc->failed = true;
+        return;
+    }
+    StackEntry operands[MAX_DEPTH];
+    tc->depth -= count;
+    memcpy(operands, &tc->stack[tc->depth], sizeof(StackEntry) * count);
+    push(tc, operands[0]);
+    for (uint8_t i = 1; i < count; i++) {
+        push(tc, operands[i]);
+        arith(tc, OP_ADD);
+    }
+}
+
+// Every operand so far has to be a number already, which leaves nothing to
+// check at run time.
+static void concat_check(TraceCompiler* tc, uint8_t count) {
+    if (count > tc->depth) {
+        tc->failed = true;
+        return;
+    }
+    for (size_t i = tc->depth - count; i < tc->depth; i++) {
+        if (tc->stack[i].kind != ENTRY_NUMBER) {
+            tc->failed = true;
+            return;
+        }
+    }
+}
+
+static void negate(TraceCompiler* tc) {
+    StackEntry a = pop(tc);
+    if (a.kind != ENTRY_NUMBER) {
+        tc->failed = true;
+        return;
+    }
+    if (a.left.kind == OPERAND_CONSTANT) {
+        push(tc, number_entry(constant_operand(-a.left.number)));
+        return;
+    }
+    int dst = a.left.kind == OPERAND_TEMP ? a.left.reg : alloc_temp(tc);
+    emit_from_xmm(&tc->as, RAX, operand_reg(a.left));
+    emit_mov_imm(&tc->as, RCX, SIGN_BIT);
+    emit_rr(&tc->as, 0x31, RAX, RCX); // xor
+    emit_to_xmm(&tc->as, dst, RAX);
+    push(tc, number_entry(reg_operand(OPERAND_TEMP, dst)));
+}
+
+static void logical_not(TraceCompiler* tc) {
+    StackEntry a = pop(tc);
+    if (a.kind == ENTRY_COMPARE) {
+        a.boolean = !a.boolean;
+        push(tc, a);
+        return;
+    }
+    free_entry(tc, a);
+    push(tc, bool_entry(a.kind == ENTRY_NIL || (a.kind == ENTRY_BOOL && !a.boolean)));
+}
+
+static void compare(TraceCompiler* tc, uint8_t op) {
+    StackEntry b = pop(tc);
+    StackEntry a = pop(tc);
+    if (a.kind == ENTRY_NUMBER && b.kind == ENTRY_NUMBER) {
+        if (a.left.kind == OPERAND_CONSTANT && b.left.kind == OPERAND_CONSTANT) {
+            double x = a.left.number;
+            double y = b.left.number;
+            push(tc, bool_entry(op == OP_LESS ? x < y : op == OP_GREATER ? x > y : x == y));
+            return;
+        }
+        StackEntry entry = {ENTRY_COMPARE, a.left, b.left, op, false};
+        push(tc, entry);
+        return;
+    }
+    if (op != OP_EQUAL || a.kind == ENTRY_COMPARE || b.kind == ENTRY_COMPARE) {
+        tc->failed = true;
+        return;
+    }
+    free_entry(tc, a);
+    free_entry(tc, b);
+    push(tc, bool_entry(a.kind == b.kind && (a.kind != ENTRY_BOOL || a.boolean == b.boolean)));
+}
+
+// Sets the flags for a comparison. The returned condition holds when it is
+// true, and for CC_E only if the parity flag is clear too.
+static Cond emit_compare_flags(TraceCompiler* tc, StackEntry* entry) {
+    if (entry->compare == OP_LESS) {
+        // a < b is b > a, which also comes out false for NaN.
+        int right = operand_in_reg(tc, entry->right);
+        emit_operand_op(tc, 0x66, SSE_UCOMISD, right, entry->left);
+        return CC_A;
+    }
+    int left = operand_in_reg(tc, entry->left);
+    emit_operand_op(tc, 0x66, SSE_UCOMISD, left, entry->right);
+    return entry->compare == OP_GREATER ? CC_A : CC_E;
+}
+
+// Boxes an entry into RAX. Clobbers RCX and RDX.
+static void emit_box(TraceCompiler* tc, StackEntry* entry) {
+    Assembler* as = &tc->as;
+    switch (entry->kind) {
+        case ENTRY_NUMBER:
+            if (entry->left.kind == OPERAND_CONSTANT) {
+                emit_mov_imm(as, RAX, BOX_NUMBER(entry->left.number));
+            } else {
+                emit_from_xmm(as, RAX, operand_reg(entry->left));
+            }
+            return;
+        case ENTRY_BOOL:
+            emit_mov_imm(as, RAX, BOX_BOOL(entry->boolean));
+            return;
+        case ENTRY_NIL:
+            emit_mov_imm(as, RAX, BOX_NIL);
+            return;
+        case ENTRY_COMPARE:
+            if (emit_compare_flags(tc, entry) == CC_A) {
+                emit_setcc(as, entry->boolean ? CC_BE : CC_A, RAX);
+            } else {
+                emit_setcc(as, CC_E, RAX);
+                emit_setcc(as, CC_NP, RDX);
+                emit(as, 0x20); // and al, dl
+                emit(as, 0xd0);
+                if (entry->boolean) {
+                    emit(as, 0x34); // xor al, 1
+                    emit(as, 0x01);
+                }
+            }
+            emit_movzx8(as, RAX);
+            emit_mov_imm(as, RCX, BOX_FALSE);
+            emit_rr(as, 0x01, RAX, RCX); // add
+            return;
+    }
+}
+
+static Exit* add_exit(TraceCompiler* tc, uint8_t* ip) {
+    if (tc->exit_count == tc->exit_capacity) {
+        tc->exit_capacity = tc->exit_capacity < 8 ? 8 : tc->exit_capacity * 2;
+        tc->exits = x64_grow(tc->exits, sizeof(Exit) * tc->exit_capacity);
+    }
+    Exit* exit = &tc->exits[tc->exit_count++];
+    exit->jump_count = 0;
+    exit->depth = tc->depth;
+    exit->stack = x64_grow(NULL, sizeof(StackEntry) * (tc->depth + 1));
+    memcpy(exit->stack, tc->stack, sizeof(StackEntry) * tc->depth);
+    exit->ip = ip;
+    return exit;
+}
+
+// Follows a conditional jump the way the recording went. Going the other
+// way leaves the trace, so only comparisons cost anything here.
+static void branch(TraceCompiler* tc, StackEntry cond, bool jumped, uint8_t* fallthrough, uint8_t* target) {
+    if (cond.kind != ENTRY_COMPARE) {
+        bool falsey = cond.kind == ENTRY_NIL || (cond.kind == ENTRY_BOOL && !cond.boolean);
+        if (falsey != jumped) {
+            tc->failed = true;
+        }
+        return;
+    }
+
+    Exit* exit = add_exit(tc, jumped ? fallthrough : target);
+    Assembler* as = &tc->as;
+    // The recording jumped when the condition was falsey, so leave when
+    // it is truthy, and the other way round.
+    bool leave_if = cond.boolean != jumped;
+    if (emit_compare_flags(tc, &cond) == CC_A) {
+        exit->jumps[exit->jump_count++] = emit_jcc(as, leave_if ? CC_A : CC_BE);
+    } else if (leave_if) {
+        size_t unordered = emit_jcc(as, CC_P);
+        exit->jumps[exit->jump_count++] = emit_jcc(as, CC_E);
+        patch_here(as, unordered);
+    } else {
+        exit->jumps[exit->jump_count++] = emit_jcc(as, CC_P);
+        exit->jumps[exit->jump_count++] = emit_jcc(as, CC_NE);
+    }
+}
+
+static void emit_global_base(Assembler* as) {
+    emit_mov_ptr(as, RCX, &as->vm->global_values.values);
+    emit_load(as, RCX, RCX, 0);
+}
+
+static void emit_return(Assembler* as, bool entered) {
+    emit(as, 0xb8); // mov eax, entered
+    emit32(as, entered);
+    emit_add_imm(as, RSP, 8);
+    emit_pop_reg(as, R15);
+    emit_pop_reg(as, R14);
+    emit_pop_reg(as, R13);
+    emit_pop_reg(as, R12);
+    emit_pop_reg(as, RBX);
+    emit_pop_reg(as, RBP);
+    emit(as, 0xc3); // ret
+}
+
+// Writes the homes back, rebuilds the stack from the snapshot and hands
+// the frame back to the interpreter.
+static void emit_exit(TraceCompiler* tc, Exit* exit) {
+    Assembler* as = &tc->as;
+    for (int i = 0; i < exit->jump_count; i++) {
+        patch_here(as, exit->jumps[i]);
+    }
+    for (size_t h = 0; h < tc->home_count; h++) {
+        Home* home = &tc->homes[h];
+        if (!home->written) {
+            continue;
+        }
+        emit_from_xmm(as, RAX, HOME_BASE + (int)h);
+        if (home->global) {
+            emit_global_base(as);
+            emit_store(as, RCX, home->index * sizeof(Value), RAX);
+        } else {
+            emit_store(as, SLOTS, home->index * sizeof(Value), RAX);
+        }
+    }
+    for (size_t i = 0; i < exit->depth; i++) {
+        emit_box(tc, &exit->stack[i]);
+        emit_store(as, SLOTS, (tc->height + i) * sizeof(Value), RAX);
+    }
+    emit_mov(as, RAX, SLOTS);
+    emit_add_imm(as, RAX, (tc->height + exit->depth) * sizeof(Value));
+    emit_store(as, TOP_PTR, 0, RAX);
+    emit_mov_ptr(as, RAX, exit->ip);
+    emit_store(as, FRAME, offsetof(CallFrame, ip), RAX);
+    emit_return(as, true);
+}
+
+// bool entry(CallFrame* frame): unboxes the homes, checking each is still a
+// number, then jumps into the loop. These are the trace's only type guards;
+// inside the loop every value's type is known.
+static void emit_entry(TraceCompiler* tc, size_t loop) {
+    Assembler* as = &tc->as;
+    emit_push_reg(as, RBP);
+    emit_push_reg(as, RBX);
+    emit_push_reg(as, R12);
+    emit_push_reg(as, R13);
+    emit_push_reg(as, R14);
+    emit_push_reg(as, R15);
+    emit_sub_imm(as, RSP, 8);
+    emit_mov(as, FRAME, RDI);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit_mov_ptr(as, TOP_PTR, &as->vm->stack_top);
+    emit_mov_imm(as, QNAN_R, QNAN);
+
+    size_t guards[MAX_HOMES];
+    for (size_t h = 0; h < tc->home_count; h++) {
+        Home* home = &tc->homes[h];
+        if (home->global) {
+            emit_global_base(as);
+            emit_load(as, RAX, RCX, home->index * sizeof(Value));
+        } else {
+            emit_load(as, RAX, SLOTS, home->index * sizeof(Value));
+        }
+        emit_mov(as, RDX, RAX);
+        emit_rr(as, 0x21, RDX, QNAN_R); // and
+        emit_cmp(as, RDX, QNAN_R);
+        guards[h] = emit_jcc(as, CC_E);
+        emit_to_xmm(as, HOME_BASE + (int)h, RAX);
+    }
+    patch_to(as, emit_jmp(as), loop);
+
+    for (size_t h = 0; h < tc->home_count; h++) {
+        patch_here(as, guards[h]);
+    }
+    emit_return(as, false);
+}
+
+static void free_compiler(TraceCompiler* tc) {
+    for (size_t i = 0; i < tc->exit_count; i++) {
+        free(tc->exits[i].stack);
+    }
+    free(tc->exits);
+    free(tc->constants);
+    free(tc->as.code);
+    free(tc->as.patches);
+}
+
+// Turns the recorded path into a loop over unboxed numbers. Constants fold
+// away as the operand stack is simulated, and only branches the recording
+// saw go one way become guards, each leaving through its own exit.
+static Trace* compile(VM* vm, Chunk* chunk, Recording* rec) {
+    TraceCompiler tc;
+    memset(&tc, 0, sizeof(tc));
+    tc.as.vm = vm;
+    tc.as.chunk = chunk;
+    tc.height = rec->height;
+
+    // The loop body comes first, so it starts at offset 0.
+    for (size_t i = 0; i < rec->count && !tc.failed; i++) {
+        uint8_t* ip = rec->ips[i];
+        switch (generic_op(*ip)) {
+            case OP_CONSTANT:
+                push(&tc, number_entry(constant_operand(RAW_NUMBER(chunk->constants.values[ip[1]]))));
+                break;
+            case OP_NIL:
+                push(&tc, nil_entry());
+                break;
+            case OP_TRUE:
+                push(&tc, bool_entry(true));
+                break;
+            case OP_FALSE:
+                push(&tc, bool_entry(false));
+                break;
+            case OP_POP:
+                free_entry(&tc, pop(&tc));
+                break;
+            case OP_GET_LOCAL:
+                get_local(&tc, ip[1]);
+                break;
+            case OP_SET_LOCAL:
+                set_local(&tc, ip[1]);
+                break;
+            case OP_SET_LOCAL_POP:
+                set_local(&tc, ip[1]);
+                free_entry(&tc, pop(&tc));
+                break;
+            case OP_GET_LOCAL_2:
+                get_local(&tc, ip[1]);
+                get_local(&tc, ip[2]);
+                break;
+            case OP_GET_LOCAL_CONSTANT:
+                get_local(&tc, ip[1]);
+                push(&tc, number_entry(constant_operand(RAW_NUMBER(chunk->constants.values[ip[2]]))));
+                break;
+            case OP_GET_GLOBAL:
+                push(&tc, number_entry(reg_operand(OPERAND_HOME, home(&tc, true, read_short(ip + 1)))));
+                break;
+            case OP_SET_GLOBAL:
+                store_home(&tc, home(&tc, true, read_short(ip + 1)));
+                break;
+            case OP_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+                compare(&tc, generic_op(*ip));
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                arith(&tc, generic_op(*ip));
+                break;
+            case OP_CONCAT:
+                concat(&tc, ip[1]);
+                break;
+            case OP_CONCAT_CHECK:
+                concat_check(&tc, ip[1]);
+                break;
+            case OP_NEGATE:
+                negate(&tc);
+                break;
+            case OP_NOT:
+                logical_not(&tc);
+                break;
+            case OP_JUMP:
+                break;
+            case OP_JUMP_IF_FALSE: {
+                uint8_t* target = ip + 3 + read_short(ip + 1);
+                if (tc.depth == 0) {
+                    tc.failed = true;
+                    break;
+                }
+                branch(&tc, tc.stack[tc.depth - 1], rec->ips[i + 1] == target, ip + 3, target);
+                break;
+            }
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER: {
+                if (*ip == OP_JUMP_IF_NOT_LESS) {
+                    compare(&tc, OP_LESS);
+                } else if (*ip == OP_JUMP_IF_NOT_GREATER) {
+                    compare(&tc, OP_GREATER);
+                }
+                uint8_t* target = ip + 3 + read_short(ip + 1);
+                StackEntry cond = pop(&tc);
+                branch(&tc, cond, rec->ips[i + 1] == target, ip + 3, target);
+                free_entry(&tc, cond);
+                break;
+            }
+            case OP_LOOP:
+                // Only the last instruction closes the loop. Others are
+                // plain backward jumps.
+                if (i + 1 == rec->count) {
+                    if (tc.depth != 0) {
+                        tc.failed = true;
+                    }
+                    patch_to(&tc.as, emit_jmp(&tc.as), 0);
+                }
+                break;
+            default:
+                tc.failed = true;
+                break;
+        }
+    }
+    if (tc.failed) {
+        free_compiler(&tc);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < tc.exit_count; i++) {
+        emit_exit(&tc, &tc.exits[i]);
+    }
+    size_t entry = tc.as.count;
+    emit_entry(&tc, 0);
+    while (tc.as.count % sizeof(double) != 0) {
+        emit(&tc.as, 0);
+    }
+    for (size_t i = 0; i < tc.constant_count; i++) {
+        patch_to(&tc.as, tc.constants[i].at, tc.as.count);
+        emit64(&tc.as, BOX_NUMBER(tc.constants[i].number));
+    }
+
+    uint8_t* code = x64_install(&tc.as);
+    size_t size = tc.as.count;
+    free_compiler(&tc);
+    if (code == NULL) {
+        return NULL;
+    }
+    Trace* trace = x64_grow(NULL, sizeof(Trace));
+    trace->code = code;
+    trace->size = size;
+    trace->entry = entry;
+    trace->height = rec->height;
+    trace->bails = 0;
+    return trace;
+}
+
+static bool run_trace(VM* vm, Trace* trace, CallFrame* frame) {
+    if (vm->stack_top != frame->slots + trace->height) {
+        return false;
+    }
+    bool (*entry)(CallFrame*);
+    uint8_t* start = trace->code + trace->entry;
+    memcpy(&entry, &start, sizeof(entry));
+    return entry(frame);
+}
+
+// Back-edges to wait before recording again, twice as many after each
+// failed recording.
+static uint32_t trace_backoff(uint32_t attempts) {
+    uint32_t shift = attempts < TRACE_MAX_ATTEMPTS ? attempts : TRACE_MAX_ATTEMPTS;
+    return (uint32_t)TRACE_HOT_LOOPS << shift;
+}
+
+void trace_loop(VM* vm, CallFrame* frame, LoopSite* site) {
+    Trace* trace = site->trace;
+    if (trace != NULL) {
+        site->countdown = 1;
+        if (run_trace(vm, trace, frame)) {
+            trace->bails = 0;
+        } else if (++trace->bails == TRACE_MAX_BAILS) {
+            trace_free(trace);
+            site->trace = NULL;
+            site->attempts = TRACE_MAX_ATTEMPTS;
+            site->countdown = UINT32_MAX;
+        }
+        return;
+    }
+    // The countdown only puts off the next call, so a loop that was given
+    // up on still comes back here every 2^32 back-edges.
+    if (vm->jit_mode == JIT_MODE_OFF || site->attempts >= TRACE_MAX_ATTEMPTS) {
+        site->countdown = UINT32_MAX;
+        return;
+    }
+
+    Recording rec;
+    if (record(vm, frame, site, &rec)) {
+        site->trace = compile(vm, &frame->closure->function->chunk, &rec);
+    }
+    if (site->trace != NULL) {
+        site->countdown = 1;
+    } else if (++site->attempts == TRACE_MAX_ATTEMPTS) {
+        site->countdown = UINT32_MAX;
+    } else {
+        site->countdown = trace_backoff(site->attempts);
+    }
+}
+
+void trace_free(Trace* trace) {
+    if (trace == NULL) {
+        return;
+    }
+    x64_release(trace->code, trace->size);
+    free(trace);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Back-edges a loop takes before the tracing JIT records it.
+#define TRACE_HOT_LOOPS 56
+// Failed recordings after which a loop is left to the interpreter for good.
+// A trace that keeps bailing out gives its loop up the same way.
+#define TRACE_MAX_ATTEMPTS 4
+
+// Called when a back-edge runs site's countdown out, with frame->ip at the
+// loop header. Runs the loop's trace, or records and compiles one. Either way
+// frame->ip ends up at an instruction for the caller to carry on from.
+void trace_loop(VM* vm, CallFrame* frame, LoopSite* site);
+void trace_free(Trace* trace);
+
+#endif
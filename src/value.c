@@ -11,27 +11,44 @@ void init_varr(ValueArray* array) {
     array->values = NULL;
 }
 
-void free_varr(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void free_varr(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     init_varr(array);
 }
 
-void varr_write(ValueArray* array, Value value) {
+void varr_write(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         size_t old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, old_capacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-bool values_equal(Value a, Value b) {
+// Interned strings are equal only if they are the same object. Any other
+// string is interned to compare it, unless the lengths differ.
+static bool strings_equal(VM* vm, ObjString* a, ObjString* b) {
+    if ((string_is_interned(a) && string_is_interned(b)) || a->length != b->length) {
+        return false;
+    }
+    if (!string_is_interned(a)) {
+        a = string_intern(vm, a);
+    }
+    if (!string_is_interned(b)) {
+        b = string_intern(vm, b);
+    }
+    return a == b;
+}
+
+bool values_equal(VM* vm, Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return RAW_NUMBER(a) == RAW_NUMBER(b);
     }
-    return a == b;
+    if (a == b) {
+        return true;
+    }
 #else
     if (a.type != b.type) {
         return false;
@@ -40,10 +57,15 @@ bool values_equal(Value a, Value b) {
         case VAL_NIL:       return true;
         case VAL_BOOL:      return RAW_BOOL(a) == RAW_BOOL(b);
         case VAL_NUMBER:    return RAW_NUMBER(a) == RAW_NUMBER(b);
-        case VAL_OBJ:       return RAW_OBJ(a) == RAW_OBJ(b);
+        case VAL_OBJ:
+            if (RAW_OBJ(a) == RAW_OBJ(b)) {
+                return true;
+            }
+            break;
         default:            return false; // Unreachable.
     }
 #endif
+    return IS_STRING(a) && IS_STRING(b) && strings_equal(vm, RAW_STRING(a), RAW_STRING(b));
 }
 
 void print_value(Value value) {
@@ -71,6 +93,8 @@ void print_value(Value value) {
         case VAL_OBJ:
             print_object(value);
             break;
+        case VAL_UNDEFINED:
+            break; // Never visible to scripts.
     }
 #endif
 }
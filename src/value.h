@@ -17,14 +17,17 @@ typedef uint64_t Value;
 #define TAG_NIL   1 // 0b01
 #define TAG_FALSE 2 // 0b10
 #define TAG_TRUE  3 // 0b11
+#define TAG_UNDEFINED 4 // 0b100
 
 #define IS_NIL(value)     ((value) == BOX_NIL)
+#define IS_UNDEFINED(value) ((value) == BOX_UNDEFINED)
 #define IS_BOOL(value)    (((value) | 1) == BOX_TRUE)
 #define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
     (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
 
 #define BOX_NIL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define BOX_UNDEFINED     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define BOX_FALSE         ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define BOX_TRUE          ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define BOX_BOOL(b)       ((b) ? BOX_TRUE : BOX_FALSE)
@@ -56,6 +59,7 @@ typedef enum {
     VAL_BOOL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -68,11 +72,13 @@ typedef struct {
 } Value;
 
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 #define BOX_NIL           ((Value){VAL_NIL, {.number = 0}})
+#define BOX_UNDEFINED     ((Value){VAL_UNDEFINED, {.number = 0}})
 #define BOX_BOOL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define BOX_NUMBER(value) ((Value){VAL_NUMBER, {.number = value}})
 #define BOX_OBJ(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
@@ -90,8 +96,8 @@ typedef struct {
 } ValueArray;
 
 void init_varr(ValueArray* array);
-void free_varr(ValueArray* array);
-void varr_write(ValueArray* array, Value value);
+void free_varr(VM* vm, ValueArray* array);
+void varr_write(VM* vm, ValueArray* array, Value value);
 
-bool values_equal(Value a, Value b);
+bool values_equal(VM* vm, Value a, Value b);
 void print_value(Value value);
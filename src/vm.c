@@ -1,10 +1,13 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "memory.h"
 #include "object.h"
 
@@ -12,57 +15,57 @@
 #include "debug.h"
 #endif
 
-VM vm;  // singleton
-
-void stack_push(Value value) {
-    *vm.stack_top = value;
-    vm.stack_top++;
+void stack_push(VM* vm, Value value) {
+    *vm->stack_top = value;
+    vm->stack_top++;
 }
 
-Value stack_pop() {
-    vm.stack_top--;
-    return *vm.stack_top;
+Value stack_pop(VM* vm) {
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 
-static void stack_reset() {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = NULL;
+static void stack_reset(VM* vm) {
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalues = NULL;
 }
 
-static Value stack_peek(size_t distance) {
-    return vm.stack_top[-1 - distance];
+static Value stack_peek(VM* vm, size_t distance) {
+    return vm->stack_top[-1 - distance];
 }
 
 static bool is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !RAW_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = RAW_STRING(stack_peek(0));
-    ObjString* a = RAW_STRING(stack_peek(1));
-
-    size_t length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Ropes are flattened for printing, so printing one again copies nothing.
+static void print_line(VM* vm, Value value) {
+    if (IS_STRING(value)) {
+        value = BOX_OBJ(string_flatten(vm, RAW_STRING(value)));
+    }
+    print_value(value);
+    printf("\n");
+}
 
-    ObjString* result = take_string(chars, length);
-    stack_pop();
-    stack_pop();
-    stack_push(BOX_OBJ(result));
+static void concatenate(VM* vm) {
+    ObjString* b = RAW_STRING(stack_peek(vm, 0));
+    ObjString* a = RAW_STRING(stack_peek(vm, 1));
+    ObjString* result = concat_strings(vm, a, b);
+    stack_pop(vm);
+    stack_pop(vm);
+    stack_push(vm, BOX_OBJ(result));
 }
 
-static void runtime_error(const char* format, ...) {
+static void runtime_error(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+    for (int i = vm->frame_count - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %zu] in ", function->chunk.lines[instruction]);
@@ -73,114 +76,327 @@ static void runtime_error(const char* format, ...) {
         }
     }
 
-    stack_reset();
+    stack_reset(vm);
 }
 
-static void define_native(const char* name, NativeFn function) {
-    stack_push(BOX_OBJ(copy_string(name, strlen(name))));
-    stack_push(BOX_OBJ(new_native(function)));
-    table_set(&vm.globals, RAW_STRING(vm.stack[0]), vm.stack[1]);
-    stack_pop();
-    stack_pop();
+// Calls reach their safepoint with the callee's frame pushed, but the error
+// belongs to the call. frame_count is how many frames there were before the
+// instruction.
+static void heap_limit_error(VM* vm, size_t frame_count) {
+    vm->frame_count = frame_count;
+    runtime_error(vm, "Out of memory: heap limit of %zu bytes exceeded.", vm->gc_max_heap);
+}
+
+// Adds the top count values for OP_CONCAT. Strings all the way through are
+// joined at once; anything else is added a pair at a time from the left,
+// as a chain of OP_ADD would.
+static bool concatenate_n(VM* vm, size_t count) {
+    Value* operands = vm->stack_top - count;
+    size_t strings = 0;
+    while (strings < count && IS_STRING(operands[strings])) {
+        strings++;
+    }
+    if (strings == count) {
+        operands[0] = BOX_OBJ(concat_string_values(vm, operands, count));
+        vm->stack_top = operands + 1;
+        return true;
+    }
+
+    for (size_t i = 1; i < count; i++) {
+        Value a = operands[0];
+        Value b = operands[i];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+            operands[0] = BOX_NUMBER(RAW_NUMBER(a) + RAW_NUMBER(b));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+            operands[0] = BOX_OBJ(concat_strings(vm, RAW_STRING(a), RAW_STRING(b)));
+        } else {
+            runtime_error(vm, "Operands must be two numbers or two strings.");
+            return false;
+        }
+    }
+    vm->stack_top = operands + 1;
+    return true;
 }
 
-static bool call(ObjClosure* closure, size_t arg_count) {
+// Checks the newest unchecked values of an OP_CONCAT chain of count so far.
+// A chain of OP_ADD only gets past each operand if it has the first one's
+// type, and fails there before the next operand runs.
+static bool check_concat(VM* vm, size_t count, size_t unchecked) {
+    Value* operands = vm->stack_top - count;
+    for (size_t i = count - unchecked; i < count; i++) {
+        if (!(IS_NUMBER(operands[0]) && IS_NUMBER(operands[i]))
+                && !(IS_STRING(operands[0]) && IS_STRING(operands[i]))) {
+            runtime_error(vm, "Operands must be two numbers or two strings.");
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t global_slot(VM* vm, ObjString* name) {
+    Value slot;
+    if (table_get(&vm->global_slots, name, &slot)) {
+        return (size_t)RAW_NUMBER(slot);
+    }
+
+    stack_push(vm, BOX_OBJ(name));
+    size_t idx = vm->global_values.count;
+    varr_write(vm, &vm->global_names, BOX_OBJ(name));
+    gc_root_barrier(vm, BOX_OBJ(name));
+    varr_write(vm, &vm->global_values, BOX_UNDEFINED);
+    table_set(vm, &vm->global_slots, name, BOX_NUMBER((double)idx));
+    stack_pop(vm);
+    return idx;
+}
+
+static const char* global_name(VM* vm, size_t slot) {
+    return RAW_STRING(vm->global_names.values[slot])->chars;
+}
+
+static void define_native(VM* vm, const char* name, NativeFn function) {
+    stack_push(vm, BOX_OBJ(copy_string(vm, name, strlen(name))));
+    stack_push(vm, BOX_OBJ(new_native(vm, function)));
+    size_t slot = global_slot(vm, RAW_STRING(vm->stack[0]));
+    vm->global_values.values[slot] = vm->stack[1];
+    stack_pop(vm);
+    stack_pop(vm);
+}
+
+static void grow_frames(VM* vm) {
+    size_t capacity = vm->frame_capacity * 2;
+    vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, vm->frame_capacity, capacity);
+    vm->frame_capacity = capacity;
+}
+
+// Moves the value stack into an allocation twice the size. Frame slots and
+// open upvalues point into it, so they are moved along.
+static void grow_stack(VM* vm) {
+    size_t capacity = vm->stack_capacity * 2;
+    Value* stack = ALLOCATE(vm, Value, capacity);
+    memcpy(stack, vm->stack, sizeof(Value) * (vm->stack_top - vm->stack));
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stack_top = stack + (vm->stack_top - vm->stack);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stack_capacity);
+    vm->stack = stack;
+    vm->stack_capacity = capacity;
+    vm->stack_limit = stack + capacity - STACK_SLACK;
+}
+
+static bool call(VM* vm, ObjClosure* closure, size_t arg_count) {
     ObjFunction* function = closure->function;
     if (arg_count != function->arity) {
-        runtime_error("Expected %zu arguments but got %zu.", function->arity, arg_count);
+        runtime_error(vm, "Expected %zu arguments but got %zu.", function->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("Stack overflow.");
+    if (vm->frame_count == vm->max_frames) {
+        runtime_error(vm, "Stack overflow.");
         return false;
     }
+    if (vm->frame_count == vm->frame_capacity) {
+        grow_frames(vm);
+    }
+    while (vm->stack_top - arg_count - 1 + function->max_stack > vm->stack_limit) {
+        grow_stack(vm);
+    }
 
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+#ifdef JIT
+    if (vm->jit_mode != JIT_MODE_OFF && function->jit == NULL) {
+        size_t threshold = vm->jit_mode == JIT_MODE_FORCE ? 1 : JIT_HOT_CALLS;
+        if (++function->call_count == threshold) {
+            jit_compile(vm, function);
+        }
+    }
+#endif
+
+    CallFrame* frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
     frame->ip = function->chunk.code;
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = vm->stack_top - arg_count - 1;
+#ifdef JIT
+    frame->jit_return = NULL;
+#endif
     return true;
 }
 
-static bool call_value(Value callee, size_t arg_count) {
+static bool call_value(VM* vm, Value callee, size_t arg_count) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = RAW_BOUND_METHOD(callee);
-                vm.stack_top[-arg_count - 1] = bound->receiver;
-                return call(bound->method, arg_count);
+                vm->stack_top[-arg_count - 1] = bound->receiver;
+                return call(vm, bound->method, arg_count);
             }
             case OBJ_CLASS: {
                 ObjClass* klass = RAW_CLASS(callee);
-                vm.stack_top[-arg_count - 1] = BOX_OBJ(new_instance(klass));
+                vm->stack_top[-arg_count - 1] = BOX_OBJ(new_instance(vm, klass));
                 Value initializer;
-                if (table_get(&klass->methods, vm.init_string, &initializer)) {
-                    return call(RAW_CLOSURE(initializer), arg_count);
+                if (table_get(&klass->methods, vm->init_string, &initializer)) {
+                    return call(vm, RAW_CLOSURE(initializer), arg_count);
                 } else if (arg_count != 0) {
-                    runtime_error("Expected 0 arguments but got %zu.", arg_count);
+                    runtime_error(vm, "Expected 0 arguments but got %zu.", arg_count);
                     return false;
                 }
                 return true;
             }
             case OBJ_CLOSURE:
-                return call(RAW_CLOSURE(callee), arg_count);
+                return call(vm, RAW_CLOSURE(callee), arg_count);
             case OBJ_NATIVE: {
                 NativeFn native = RAW_NATIVE(callee);
-                Value result = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count + 1;
-                stack_push(result);
+                Value result = native(vm, arg_count, vm->stack_top - arg_count);
+                vm->stack_top -= arg_count + 1;
+                stack_push(vm, result);
                 return true;
             }
             default:
                 break; // Non-callable object type.
         }
     }
-    runtime_error("Can only call functions and classes.");
+    runtime_error(vm, "Can only call functions and classes.");
     return false;
 }
 
-static bool invoke_from_class(ObjClass* klass, ObjString* name, size_t arg_count) {
+static bool invoke_from_class(VM* vm, ObjClass* klass, ObjString* name, size_t arg_count) {
     Value method;
     if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(RAW_CLOSURE(method), arg_count);
+    return call(vm, RAW_CLOSURE(method), arg_count);
 }
 
-static bool invoke(ObjString* name, size_t arg_count) {
-    Value receiver = stack_peek(arg_count);
-    if (!IS_INSTANCE(receiver)) {
-        runtime_error("Only instances have methods.");
+static bool bind_method(VM* vm, ObjClass* klass, ObjString* name) {
+    Value method;
+    if (!table_get(&klass->methods, name, &method)) {
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    ObjInstance* instance = RAW_INSTANCE(receiver);
+    ObjBoundMethod* bound = new_bound_method(vm, stack_peek(vm, 0), RAW_CLOSURE(method));
+    stack_pop(vm);
+    stack_push(vm, BOX_OBJ(bound));
+    return true;
+}
 
-    Value value;
-    if (table_get(&instance->fields, name, &value)) {
-        vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+static CacheEntry* cache_add(VM* vm, InlineCache* cache, ObjShape* shape, ObjShape* transition,
+                             size_t slot, ObjClosure* method) {
+    CacheEntry* entry;
+    if (cache->count < INLINE_CACHE_WAYS) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % INLINE_CACHE_WAYS;
+    }
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->slot = slot;
+    entry->method = method;
+    // The cache belongs to the running function.
+    Obj* owner = (Obj*)vm->frames[vm->frame_count - 1].closure->function;
+    gc_write_barrier(vm, owner, BOX_OBJ(shape));
+    if (transition != NULL) {
+        gc_write_barrier(vm, owner, BOX_OBJ(transition));
     }
+    if (method != NULL) {
+        gc_write_barrier(vm, owner, BOX_OBJ(method));
+    }
+    return entry;
+}
 
-    return invoke_from_class(instance->klass, name, arg_count);
+// Finds the entry for the instance's shape. Shapes are never shared between
+// classes and record every field, so a matching shape also proves that no
+// field shadows a cached method.
+static CacheEntry* cache_lookup(InlineCache* cache, ObjInstance* instance) {
+    for (size_t i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape == instance->shape) {
+            return entry;
+        }
+    }
+    return NULL;
 }
 
-static bool bind_method(ObjClass* klass, ObjString* name) {
+// The slow path: resolve the property through the shape and class and
+// remember it.
+static CacheEntry* cache_resolve(VM* vm, InlineCache* cache, ObjInstance* instance, ObjString* name) {
+    size_t slot;
+    if (shape_find_slot(instance->shape, name, &slot)) {
+        return cache_add(vm, cache, instance->shape, NULL, slot, NULL);
+    }
     Value method;
-    if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+    if (table_get(&instance->klass->methods, name, &method)) {
+        return cache_add(vm, cache, instance->shape, NULL, 0, RAW_CLOSURE(method));
+    }
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
+    return NULL;
+}
+
+static bool get_property(VM* vm, ObjString* name, InlineCache* cache) {
+    ObjInstance* instance = RAW_INSTANCE(stack_peek(vm, 0));
+    CacheEntry* entry = cache_lookup(cache, instance);
+    if (entry == NULL && (entry = cache_resolve(vm, cache, instance, name)) == NULL) {
         return false;
     }
-    ObjBoundMethod* bound = new_bound_method(stack_peek(0), RAW_CLOSURE(method));
-    stack_pop();
-    stack_push(BOX_OBJ(bound));
+
+    Value value;
+    if (entry->method == NULL) {
+        value = instance->fields[entry->slot];
+    } else {
+        value = BOX_OBJ(new_bound_method(vm, stack_peek(vm, 0), entry->method));
+    }
+    stack_pop(vm);
+    stack_push(vm, value);
     return true;
 }
 
-static ObjUpvalue* capture_upvalue(Value* local) {
+static void set_property(VM* vm, ObjString* name, InlineCache* cache) {
+    ObjInstance* instance = RAW_INSTANCE(stack_peek(vm, 1));
+    CacheEntry* entry = cache_lookup(cache, instance);
+    if (entry == NULL || entry->method != NULL) {
+        size_t slot;
+        if (shape_find_slot(instance->shape, name, &slot)) {
+            entry = cache_add(vm, cache, instance->shape, NULL, slot, NULL);
+        } else {
+            ObjShape* next = shape_transition(vm, instance->shape, name);
+            entry = cache_add(vm, cache, instance->shape, next, next->field_count - 1, NULL);
+        }
+    }
+
+    if (entry->transition != NULL) {
+        instance_transition(vm, instance, entry->transition);
+    }
+    instance->fields[entry->slot] = stack_peek(vm, 0);
+    gc_write_barrier(vm, (Obj*)instance, stack_peek(vm, 0));
+}
+
+static bool invoke(VM* vm, ObjString* name, size_t arg_count, InlineCache* cache) {
+    Value receiver = stack_peek(vm, arg_count);
+    if (!IS_INSTANCE(receiver)) {
+        runtime_error(vm, "Only instances have methods.");
+        return false;
+    }
+    ObjInstance* instance = RAW_INSTANCE(receiver);
+
+    CacheEntry* entry = cache_lookup(cache, instance);
+    if (entry == NULL && (entry = cache_resolve(vm, cache, instance, name)) == NULL) {
+        return false;
+    }
+
+    if (entry->method == NULL) {
+        Value value = instance->fields[entry->slot];
+        vm->stack_top[-arg_count - 1] = value;
+        return call_value(vm, value, arg_count);
+    }
+    return call(vm, entry->method, arg_count);
+}
+
+static ObjUpvalue* capture_upvalue(VM* vm, Value* local) {
     ObjUpvalue* prev = NULL;
-    ObjUpvalue* upvalue = vm.open_upvalues;
+    ObjUpvalue* upvalue = vm->open_upvalues;
 
     while (upvalue != NULL && upvalue->location > local) {
         prev = upvalue;
@@ -191,38 +407,68 @@ static ObjUpvalue* capture_upvalue(Value* local) {
         return upvalue;
     }
 
-    ObjUpvalue* created = new_upvalue(local);
+    ObjUpvalue* created = new_upvalue(vm, local);
     created->next = upvalue;
     if (prev == NULL) {
-        vm.open_upvalues = created;
+        vm->open_upvalues = created;
     } else {
         prev->next = created;
     }
     return created;
 }
 
-static void close_upvalues(Value* last) {
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.open_upvalues;
+static void close_upvalues(VM* vm, Value* last) {
+    while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+        gc_write_barrier(vm, (Obj*)upvalue, upvalue->closed);
+        vm->open_upvalues = upvalue->next;
     }
 }
 
-static void define_method(ObjString* name) {
-    Value method = stack_peek(0);
-    ObjClass* klass = RAW_CLASS(stack_peek(1));
-    table_set(&klass->methods, name, method);
-    stack_pop();
+// Moves the frame a tail call just pushed down over its caller's, so
+// tail-recursive code runs in constant stack space. call() made room for
+// the callee's frame higher up, so it still fits.
+static void reuse_frame(VM* vm) {
+    CallFrame* callee = &vm->frames[vm->frame_count - 1];
+    CallFrame* caller = callee - 1;
+    close_upvalues(vm, caller->slots);
+    size_t count = (size_t)(vm->stack_top - callee->slots);
+    memmove(caller->slots, callee->slots, sizeof(Value) * count);
+    vm->stack_top = caller->slots + count;
+    caller->closure = callee->closure;
+    caller->ip = callee->ip;
+    vm->frame_count--;
+}
+
+static void define_method(VM* vm, ObjString* name) {
+    Value method = stack_peek(vm, 0);
+    ObjClass* klass = RAW_CLASS(stack_peek(vm, 1));
+    table_set(vm, &klass->methods, name, method);
+    gc_write_barrier(vm, (Obj*)klass, method);
+    stack_pop(vm);
+}
+
+static void set_upvalue(VM* vm, ObjUpvalue* upvalue, Value value) {
+    *upvalue->location = value;
+    gc_write_barrier(vm, (Obj*)upvalue, value);
+}
+
+static void inherit(VM* vm, ObjClass* superclass, ObjClass* subclass) {
+    table_add_all(vm, &superclass->methods, &subclass->methods);
+    gc_remember(vm, (Obj*)subclass);
+    if (vm->gc_phase == GC_MARKING) {
+        table_mark_reachable(vm, &subclass->methods);
+    }
 }
 
 #ifdef DEBUG_TRACE_EXECUTION
-static void print_stack() {
-    if (vm.stack_top == vm.stack) {
+static void print_stack(VM* vm) {
+    if (vm->stack_top == vm->stack) {
         printf("[ ]");
     } else {
-        for (Value* curr = vm.stack; curr < vm.stack_top; curr++) {
+        for (Value* curr = vm->stack; curr < vm->stack_top; curr++) {
             printf("[ ");
             print_value(*curr);
             printf(" ]");
@@ -232,312 +478,978 @@ static void print_stack() {
 }
 #endif
 
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+#ifdef DEBUG_PROFILE_OPCODES
+static void profile_opcode(VM* vm, uint8_t opcode) {
+    if (vm->previous_opcode != -1) {
+        vm->opcode_pairs[vm->previous_opcode][opcode]++;
+    }
+    vm->previous_opcode = opcode;
+}
 
+static void print_opcode_pairs(VM* vm) {
+    fprintf(stderr, "-- opcode pairs (count first second)\n");
+    for (size_t first = 0; first < UINT8_COUNT; first++) {
+        for (size_t second = 0; second < UINT8_COUNT; second++) {
+            if (vm->opcode_pairs[first][second] > 0) {
+                fprintf(stderr, "%zu %zu %zu\n", vm->opcode_pairs[first][second], first, second);
+            }
+        }
+    }
+}
+#endif
+
+// Operand readers for run() and jit_fallback(), which keep the executing
+// frame in a local named frame.
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() RAW_STRING(READ_CONSTANT())
 #define READ_SHORT() \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_OP(value_type, op) \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+// The collector only runs between instructions that allocate, where every
+// live object is reachable from the VM's roots. Running out of heap there is
+// a runtime error. A call's safepoint is given the frame count from before
+// it pushed the callee's frame.
+#define CALL_SAFEPOINT(frames) \
+    do { \
+        if (vm->gc_pending && !gc_collect(vm)) { \
+            heap_limit_error(vm, frames); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+#define SAFEPOINT() CALL_SAFEPOINT(vm->frame_count)
+
+#ifdef COMPUTED_GOTO
+// Labels as values are a GNU extension, which -pedantic would flag.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__GNUC__) && !defined(__clang__)
+// Otherwise GCC cross-jumps every DISPATCH() back into one shared branch.
+__attribute__((optimize("no-crossjumping")))
+#endif
+#endif
+static InterpretResult run(VM* vm) {
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
+
+// Rewrites the opcode that is executing. Quickened forms only trust their
+// operand types after a guard, so the rewrite is always safe to undo.
+#define QUICKEN(op) (frame->ip[-1] = (op))
+#define DEOPTIMIZE(op) \
+    do { \
+        frame->ip--; \
+        *frame->ip = (op); \
+        DISPATCH(); \
+    } while (false)
+#define BINARY_OP(value_type, op, quick) \
     do { \
-        if (!IS_NUMBER(stack_peek(0)) || !IS_NUMBER(stack_peek(1))) { \
-            runtime_error("Operands must be numbers."); \
+        if (!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) { \
+            runtime_error(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = RAW_NUMBER(stack_pop()); \
-        double a = RAW_NUMBER(stack_pop()); \
-        stack_push(value_type(a op b)); \
+        QUICKEN(quick); \
+        double b = RAW_NUMBER(stack_pop(vm)); \
+        double a = RAW_NUMBER(stack_pop(vm)); \
+        stack_push(vm, value_type(a op b)); \
+    } while (false)
+#define NUMBER_OP(value_type, op, generic) \
+    do { \
+        Value b = vm->stack_top[-1]; \
+        Value a = vm->stack_top[-2]; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            DEOPTIMIZE(generic); \
+        } \
+        vm->stack_top--; \
+        vm->stack_top[-1] = value_type(RAW_NUMBER(a) op RAW_NUMBER(b)); \
+    } while (false)
+#define COMPARE_JUMP(op) \
+    do { \
+        if (!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) { \
+            runtime_error(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = RAW_NUMBER(stack_pop(vm)); \
+        double a = RAW_NUMBER(stack_pop(vm)); \
+        uint16_t offset = READ_SHORT(); \
+        if (!(a op b)) { \
+            frame->ip += offset; \
+        } \
     } while (false)
 
-    while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
-        print_stack();
-        disassemble_instruction(&frame->closure->function->chunk,
-                (size_t)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        print_stack(vm); \
+        disassemble_instruction(vm, &frame->closure->function->chunk, \
+                (size_t)(frame->ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
-        uint8_t instruction = READ_BYTE();
-        switch (instruction) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                stack_push(constant);
-                break;
-            }
-            case OP_NIL:    stack_push(BOX_NIL); break;
-            case OP_TRUE:   stack_push(BOX_BOOL(true)); break;
-            case OP_FALSE:  stack_push(BOX_BOOL(false)); break;
-            case OP_POP:    stack_pop(); break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                table_set(&vm.globals, name, stack_peek(0));
-                stack_pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (table_set(&vm.globals, name, stack_peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                stack_push(value);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = stack_peek(0);
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                stack_push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = stack_peek(0);
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                stack_push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(stack_peek(1))) {
-                    runtime_error("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = RAW_INSTANCE(stack_peek(1));
-                table_set(&instance->fields, READ_STRING(), stack_peek(0));
-                Value value = stack_pop();
-                stack_pop();
-                stack_push(value);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(stack_peek(0))) {
-                    runtime_error("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = RAW_INSTANCE(stack_peek(0));
-                ObjString* name = READ_STRING();
-                Value value;
-                if (table_get(&instance->fields, name, &value)) {
-                    stack_pop();
-                    stack_push(value);
-                    break;
-                }
-                if (!bind_method(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profile_opcode(vm, *frame->ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef JIT
+// Switches to compiled code whenever the new top frame has some.
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm->frames[vm->frame_count - 1]; \
+        if (frame->closure->function->jit != NULL) { \
+            goto run_jit; \
+        } \
+    } while (false)
+#else
+#define LOAD_FRAME() (frame = &vm->frames[vm->frame_count - 1])
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Threaded dispatch: each handler jumps straight to the next one, so every
+    // opcode gets its own indirect branch for the predictor to learn.
+    static void* dispatch_table[] = {
+        [OP_CONSTANT]       = &&do_OP_CONSTANT,
+        [OP_NIL]            = &&do_OP_NIL,
+        [OP_TRUE]           = &&do_OP_TRUE,
+        [OP_FALSE]          = &&do_OP_FALSE,
+        [OP_POP]            = &&do_OP_POP,
+        [OP_DEFINE_GLOBAL]  = &&do_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]     = &&do_OP_SET_GLOBAL,
+        [OP_GET_GLOBAL]     = &&do_OP_GET_GLOBAL,
+        [OP_SET_LOCAL]      = &&do_OP_SET_LOCAL,
+        [OP_GET_LOCAL]      = &&do_OP_GET_LOCAL,
+        [OP_SET_UPVALUE]    = &&do_OP_SET_UPVALUE,
+        [OP_GET_UPVALUE]    = &&do_OP_GET_UPVALUE,
+        [OP_SET_PROPERTY]   = &&do_OP_SET_PROPERTY,
+        [OP_GET_PROPERTY]   = &&do_OP_GET_PROPERTY,
+        [OP_GET_SUPER]      = &&do_OP_GET_SUPER,
+        [OP_EQUAL]          = &&do_OP_EQUAL,
+        [OP_LESS]           = &&do_OP_LESS,
+        [OP_GREATER]        = &&do_OP_GREATER,
+        [OP_ADD]            = &&do_OP_ADD,
+        [OP_SUBTRACT]       = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY]       = &&do_OP_MULTIPLY,
+        [OP_DIVIDE]         = &&do_OP_DIVIDE,
+        [OP_NEGATE]         = &&do_OP_NEGATE,
+        [OP_CONCAT]         = &&do_OP_CONCAT,
+        [OP_CONCAT_CHECK]   = &&do_OP_CONCAT_CHECK,
+        [OP_NOT]            = &&do_OP_NOT,
+        [OP_PRINT]          = &&do_OP_PRINT,
+        [OP_LOOP]           = &&do_OP_LOOP,
+        [OP_JUMP]           = &&do_OP_JUMP,
+        [OP_JUMP_IF_FALSE]  = &&do_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE] = &&do_OP_POP_JUMP_IF_FALSE,
+        [OP_CALL]           = &&do_OP_CALL,
+        [OP_TAIL_CALL]      = &&do_OP_TAIL_CALL,
+        [OP_INVOKE]         = &&do_OP_INVOKE,
+        [OP_TAIL_INVOKE]    = &&do_OP_TAIL_INVOKE,
+        [OP_SUPER_INVOKE]   = &&do_OP_SUPER_INVOKE,
+        [OP_TAIL_SUPER_INVOKE] = &&do_OP_TAIL_SUPER_INVOKE,
+        [OP_CLOSURE]        = &&do_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]  = &&do_OP_CLOSE_UPVALUE,
+        [OP_RETURN]         = &&do_OP_RETURN,
+        [OP_CLASS]          = &&do_OP_CLASS,
+        [OP_INHERIT]        = &&do_OP_INHERIT,
+        [OP_METHOD]         = &&do_OP_METHOD,
+        [OP_GET_LOCAL_2]    = &&do_OP_GET_LOCAL_2,
+        [OP_GET_LOCAL_CONSTANT] = &&do_OP_GET_LOCAL_CONSTANT,
+        [OP_SET_LOCAL_POP]  = &&do_OP_SET_LOCAL_POP,
+        [OP_JUMP_IF_NOT_LESS] = &&do_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&do_OP_JUMP_IF_NOT_GREATER,
+        [OP_ADD_NUM]        = &&do_OP_ADD_NUM,
+        [OP_ADD_STR]        = &&do_OP_ADD_STR,
+        [OP_SUBTRACT_NUM]   = &&do_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]   = &&do_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]     = &&do_OP_DIVIDE_NUM,
+        [OP_LESS_NUM]       = &&do_OP_LESS_NUM,
+        [OP_GREATER_NUM]    = &&do_OP_GREATER_NUM,
+    };
+
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#define DISPATCH_LOOP DISPATCH();
+#define CASE(op) do_##op
+#else
+#define DISPATCH() goto dispatch
+#define DISPATCH_LOOP \
+    dispatch: \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        switch (READ_BYTE())
+#define CASE(op) case op
+#endif
+
+    LOAD_FRAME();
+    DISPATCH_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            stack_push(vm, constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):    stack_push(vm, BOX_NIL); DISPATCH();
+        CASE(OP_TRUE):   stack_push(vm, BOX_BOOL(true)); DISPATCH();
+        CASE(OP_FALSE):  stack_push(vm, BOX_BOOL(false)); DISPATCH();
+        CASE(OP_POP):    stack_pop(vm); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm->global_values.values[slot] = stack_pop(vm);
+            gc_root_barrier(vm, vm->global_values.values[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values.values[slot])) {
+                runtime_error(vm, "Undefined variable '%s'.", global_name(vm, slot));
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = RAW_CLASS(stack_pop());
-                if (!bind_method(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = stack_pop();
-                Value a = stack_pop();
-                stack_push(BOX_BOOL(values_equal(a, b)));
-                break;
-            }
-            case OP_LESS:       BINARY_OP(BOX_BOOL, <); break;
-            case OP_GREATER:    BINARY_OP(BOX_BOOL, >); break;
-            case OP_ADD: {
-                Value peek_b = stack_peek(0);
-                Value peek_a = stack_peek(1);
-                if (IS_STRING(peek_b) && IS_STRING(peek_a)) {
-                    concatenate();
-                } else if (IS_NUMBER(peek_b) && IS_NUMBER(peek_a)) {
-                    double b = RAW_NUMBER(stack_pop());
-                    double a = RAW_NUMBER(stack_pop());
-                    stack_push(BOX_NUMBER(a + b));
-                } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT:   BINARY_OP(BOX_NUMBER, -); break;
-            case OP_MULTIPLY:   BINARY_OP(BOX_NUMBER, *); break;
-            case OP_DIVIDE:     BINARY_OP(BOX_NUMBER, /); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(stack_peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                stack_push(BOX_NUMBER(-RAW_NUMBER(stack_pop())));
-                break;
-            case OP_NOT:
-                stack_push(BOX_BOOL(is_falsey(stack_pop())));
-                break;
-            case OP_PRINT: {
-                print_value(stack_pop());
-                printf("\n");
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
+            vm->global_values.values[slot] = stack_peek(vm, 0);
+            gc_root_barrier(vm, stack_peek(vm, 0));
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->global_values.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error(vm, "Undefined variable '%s'.", global_name(vm, slot));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stack_push(vm, value);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = stack_peek(vm, 0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            stack_push(vm, frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            set_upvalue(vm, frame->closure->upvalues[slot], stack_peek(vm, 0));
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            stack_push(vm, *frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            if (!IS_INSTANCE(stack_peek(vm, 1))) {
+                runtime_error(vm, "Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjString* name = READ_STRING();
+            set_property(vm, name, READ_CACHE());
+            Value value = stack_pop(vm);
+            stack_pop(vm);
+            stack_push(vm, value);
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            if (!IS_INSTANCE(stack_peek(vm, 0))) {
+                runtime_error(vm, "Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjString* name = READ_STRING();
+            if (!get_property(vm, name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            if (!bind_method(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = stack_pop(vm);
+            Value a = stack_pop(vm);
+            stack_push(vm, BOX_BOOL(values_equal(vm, a, b)));
+            // Comparing ropes flattens and interns them.
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_LESS):       BINARY_OP(BOX_BOOL, <, OP_LESS_NUM); DISPATCH();
+        CASE(OP_GREATER):    BINARY_OP(BOX_BOOL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_ADD): {
+            Value peek_b = stack_peek(vm, 0);
+            Value peek_a = stack_peek(vm, 1);
+            if (IS_STRING(peek_b) && IS_STRING(peek_a)) {
+                QUICKEN(OP_ADD_STR);
+                concatenate(vm);
+                SAFEPOINT();
+            } else if (IS_NUMBER(peek_b) && IS_NUMBER(peek_a)) {
+                QUICKEN(OP_ADD_NUM);
+                double b = RAW_NUMBER(stack_pop(vm));
+                double a = RAW_NUMBER(stack_pop(vm));
+                stack_push(vm, BOX_NUMBER(a + b));
+            } else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_CONCAT): {
+            if (!concatenate_n(vm, READ_BYTE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_CONCAT_CHECK): {
+            uint8_t count = READ_BYTE();
+            uint8_t unchecked = READ_BYTE();
+            if (!check_concat(vm, count, unchecked)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):   BINARY_OP(BOX_NUMBER, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY):   BINARY_OP(BOX_NUMBER, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE):     BINARY_OP(BOX_NUMBER, /, OP_DIVIDE_NUM); DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(stack_peek(vm, 0))) {
+                runtime_error(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stack_push(vm, BOX_NUMBER(-RAW_NUMBER(stack_pop(vm))));
+            DISPATCH();
+        CASE(OP_NOT):
+            stack_push(vm, BOX_BOOL(is_falsey(stack_pop(vm))));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            print_line(vm, stack_pop(vm));
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            uint16_t loop = READ_SHORT();
+            frame->ip -= offset;
+#ifdef JIT
+            LoopSite* site = &frame->closure->function->chunk.loops[loop];
+            if (--site->countdown == 0) {
+                trace_loop(vm, frame, site);
+            }
+#else
+            (void)loop;
+#endif
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(stack_peek(vm, 0))) {
                 frame->ip += offset;
-                break;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey(stack_peek(0))) {
-                    frame->ip += offset;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(stack_pop(vm))) {
+                frame->ip += offset;
             }
-            case OP_CALL: {
-                uint8_t arg_count = READ_BYTE();
-                if (!call_value(stack_peek(arg_count), arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                uint8_t arg_count = READ_BYTE();
-                if (!invoke(method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                uint8_t arg_count = READ_BYTE();
-                ObjClass* superclass = RAW_CLASS(stack_pop());
-                if (!invoke_from_class(superclass, method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction* function = RAW_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = new_closure(function);
-                stack_push(BOX_OBJ(closure));
-                for (size_t i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            uint8_t arg_count = READ_BYTE();
+            size_t frame_count = vm->frame_count;
+            if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            CALL_SAFEPOINT(frame_count);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            uint8_t arg_count = READ_BYTE();
+            size_t frame_count = vm->frame_count;
+            if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // The caller's frame is still there for an error to name.
+            CALL_SAFEPOINT(frame_count);
+            if (vm->frame_count > frame_count) {
+                reuse_frame(vm);
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            size_t frame_count = vm->frame_count;
+            if (!invoke(vm, method, arg_count, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            CALL_SAFEPOINT(frame_count);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_INVOKE): {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            size_t frame_count = vm->frame_count;
+            if (!invoke(vm, method, arg_count, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            CALL_SAFEPOINT(frame_count);
+            if (vm->frame_count > frame_count) {
+                reuse_frame(vm);
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            size_t frame_count = vm->frame_count;
+            if (!invoke_from_class(vm, superclass, method, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            CALL_SAFEPOINT(frame_count);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            size_t frame_count = vm->frame_count;
+            if (!invoke_from_class(vm, superclass, method, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            CALL_SAFEPOINT(frame_count);
+            if (vm->frame_count > frame_count) {
+                reuse_frame(vm);
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = RAW_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = new_closure(vm, function);
+            stack_push(vm, BOX_OBJ(closure));
+            for (size_t i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
             }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(vm.stack_top - 1);
-                stack_pop();
-                break;
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            close_upvalues(vm, vm->stack_top - 1);
+            stack_pop(vm);
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            Value result = stack_pop(vm);
+            close_upvalues(vm, frame->slots);
+
+            vm->frame_count--;
+            if (vm->frame_count == 0) {
+                stack_pop(vm);
+                return INTERPRET_OK;
             }
-            case OP_RETURN: {
-                Value result = stack_pop();
-                close_upvalues(frame->slots);
 
-                vm.frame_count--;
-                if (vm.frame_count == 0) {
-                    stack_pop();
-                    return INTERPRET_OK;
-                }
+            vm->stack_top = frame->slots;
+            stack_push(vm, result);
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            stack_push(vm, BOX_OBJ(new_class(vm, READ_STRING())));
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = stack_peek(vm, 1);
+            if (!IS_CLASS(superclass)) {
+                runtime_error(vm, "Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            inherit(vm, RAW_CLASS(superclass), RAW_CLASS(stack_peek(vm, 0)));
+            stack_pop(vm);
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            define_method(vm, READ_STRING());
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_2): {
+            uint8_t first = READ_BYTE();
+            uint8_t second = READ_BYTE();
+            stack_push(vm, frame->slots[first]);
+            stack_push(vm, frame->slots[second]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            stack_push(vm, frame->slots[slot]);
+            stack_push(vm, READ_CONSTANT());
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = stack_pop(vm);
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS):      COMPARE_JUMP(<); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER):   COMPARE_JUMP(>); DISPATCH();
+        CASE(OP_ADD_NUM):       NUMBER_OP(BOX_NUMBER, +, OP_ADD); DISPATCH();
+        CASE(OP_ADD_STR): {
+            if (!IS_STRING(stack_peek(vm, 0)) || !IS_STRING(stack_peek(vm, 1))) {
+                DEOPTIMIZE(OP_ADD);
+            }
+            concatenate(vm);
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NUM):  NUMBER_OP(BOX_NUMBER, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM):  NUMBER_OP(BOX_NUMBER, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):    NUMBER_OP(BOX_NUMBER, /, OP_DIVIDE); DISPATCH();
+        CASE(OP_LESS_NUM):      NUMBER_OP(BOX_BOOL, <, OP_LESS); DISPATCH();
+        CASE(OP_GREATER_NUM):   NUMBER_OP(BOX_BOOL, >, OP_GREATER); DISPATCH();
+    }
+
+#ifdef JIT
+run_jit:
+    switch (jit_enter(vm, frame)) {
+        case JIT_EXIT_FRAME:
+            LOAD_FRAME();
+            DISPATCH();
+        case JIT_EXIT_DONE:
+            return INTERPRET_OK;
+        default:
+            return INTERPRET_RUNTIME_ERROR;
+    }
+#endif
 
-                vm.stack_top = frame->slots;
-                stack_push(result);
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
 
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+#undef CASE
+#undef DISPATCH_LOOP
+#undef DISPATCH
+#undef PROFILE_INSTRUCTION
+#undef TRACE_INSTRUCTION
+#undef COMPARE_JUMP
+#undef NUMBER_OP
+#undef BINARY_OP
+#undef DEOPTIMIZE
+#undef QUICKEN
+#undef LOAD_FRAME
+}
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef JIT
+// Finishes a tail call from compiled code. A callee that pushed a frame
+// takes over the caller's, which keeps its jit_return.
+static JitStatus tail_call_exit(VM* vm, size_t frame_count) {
+    if (vm->frame_count == frame_count) {
+        return JIT_CONTINUE;
+    }
+    // Collect while the caller's frame is still there for an error to name.
+    if (vm->gc_pending && !gc_collect(vm)) {
+        heap_limit_error(vm, frame_count);
+        return JIT_EXIT_ERROR;
+    }
+    reuse_frame(vm);
+    return JIT_EXIT_FRAME;
+}
+
+static JitStatus fallback(VM* vm, CallFrame* frame) {
+    size_t frame_count = vm->frame_count;
+    switch (frame->ip[-1]) {
+        // Compiled code only gets to the global cases while marking or for
+        // undefined variables.
+        case OP_DEFINE_GLOBAL: {
+            uint16_t slot = READ_SHORT();
+            vm->global_values.values[slot] = stack_pop(vm);
+            gc_root_barrier(vm, vm->global_values.values[slot]);
+            return JIT_CONTINUE;
+        }
+        case OP_SET_GLOBAL: {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values.values[slot])) {
+                runtime_error(vm, "Undefined variable '%s'.", global_name(vm, slot));
+                return JIT_EXIT_ERROR;
             }
-            case OP_CLASS: {
-                stack_push(BOX_OBJ(new_class(READ_STRING())));
-                break;
+            vm->global_values.values[slot] = stack_peek(vm, 0);
+            gc_root_barrier(vm, stack_peek(vm, 0));
+            return JIT_CONTINUE;
+        }
+        case OP_GET_GLOBAL:
+            runtime_error(vm, "Undefined variable '%s'.", global_name(vm, READ_SHORT()));
+            return JIT_EXIT_ERROR;
+        case OP_SET_UPVALUE: {
+            // Compiled code only gets here to store young objects or while
+            // marking.
+            uint8_t slot = READ_BYTE();
+            set_upvalue(vm, frame->closure->upvalues[slot], stack_peek(vm, 0));
+            return JIT_CONTINUE;
+        }
+        case OP_SET_PROPERTY: {
+            if (!IS_INSTANCE(stack_peek(vm, 1))) {
+                runtime_error(vm, "Only instances have fields.");
+                return JIT_EXIT_ERROR;
+            }
+            ObjString* name = READ_STRING();
+            set_property(vm, name, READ_CACHE());
+            Value value = stack_pop(vm);
+            stack_pop(vm);
+            stack_push(vm, value);
+            return JIT_CONTINUE;
+        }
+        case OP_GET_PROPERTY: {
+            if (!IS_INSTANCE(stack_peek(vm, 0))) {
+                runtime_error(vm, "Only instances have properties.");
+                return JIT_EXIT_ERROR;
             }
-            case OP_INHERIT: {
-                Value superclass = stack_peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtime_error("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+            ObjString* name = READ_STRING();
+            return get_property(vm, name, READ_CACHE()) ? JIT_CONTINUE : JIT_EXIT_ERROR;
+        }
+        case OP_GET_SUPER: {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            return bind_method(vm, superclass, name) ? JIT_CONTINUE : JIT_EXIT_ERROR;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            // The number case is inlined, so only strings are left.
+            if (IS_STRING(stack_peek(vm, 0)) && IS_STRING(stack_peek(vm, 1))) {
+                concatenate(vm);
+                return JIT_CONTINUE;
+            }
+            runtime_error(vm, "Operands must be two numbers or two strings.");
+            return JIT_EXIT_ERROR;
+        case OP_NEGATE:
+            runtime_error(vm, "Operand must be a number.");
+            return JIT_EXIT_ERROR;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            runtime_error(vm, "Operands must be numbers.");
+            return JIT_EXIT_ERROR;
+        case OP_CONCAT:
+            // The all-numbers case is inlined.
+            return concatenate_n(vm, READ_BYTE()) ? JIT_CONTINUE : JIT_EXIT_ERROR;
+        case OP_CONCAT_CHECK: {
+            // Numbers are checked inline.
+            uint8_t count = READ_BYTE();
+            uint8_t unchecked = READ_BYTE();
+            return check_concat(vm, count, unchecked) ? JIT_CONTINUE : JIT_EXIT_ERROR;
+        }
+        case OP_EQUAL: {
+            // Compiled code only gets here to compare ropes.
+            Value b = stack_pop(vm);
+            Value a = stack_pop(vm);
+            stack_push(vm, BOX_BOOL(values_equal(vm, a, b)));
+            return JIT_CONTINUE;
+        }
+        case OP_PRINT:
+            print_line(vm, stack_pop(vm));
+            return JIT_CONTINUE;
+        case OP_LOOP: {
+            // Compiled code only gets here once the back-edge counter runs
+            // out. A trace may stop anywhere, so resume at frame->ip.
+            uint16_t offset = READ_SHORT();
+            uint16_t loop = READ_SHORT();
+            frame->ip -= offset;
+            trace_loop(vm, frame, &frame->closure->function->chunk.loops[loop]);
+            return JIT_EXIT_FRAME;
+        }
+        case OP_CALL: {
+            uint8_t arg_count = READ_BYTE();
+            if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+                return JIT_EXIT_ERROR;
+            }
+            break;
+        }
+        case OP_TAIL_CALL: {
+            uint8_t arg_count = READ_BYTE();
+            if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+                return JIT_EXIT_ERROR;
+            }
+            return tail_call_exit(vm, frame_count);
+        }
+        case OP_INVOKE: {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            if (!invoke(vm, method, arg_count, READ_CACHE())) {
+                return JIT_EXIT_ERROR;
+            }
+            break;
+        }
+        case OP_TAIL_INVOKE: {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            if (!invoke(vm, method, arg_count, READ_CACHE())) {
+                return JIT_EXIT_ERROR;
+            }
+            return tail_call_exit(vm, frame_count);
+        }
+        case OP_SUPER_INVOKE: {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            if (!invoke_from_class(vm, superclass, method, arg_count)) {
+                return JIT_EXIT_ERROR;
+            }
+            break;
+        }
+        case OP_TAIL_SUPER_INVOKE: {
+            ObjString* method = READ_STRING();
+            uint8_t arg_count = READ_BYTE();
+            ObjClass* superclass = RAW_CLASS(stack_pop(vm));
+            if (!invoke_from_class(vm, superclass, method, arg_count)) {
+                return JIT_EXIT_ERROR;
+            }
+            return tail_call_exit(vm, frame_count);
+        }
+        case OP_CLOSURE: {
+            ObjFunction* function = RAW_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = new_closure(vm, function);
+            stack_push(vm, BOX_OBJ(closure));
+            for (size_t i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                ObjClass* subclass = RAW_CLASS(stack_peek(0));
-                table_add_all(&RAW_CLASS(superclass)->methods, &subclass->methods);
-                stack_pop();
-                break;
             }
-            case OP_METHOD: {
-                define_method(READ_STRING());
-                break;
+            return JIT_CONTINUE;
+        }
+        case OP_CLOSE_UPVALUE:
+            close_upvalues(vm, vm->stack_top - 1);
+            stack_pop(vm);
+            return JIT_CONTINUE;
+        case OP_RETURN: {
+            Value result = stack_pop(vm);
+            close_upvalues(vm, frame->slots);
+
+            vm->frame_count--;
+            if (vm->frame_count == 0) {
+                stack_pop(vm);
+                return JIT_EXIT_DONE;
             }
+
+            vm->stack_top = frame->slots;
+            stack_push(vm, result);
+            return JIT_EXIT_FRAME;
+        }
+        case OP_CLASS:
+            stack_push(vm, BOX_OBJ(new_class(vm, READ_STRING())));
+            return JIT_CONTINUE;
+        case OP_INHERIT: {
+            Value superclass = stack_peek(vm, 1);
+            if (!IS_CLASS(superclass)) {
+                runtime_error(vm, "Superclass must be a class.");
+                return JIT_EXIT_ERROR;
+            }
+            inherit(vm, RAW_CLASS(superclass), RAW_CLASS(stack_peek(vm, 0)));
+            stack_pop(vm);
+            return JIT_CONTINUE;
         }
+        case OP_METHOD:
+            define_method(vm, READ_STRING());
+            return JIT_CONTINUE;
     }
 
-#undef BINARY_OP
+    // A call either finished natively or pushed a frame to run next. That
+    // frame can return straight into this one's code. Pushing it may have
+    // moved the frames, so frame is looked up again.
+    if (vm->frame_count == frame_count) {
+        return JIT_CONTINUE;
+    }
+    frame = &vm->frames[frame_count - 1];
+    vm->frames[vm->frame_count - 1].jit_return = jit_resume_point(frame);
+    return JIT_EXIT_FRAME;
+}
+
+// Everything compiled code does not inline comes through here, so this is
+// its one safepoint.
+JitStatus jit_fallback(VM* vm, CallFrame* frame) {
+    size_t frame_count = vm->frame_count;
+    JitStatus status = fallback(vm, frame);
+    if (status != JIT_EXIT_ERROR && vm->gc_pending && !gc_collect(vm)) {
+        heap_limit_error(vm, frame_count);
+        return JIT_EXIT_ERROR;
+    }
+    return status;
+}
+#endif
+
+#undef SAFEPOINT
+#undef CALL_SAFEPOINT
+#undef READ_CACHE
 #undef READ_SHORT
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_BYTE
-}
 
-static Value clock_native(size_t UNUSED(arg_count), Value* UNUSED(args)) {
+static Value clock_native(UNUSED(VM* vm), UNUSED(size_t arg_count), UNUSED(Value* args)) {
     return BOX_NUMBER((double)clock() / CLOCKS_PER_SEC);
 }
 
-void init_vm() {
-    stack_reset();
-    vm.objects = NULL;
-    vm.gray_count = 0;
-    vm.gray_capacity = 0;
-    vm.gray_stack = NULL;
-    vm.bytes_allocated = 0;
-    vm.gc_threshold = 1024 * 1024;
-    init_table(&vm.strings);
-    init_table(&vm.globals);
-    vm.init_string = NULL;
-    vm.init_string = copy_string("init", 4);
-    define_native("clock", clock_native);
+// The collector's statistics, as the JSON --gc-stats writes on exit.
+static Value gc_stats_native(VM* vm, UNUSED(size_t arg_count), UNUSED(Value* args)) {
+    char* json = gc_stats_json(vm);
+    ObjString* string = copy_string(vm, json, strlen(json));
+    free(json);
+    return BOX_OBJ(string);
+}
+
+// Weak references and maps are reached through natives, which give nil for
+// arguments of the wrong kind.
+static Value weak_ref_native(VM* vm, size_t arg_count, Value* args) {
+    if (arg_count != 1) {
+        return BOX_NIL;
+    }
+    return BOX_OBJ(new_weak_ref(vm, args[0]));
+}
+
+static Value weak_ref_get_native(UNUSED(VM* vm), size_t arg_count, Value* args) {
+    if (arg_count != 1 || !IS_WEAK_REF(args[0])) {
+        return BOX_NIL;
+    }
+    return RAW_WEAK_REF(args[0])->target;
+}
+
+static Value weak_map_native(VM* vm, UNUSED(size_t arg_count), UNUSED(Value* args)) {
+    return BOX_OBJ(new_weak_map(vm));
 }
 
-void free_vm() {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    vm.init_string = NULL;
-    free_objects();
+static Value weak_map_get_native(VM* vm, size_t arg_count, Value* args) {
+    Value value;
+    if (arg_count != 2 || !IS_WEAK_MAP(args[0]) || !IS_STRING(args[1]) ||
+            !table_get(&RAW_WEAK_MAP(args[0])->table, string_intern(vm, RAW_STRING(args[1])), &value)) {
+        return BOX_NIL;
+    }
+    return value;
+}
+
+static Value weak_map_set_native(VM* vm, size_t arg_count, Value* args) {
+    if (arg_count != 3 || !IS_WEAK_MAP(args[0]) || !IS_STRING(args[1])) {
+        return BOX_NIL;
+    }
+    ObjWeakMap* map = RAW_WEAK_MAP(args[0]);
+    table_set(vm, &map->table, string_intern(vm, RAW_STRING(args[1])), args[2]);
+    gc_write_barrier(vm, (Obj*)map, args[2]);
+    return args[2];
+}
+
+static Value weak_map_delete_native(VM* vm, size_t arg_count, Value* args) {
+    if (arg_count != 2 || !IS_WEAK_MAP(args[0]) || !IS_STRING(args[1])) {
+        return BOX_BOOL(false);
+    }
+    ObjString* key = string_intern(vm, RAW_STRING(args[1]));
+    return BOX_BOOL(table_delete(&RAW_WEAK_MAP(args[0])->table, key));
+}
+
+void init_vm(VM* vm) {
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+    vm->stack = NULL;
+    vm->stack_capacity = 0;
+    stack_reset(vm);
+    init_gc(vm);
+    vm->jit_mode = JIT_MODE_ON;
+    vm->parser = NULL;
+#ifdef DEBUG_PROFILE_OPCODES
+    memset(vm->opcode_pairs, 0, sizeof(vm->opcode_pairs));
+    vm->previous_opcode = -1;
+#endif
+    init_table(&vm->strings);
+    init_table(&vm->global_slots);
+    init_varr(&vm->global_names);
+    init_varr(&vm->global_values);
+    vm->init_string = NULL;
+    vm->frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    vm->frame_capacity = FRAMES_INITIAL;
+    vm->max_frames = FRAMES_MAX;
+    vm->stack = ALLOCATE(vm, Value, STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
+    vm->stack_limit = vm->stack + STACK_INITIAL - STACK_SLACK;
+    stack_reset(vm);
+    vm->init_string = copy_string(vm, "init", 4);
+    define_native(vm, "clock", clock_native);
+    define_native(vm, "gcStats", gc_stats_native);
+    define_native(vm, "weakRef", weak_ref_native);
+    define_native(vm, "weakRefGet", weak_ref_get_native);
+    define_native(vm, "weakMap", weak_map_native);
+    define_native(vm, "weakMapGet", weak_map_get_native);
+    define_native(vm, "weakMapSet", weak_map_set_native);
+    define_native(vm, "weakMapDelete", weak_map_delete_native);
+}
+
+void free_vm(VM* vm) {
+#ifdef DEBUG_PROFILE_OPCODES
+    print_opcode_pairs(vm);
+#endif
+    free_table(vm, &vm->global_slots);
+    free_varr(vm, &vm->global_names);
+    free_varr(vm, &vm->global_values);
+    free_table(vm, &vm->strings);
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->frame_capacity);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stack_capacity);
+    vm->init_string = NULL;
+    free_objects(vm);
 }
 
-InterpretResult vm_interpret(const char* source) {
-    ObjFunction* function = compile(source);
+InterpretResult vm_interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
 
-    stack_push(BOX_OBJ(function));
-    ObjClosure* closure = new_closure(function);
-    stack_pop();
-    stack_push(BOX_OBJ(closure));
-    call_value(BOX_OBJ(closure), 0);
+    stack_push(vm, BOX_OBJ(function));
+    ObjClosure* closure = new_closure(vm, function);
+    stack_pop(vm);
+    stack_push(vm, BOX_OBJ(closure));
+    call_value(vm, BOX_OBJ(closure), 0);
 
-    return run();
+    return run(vm);
 }
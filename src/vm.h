@@ -1,35 +1,141 @@
 #pragma once
 
+#include <time.h>
+
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call-frame and value stacks start this small and double on demand.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL (2 * UINT8_COUNT)
+// Slots past a frame's deepest point for values the VM keeps on the stack
+// while it allocates.
+#define STACK_SLACK 8
+// Default call depth limit; --max-depth changes it.
+#define FRAMES_MAX 1024
+// Upper bound for --gc-threads.
+#define GC_MAX_THREADS 64
+
+typedef enum {
+    JIT_MODE_OFF,
+    JIT_MODE_ON,    // compile functions once they get hot
+    JIT_MODE_FORCE, // compile every function on its first call
+} JitMode;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,  // tracing the old generation a slice at a time
+    GC_SWEEPING,
+    GC_COMPACTING, // moving objects out of sparse heap blocks
+} GcPhase;
+
+// Pause lengths are counted in buckets of powers of two microseconds: the
+// first counts pauses under 1us, the last everything from 2^(N-2)us up.
+#define GC_PAUSE_BUCKETS 24
+
+// Collector telemetry, always kept. Pauses are the safepoints the
+// collector did work at.
+typedef struct {
+    size_t minor_collections;
+    size_t major_collections;
+    size_t compactions;
+    size_t pauses;
+    uint64_t pause_total_ns;
+    uint64_t pause_max_ns;
+    size_t pause_histogram[GC_PAUSE_BUCKETS];
+    size_t bytes_promoted;
+    size_t bytes_reclaimed;
+    size_t allocations[OBJ_TYPE_COUNT];
+    size_t allocated_bytes[OBJ_TYPE_COUNT];
+} GcStats;
 
 typedef struct {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots;
+#ifdef JIT
+    uint8_t* jit_return; // native code of a compiled caller that called directly
+#endif
 } CallFrame;
 
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+struct VM {
+    CallFrame* frames;
     size_t frame_count;
-    Value stack[STACK_MAX];
+    size_t frame_capacity;
+    size_t max_frames;
+    // A frame uses at most its function's max_stack slots, so a call grows
+    // the stack when the callee's frame would reach past stack_limit.
+    Value* stack;
     Value* stack_top;
+    Value* stack_limit;
+    size_t stack_capacity;
     ObjString* init_string;
     ObjUpvalue* open_upvalues;
-    Table globals;
+    // Globals live in slots the compiler assigns by name. A slot holds
+    // BOX_UNDEFINED until its variable is defined.
+    Table global_slots;
+    ValueArray global_names;
+    ValueArray global_values;
     Table strings;
     Obj* objects;
+    // The link to the first old object a sweep in progress has yet to
+    // visit. Dead objects are unlinked in place, and anything allocated
+    // meanwhile goes in ahead of it, marked.
+    Obj** sweeping;
+    // New objects are bump-allocated here and promoted to the old
+    // generation if they survive a minor collection.
+    uint8_t* nursery;
+    uint8_t* nursery_top;
+    uint8_t* nursery_end;
+    // Old objects that may point into the nursery.
+    ObjArray remembered;
+    // Young objects that own memory outside the nursery or sit in strings.
+    ObjArray young_owners;
+    // Every weak reference and weak map not yet found dead.
+    ObjArray weak_objects;
+    // Set by allocation; the interpreter collects at its next safepoint.
+    bool gc_pending;
+    GcPhase gc_phase;
+    // Objects marked or swept per slice of an old-generation cycle; zero
+    // runs the whole cycle in one pause.
+    size_t gc_budget;
+    // Threads that mark when a whole old-generation mark runs at once.
+    size_t gc_threads;
+    // Compact once more than this percentage of the object cells is free;
+    // zero never compacts.
+    size_t gc_compact;
+    bool gc_compact_pending;
+    // Pacing: the old generation is collected once it outgrows what the last
+    // cycle left by enough to keep collecting at about gc_target percent of
+    // the CPU time, or by GC_HEAP_GROW_FACTOR if that is zero. It never
+    // triggers below gc_min_heap bytes, and past gc_max_heap, if set, the
+    // program fails.
+    size_t gc_target;
+    size_t gc_min_heap;
+    size_t gc_max_heap;
+    size_t gc_live;        // bytes the last cycle left
+    clock_t gc_time;       // CPU time the old generation has cost since then
+    clock_t gc_period_start;
+    GcStats gc_stats;
     size_t gray_count;
     size_t gray_capacity;
     Obj** gray_stack;
     size_t bytes_allocated;
     size_t gc_threshold;
-} VM;
+    JitMode jit_mode;
+    // The compilation in progress, whose functions are GC roots.
+    struct Parser* parser;
+    // Where old objects and everything else reallocate() hands out live.
+    Heap heap;
+#ifdef DEBUG_PROFILE_OPCODES
+    // Counts of adjacent opcode pairs, used to pick the compiler's superinstructions.
+    size_t opcode_pairs[UINT8_COUNT][UINT8_COUNT];
+    int previous_opcode;
+#endif
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -37,11 +143,11 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+void init_vm(VM* vm);
+void free_vm(VM* vm);
+InterpretResult vm_interpret(VM* vm, const char* source);
 
-void init_vm();
-void free_vm();
-InterpretResult vm_interpret(const char* source);
+size_t global_slot(VM* vm, ObjString* name);
 
-void stack_push(Value value);
-Value stack_pop();
+void stack_push(VM* vm, Value value);
+Value stack_pop(VM* vm);
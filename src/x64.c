@@ -0,0 +1,264 @@
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "x64.h"
+
+#ifdef JIT
+
+void* x64_grow(void* ptr, size_t size) {
+    void* result = realloc(ptr, size);
+    if (result == NULL) {
+        exit(1);
+    }
+    return result;
+}
+
+uint8_t* x64_install(Assembler* as) {
+    uint8_t* code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, as->code, as->count);
+    if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as->count);
+        return NULL;
+    }
+    return code;
+}
+
+void x64_release(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
+
+void emit(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = x64_grow(as->code, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit(as, (value >> (8 * i)) & 0xff);
+    }
+}
+
+void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit(as, (value >> (8 * i)) & 0xff);
+    }
+}
+
+void patch32(Assembler* as, size_t at, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        as->code[at + i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+void emit_rex(Assembler* as, bool wide, Reg reg, Reg rm) {
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40) {
+        emit(as, rex);
+    }
+}
+
+// op reg, [base + disp32]
+void emit_mem(Assembler* as, uint8_t op, Reg reg, Reg base, int32_t disp) {
+    emit_rex(as, true, reg, base);
+    emit(as, op);
+    emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit(as, 0x24);
+    }
+    emit32(as, (uint32_t)disp);
+}
+
+// op rm, reg
+void emit_rr(Assembler* as, uint8_t op, Reg rm, Reg reg) {
+    emit_rex(as, true, reg, rm);
+    emit(as, op);
+    emit(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op [base + disp32], imm32 with the ModRM reg field as opcode extension
+void emit_mem_imm(Assembler* as, bool wide, uint8_t ext, Reg base, int32_t disp, int32_t value) {
+    emit_rex(as, wide, RAX, base);
+    emit(as, 0x81);
+    emit(as, 0x80 | (ext << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit(as, 0x24);
+    }
+    emit32(as, (uint32_t)disp);
+    emit32(as, (uint32_t)value);
+}
+
+void emit_load(Assembler* as, Reg dst, Reg base, int32_t disp) {
+    emit_mem(as, 0x8b, dst, base, disp);
+}
+
+void emit_store(Assembler* as, Reg base, int32_t disp, Reg src) {
+    emit_mem(as, 0x89, src, base, disp);
+}
+
+void emit_mov(Assembler* as, Reg dst, Reg src) {
+    emit_rr(as, 0x89, dst, src);
+}
+
+void emit_mov_imm(Assembler* as, Reg dst, uint64_t value) {
+    emit_rex(as, true, RAX, dst);
+    emit(as, 0xb8 | (dst & 7));
+    emit64(as, value);
+}
+
+void emit_mov_ptr(Assembler* as, Reg dst, const void* ptr) {
+    emit_mov_imm(as, dst, (uint64_t)(uintptr_t)ptr);
+}
+
+void emit_add_imm(Assembler* as, Reg dst, int32_t value) {
+    emit_rr(as, 0x81, dst, (Reg)0);
+    emit32(as, (uint32_t)value);
+}
+
+void emit_sub_imm(Assembler* as, Reg dst, int32_t value) {
+    emit_rr(as, 0x81, dst, (Reg)5);
+    emit32(as, (uint32_t)value);
+}
+
+void emit_cmp(Assembler* as, Reg a, Reg b) {
+    emit_rr(as, 0x39, a, b);
+}
+
+void emit_test(Assembler* as, Reg reg) {
+    emit_rr(as, 0x85, reg, reg);
+}
+
+void emit_setcc(Assembler* as, Cond cc, Reg dst) {
+    emit(as, 0x0f);
+    emit(as, 0x90 | cc);
+    emit(as, 0xc0 | (dst & 7));
+}
+
+void emit_movzx8(Assembler* as, Reg dst) {
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    emit(as, 0xc0 | ((dst & 7) << 3) | (dst & 7));
+}
+
+// movq xmm, reg
+void emit_to_xmm(Assembler* as, int xmm, Reg src) {
+    emit(as, 0x66);
+    emit_rex(as, true, (Reg)xmm, src);
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    emit(as, 0xc0 | ((xmm & 7) << 3) | (src & 7));
+}
+
+// movq reg, xmm
+void emit_from_xmm(Assembler* as, Reg dst, int xmm) {
+    emit(as, 0x66);
+    emit_rex(as, true, (Reg)xmm, dst);
+    emit(as, 0x0f);
+    emit(as, 0x7e);
+    emit(as, 0xc0 | ((xmm & 7) << 3) | (dst & 7));
+}
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1
+void emit_sse(Assembler* as, uint8_t op) {
+    emit_sse_rr(as, 0xf2, op, 0, 1);
+}
+
+// op xmm, xmm with a mandatory prefix (0x66, 0xf2) or none.
+void emit_sse_rr(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src) {
+    if (prefix != 0) {
+        emit(as, prefix);
+    }
+    emit_rex(as, false, (Reg)dst, (Reg)src);
+    emit(as, 0x0f);
+    emit(as, op);
+    emit(as, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// op xmm, [rip + rel32]; returns the rel32 position for patch_to().
+size_t emit_sse_rip(Assembler* as, uint8_t prefix, uint8_t op, int dst) {
+    if (prefix != 0) {
+        emit(as, prefix);
+    }
+    emit_rex(as, false, (Reg)dst, RAX);
+    emit(as, 0x0f);
+    emit(as, op);
+    emit(as, 0x05 | ((dst & 7) << 3));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void emit_ucomisd(Assembler* as, int a, int b) {
+    emit_sse_rr(as, 0x66, SSE_UCOMISD, a, b);
+}
+
+// lea reg, [rip + rel32]; returns the rel32 position for patch_here().
+size_t emit_lea_rip(Assembler* as, Reg dst) {
+    emit_rex(as, true, dst, RAX);
+    emit(as, 0x8d);
+    emit(as, 0x05 | ((dst & 7) << 3));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void emit_call(Assembler* as, uintptr_t function) {
+    emit_mov_imm(as, RAX, function);
+    emit(as, 0xff);
+    emit(as, 0xd0);
+}
+
+void emit_push_reg(Assembler* as, Reg reg) {
+    if (reg & 8) {
+        emit(as, 0x41);
+    }
+    emit(as, 0x50 | (reg & 7));
+}
+
+void emit_pop_reg(Assembler* as, Reg reg) {
+    if (reg & 8) {
+        emit(as, 0x41);
+    }
+    emit(as, 0x58 | (reg & 7));
+}
+
+// Returns the position of the rel32 operand for patch_here().
+size_t emit_jcc(Assembler* as, Cond cc) {
+    emit(as, 0x0f);
+    emit(as, 0x80 | cc);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+size_t emit_jmp(Assembler* as) {
+    emit(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void patch_to(Assembler* as, size_t at, size_t target) {
+    patch32(as, at, (uint32_t)(target - (at + 4)));
+}
+
+void patch_here(Assembler* as, size_t at) {
+    patch_to(as, at, as->count);
+}
+
+void add_patch(Assembler* as, size_t at, size_t target) {
+    if (as->patch_count == as->patch_capacity) {
+        as->patch_capacity = as->patch_capacity < 16 ? 16 : as->patch_capacity * 2;
+        as->patches = x64_grow(as->patches, sizeof(Patch) * as->patch_capacity);
+    }
+    as->patches[as->patch_count].at = at;
+    as->patches[as->patch_count].target = target;
+    as->patch_count++;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+#ifdef JIT
+
+// A small x86-64 assembler shared by the baseline and tracing JITs.
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+// Registers that stay fixed across all compiled code. They are callee-saved,
+// so they survive calls into the VM.
+#define FRAME   RBX // CallFrame*
+#define SLOTS   R12 // frame->slots
+#define TOP_PTR R13 // &vm->stack_top
+#define TOP     R14 // cached vm->stack_top, written back around every call
+#define QNAN_R  R15 // QNAN, for number guards
+
+typedef enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb,
+} Cond;
+
+typedef struct {
+    size_t at;     // position of a rel32 operand
+    size_t target; // what it jumps to, as the compiler defines it
+} Patch;
+
+typedef struct {
+    VM* vm; // the VM whose state the code addresses directly
+    Chunk* chunk;
+    uint8_t* code;
+    size_t count;
+    size_t capacity;
+    Patch* patches;
+    size_t patch_count;
+    size_t patch_capacity;
+    uint32_t* targets;
+    size_t leave;
+    size_t exit;
+} Assembler;
+
+void* x64_grow(void* ptr, size_t size);
+// Copies the assembled code into executable memory. Returns NULL on failure.
+uint8_t* x64_install(Assembler* as);
+void x64_release(uint8_t* code, size_t size);
+
+void emit(Assembler* as, uint8_t byte);
+void emit32(Assembler* as, uint32_t value);
+void emit64(Assembler* as, uint64_t value);
+void patch32(Assembler* as, size_t at, uint32_t value);
+void emit_rex(Assembler* as, bool wide, Reg reg, Reg rm);
+void emit_mem(Assembler* as, uint8_t op, Reg reg, Reg base, int32_t disp);
+void emit_rr(Assembler* as, uint8_t op, Reg rm, Reg reg);
+void emit_mem_imm(Assembler* as, bool wide, uint8_t ext, Reg base, int32_t disp, int32_t value);
+void emit_load(Assembler* as, Reg dst, Reg base, int32_t disp);
+void emit_store(Assembler* as, Reg base, int32_t disp, Reg src);
+void emit_mov(Assembler* as, Reg dst, Reg src);
+void emit_mov_imm(Assembler* as, Reg dst, uint64_t value);
+void emit_mov_ptr(Assembler* as, Reg dst, const void* ptr);
+void emit_add_imm(Assembler* as, Reg dst, int32_t value);
+void emit_sub_imm(Assembler* as, Reg dst, int32_t value);
+void emit_cmp(Assembler* as, Reg a, Reg b);
+void emit_test(Assembler* as, Reg reg);
+void emit_setcc(Assembler* as, Cond cc, Reg dst);
+void emit_movzx8(Assembler* as, Reg dst);
+void emit_to_xmm(Assembler* as, int xmm, Reg src);
+void emit_from_xmm(Assembler* as, Reg dst, int xmm);
+void emit_sse(Assembler* as, uint8_t op);
+void emit_sse_rr(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src);
+size_t emit_sse_rip(Assembler* as, uint8_t prefix, uint8_t op, int dst);
+void emit_ucomisd(Assembler* as, int a, int b);
+size_t emit_lea_rip(Assembler* as, Reg dst);
+void emit_call(Assembler* as, uintptr_t function);
+void emit_push_reg(Assembler* as, Reg reg);
+void emit_pop_reg(Assembler* as, Reg reg);
+size_t emit_jcc(Assembler* as, Cond cc);
+size_t emit_jmp(Assembler* as);
+void patch_to(Assembler* as, size_t at, size_t target);
+void patch_here(Assembler* as, size_t at);
+void add_patch(Assembler* as, size_t at, size_t target);
+
+// SSE2 opcodes for emit_sse(), emit_sse_rr() and emit_sse_rip().
+#define SSE_MOVSD   0x10
+#define SSE_MOVAPD  0x28
+#define SSE_UCOMISD 0x2e
+#define SSE_ADD     0x58
+#define SSE_MUL     0x59
+#define SSE_SUB     0x5c
+#define SSE_DIV     0x5e
+
+#endif
@@ -21,6 +21,9 @@ SYNTAX_ERROR_RE = re.compile(r'\[.*line (\d+)\] (Error.+)')
 STACK_TRACE_RE = re.compile(r'\[line (\d+)\]')
 NONTEST_RE = re.compile(r'// nontest')
 
+# Interpreter flags that select how the JIT runs.
+JIT_FLAGS = ['--no-jit', '--force-jit']
+
 EX_DATAERR = 65
 EX_SOFTWARE = 70
 
@@ -33,11 +36,12 @@ expectations = 0
 interpreter = None
 filter_paths = None
 verbose = False
+interpreter_flags = []
 
 
 class Interpreter:
     def __init__(self):
-        self.args = [join(REPO_DIR, 'clox')]
+        self.args = [join(REPO_DIR, 'clox')] + interpreter_flags
         self.language = 'c'
         self.tests = {
             TEST_DIR: 'pass',
@@ -377,12 +381,16 @@ def run_suite():
 
 
 def print_usage():
-    print("Usage: test.py [-v] [filter]")
+    print("Usage: test.py [--no-jit | --force-jit] [-v] [filter]")
 
 
 def main(args):
     global filter_paths
     global verbose
+    global interpreter_flags
+
+    interpreter_flags = [arg for arg in args if arg in JIT_FLAGS]
+    args = [arg for arg in args if arg not in JIT_FLAGS]
 
     if len(args) > 2:
         print_usage()